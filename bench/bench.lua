@@ -0,0 +1,318 @@
+--
+-- qpb_bench: timings of the binding's hot paths.
+-- each result is one json object per line:
+-- { "name":..., "lua":..., "options":..., "ops":..., "repeat":..., "ns_min":..., "ns_median":... }
+-- ns_* are nanoseconds per operation; ops is the operation count of a single timed run.
+--
+local BENCH= BENCH or { clock= os.clock, options= 0, properties= false, ["repeat"]= 5, scale= 1, filter= "" }
+local load= loadstring or load
+local lua= (jit and jit.version) or _VERSION
+local clock= BENCH.clock
+local floor= math.floor
+
+local function report( name, ops, times )
+  table.sort( times )
+  local median= times[ floor( (#times+1)/2 ) ]
+  io.write( string.format( '{"name":"%s","lua":"%s","options":%d,"ops":%d,"repeat":%d,"ns_min":%.2f,"ns_median":%.2f}\n',
+    name, lua, BENCH.options, ops, #times, times[1]*1e9/ops, median*1e9/ops ) )
+  io.flush()
+end
+
+-- setup() returns run( n ), which performs n operations.
+local function bench( name, ops, setup )
+  if BENCH.filter~="" and not string.find( name, BENCH.filter, 1, true ) then
+    return
+  end
+  ops= math.max( 1, floor( ops * BENCH.scale ) )
+  local run= setup( ops )
+  run( math.max( 1, floor( ops/10 ) ) ) -- warm up
+  local times= {}
+  for r=1,BENCH["repeat"] do
+    collectgarbage( "collect" )
+    local start= clock()
+    run( ops )
+    times[r]= clock() - start
+  end
+  report( name, ops, times )
+end
+
+-- compiles a loop of n repetitions of 'body'; 'm' and 'v' are the loop's upvalues.
+-- ( the loop only keeps them alive if the body refers to them )
+local function loop( body )
+  return assert( load( "local m, v= ...; return function( n ) for i=1,n do " .. body .. " end end" ) )
+end
+
+-- reading a field, or a path of fields, in the style the options allow.
+local function read( path )
+  if BENCH.properties then
+    return "m." .. table.concat( path, "." )
+  end
+  return "m:" .. table.concat( path, "():" ) .. "()"
+end
+
+--------------------------------------------------------------------------------
+-- scalar fields
+local values= {
+  { "i32", "i", 12345 },
+  { "i64", "i", 123456789 },
+  { "u32", "i", 12345 },
+  { "u64", "i", 123456789 },
+  { "dbl", "i*0.5", 1.5 },
+  { "flt", "i*0.5", 1.5 },
+  { "flag", "true", true },
+  { "str", "v", "hello world" },
+  { "raw", "v", "\0\1\2\3" },
+  { "kind", "v", "K_ONE" },
+}
+
+local function scalars()
+  local m= QPB.new( "Scalars" )
+  for _, f in ipairs( values ) do
+    m["set_" .. f[1]]( m, f[3] )
+  end
+  return m
+end
+
+for _, f in ipairs( values ) do
+  bench( "get." .. f[1], 1000000, function()
+    return loop( "local x= " .. read( { f[1] } ) )( scalars() )
+  end )
+end
+for _, f in ipairs( values ) do
+  bench( "set." .. f[1], 1000000, function()
+    return loop( "m:set_" .. f[1] .. "( " .. f[2] .. " )" )( scalars(), f[3] )
+  end )
+end
+bench( "set.kind_number", 1000000, function()
+  return loop( "m:set_kind( 1 )" )( scalars() )
+end )
+bench( "assign.i32", 1000000, function()
+  return loop( "m.i32= i" )( scalars() )
+end )
+bench( "has.i32", 1000000, function()
+  return loop( "local x= m:has_i32()" )( scalars() )
+end )
+
+--------------------------------------------------------------------------------
+-- sub-messages
+local function chain( depth )
+  local r= QPB.new( "Record" )
+  local node= r:mutable_chain()
+  for d=2,depth do
+    node= node:mutable_next()
+  end
+  node:set_v( depth )
+  return r
+end
+
+for _, depth in ipairs( { 1, 4, 8 } ) do
+  bench( "sub.depth" .. depth, 200000, function()
+    local path= { "chain" }
+    for d=2,depth do
+      path[#path+1]= "next"
+    end
+    path[#path+1]= "v"
+    return loop( "local x= " .. read( path ) )( chain( depth ) )
+  end )
+end
+bench( "sub.mutable", 1000000, function()
+  return loop( "local x= m:mutable_scalars()" )( QPB.new( "Record" ) )
+end )
+
+--------------------------------------------------------------------------------
+-- repeated fields; each element visited is one operation.
+local SIZE= 1000
+
+local function record()
+  local r= QPB.new( "Record" )
+  r:set_id( 1 )
+  r:set_name( "record" )
+  for i=1,SIZE do
+    r:add_ints( i )
+    r:add_doubles( i*0.5 )
+    r:add_strings( "s" .. i )
+    local item= r:add_items()
+    item:set_i32( i )
+    item:set_str( "item" )
+  end
+  r:mutable_scalars():set_i32( 1 )
+  return r
+end
+
+-- n element visits, as whole passes over an array of SIZE elements
+local function passes( body )
+  return assert( load( [[
+    local m, v= ...
+    return function( n )
+      local a= m
+      for pass=1,math.ceil( n/]] .. SIZE .. [[ ) do
+        ]] .. body .. [[
+      end
+    end]] ) )
+end
+
+local arrays= {
+  { "int32", "mutable_ints" },
+  { "double", "mutable_doubles" },
+  { "string", "mutable_strings" },
+  { "message", "mutable_items" },
+}
+for _, a in ipairs( arrays ) do
+  local function array()
+    local r= record()
+    return r[a[2]]( r ), r
+  end
+  bench( "array.index." .. a[1], 1000000, function()
+    return passes( "for i=1,#a do local x= a[i] end" )( array() )
+  end )
+  bench( "array.values." .. a[1], 1000000, function()
+    return passes( "for x in a:values() do end" )( array() )
+  end )
+  bench( "array.ipairs." .. a[1], 1000000, function()
+    return passes( "for i, x in QPB.ipairs( a ) do end" )( array() )
+  end )
+  bench( "array.slice." .. a[1], 1000000, function()
+    return passes( "local t= a:slice( 1, #a, true )" )( array() )
+  end )
+end
+bench( "array.set.int32", 1000000, function()
+  return passes( "for i=1,#a do a[i]= i end" )( record():mutable_ints() )
+end )
+bench( "array.add.int32", 1000000, function()
+  return passes( "a:extend( v )" )( QPB.new( "Record" ):mutable_ints(), ( record():mutable_ints():slice( 1, SIZE, true ) ) )
+end )
+
+-- a large bytes field: each get copies it into a new lua string, a view reads it in place.
+local blob= QPB.new( "Scalars" )
+blob:set_raw( string.rep( "\0\1\2\3", 65536 ) )
+bench( "blob.get", 1000, function()
+  return loop( "local x= #" .. read( { "raw" } ) )( blob )
+end )
+bench( "blob.view", 1000, function()
+  return loop( "local x= #m:view_raw()" )( blob )
+end )
+
+-- growing a bytes field a chunk at a time: set copies the whole value each time, a builder appends in place.
+local chunk= string.rep( "\0\1\2\3", 256 )
+bench( "blob.set_concat", 10000, function()
+  return loop( "if i%256==1 then m:set_raw( '' ) end m:set_raw( " .. read( { "raw" } ) .. " .. v )" )( QPB.new( "Scalars" ), chunk )
+end )
+bench( "blob.append", 10000, function()
+  return loop( "if i%256==1 then m:set_raw( '' ) end m:mutable_raw():append( v )" )( QPB.new( "Scalars" ), chunk )
+end )
+
+-- keyed access to a map of SIZE entries goes through protobuf's hashed map
+local keys= {}
+for i=1,SIZE do
+  keys[i]= "key" .. i
+end
+local function map()
+  local r= QPB.new( "Record" )
+  local a= r:mutable_attrs()
+  for i=1,SIZE do
+    a[keys[i]]= i
+  end
+  return a, r
+end
+bench( "map.get", 1000000, function()
+  return loop( "local x= m[v[i%" .. SIZE .. "+1]]" )( map(), keys )
+end )
+bench( "map.set", 1000000, function()
+  return loop( "m[v[i%" .. SIZE .. "+1]]= i" )( map(), keys )
+end )
+bench( "map.pairs", 1000000, function()
+  return passes( "for k, x in QPB.pairs( a ) do end" )( map() )
+end )
+
+--------------------------------------------------------------------------------
+-- whole messages
+local filled= record()
+local bytes= QPB.encode( filled )
+
+bench( "table.to_table", 200, function()
+  return loop( "local t= m:to_table()" )( filled )
+end )
+bench( "table.to_table_reuse", 200, function()
+  return loop( "m:to_table( v )" )( filled, filled:to_table() )
+end )
+bench( "table.from_table", 200, function()
+  return loop( "local r= QPB.from_table( 'Record', v )" )( nil, filled:to_table() )
+end )
+bench( "wire.encode", 2000, function()
+  return loop( "local s= QPB.encode( m )" )( filled )
+end )
+bench( "wire.decode", 2000, function()
+  return loop( "local r= QPB.decode( 'Record', v )" )( nil, bytes )
+end )
+bench( "wire.decode_mask", 2000, function()
+  return loop( "local r= QPB.decode( 'Record', v, { 'id', 'scalars.i32' } )" )( nil, bytes )
+end )
+-- routing: read one header field, then forward the message
+for _, decode in ipairs{ "decode", "decode_lazy" } do
+  bench( "wire.route_" .. decode, 2000, function()
+    return loop( "local m= QPB." .. decode .. "( 'Record', v ) local x= " .. read{ "scalars", "i32" } .. " local s= QPB.encode( m )" )( nil, bytes )
+  end )
+end
+bench( "wire.parse_from", 2000, function()
+  return loop( "m:parse_from( v )" )( QPB.new( "Record" ), bytes )
+end )
+bench( "json.to_json", 2000, function()
+  return loop( "local s= m:to_json()" )( filled )
+end )
+bench( "json.from_json", 2000, function()
+  return loop( "local r= QPB.from_json( 'Record', v )" )( nil, filled:to_json() )
+end )
+
+-- ops count messages; each call converts a whole batch of them on the worker threads.
+local BATCH= 256
+local batch_msgs, batch_bytes= {}, {}
+for i=1,BATCH do
+  batch_msgs[i], batch_bytes[i]= filled, bytes
+end
+local function batches( call, arg )
+  return function( n )
+    for i=1,math.ceil( n/BATCH ) do
+      local r= call( arg )
+    end
+  end
+end
+bench( "wire.encode_batch", 2048, function()
+  return batches( QPB.encode_batch, batch_msgs )
+end )
+bench( "wire.decode_batch", 2048, function()
+  return batches( function( t ) return QPB.decode_batch( 'Record', t ) end, batch_bytes )
+end )
+
+--------------------------------------------------------------------------------
+-- allocation and collection; the collector runs as it normally would.
+local small= QPB.encode( scalars() )
+
+bench( "churn.new", 200000, function()
+  return loop( "local r= QPB.new( 'Record' )" )()
+end )
+bench( "churn.new_sub", 200000, function()
+  return loop( "local r= QPB.new( 'Record' ):mutable_scalars()" )()
+end )
+bench( "churn.decode", 200000, function()
+  return loop( "local r= QPB.decode( 'Scalars', v )" )( nil, small )
+end )
+bench( "churn.arena", 200000, function()
+  return loop( "local r= v:new( 'Record' )" )( nil, QPB.arena() )
+end )
+
+-- a full collection with many messages, and handles to their sub-messages, alive.
+local LIVE= 10000
+local function live()
+  local t= {}
+  for i=1,LIVE do
+    local r= QPB.new( "Record" )
+    t[i]= { r, r:mutable_scalars() }
+  end
+  return t
+end
+bench( "gc.full_live", 20, function()
+  return loop( "collectgarbage( 'collect' ); local keep= m" )( live() )
+end )
+bench( "gc.churn_live", 200000, function()
+  return loop( "local r= QPB.new( 'Record' ):mutable_scalars(); local keep= m" )( live() )
+end )
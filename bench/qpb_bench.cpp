@@ -0,0 +1,111 @@
+/**
+ * @file qpb_bench.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ *
+ * runs bench.lua against a lua_State with the bench.proto messages registered.
+ * every result is printed as one json object per line, see bench.lua.
+ *
+ * usage: qpb_bench [--options n] [--repeat n] [--scale x] [--filter text] [script.lua]
+ */
+#include "qpb/qpb.h"
+#include "qpb/qpb_lua.h"
+#include "bench.pb.h"
+extern "C" {
+#include <lualib.h>
+}
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#ifndef QPB_BENCH_SCRIPT
+#define QPB_BENCH_SCRIPT "bench.lua"
+#endif
+
+//---------------------------------------------------------------------------
+// seconds from a monotonic clock; os.clock() is cpu time, and coarse on some platforms.
+static int bench_clock( lua_State* L )
+{
+  typedef std::chrono::steady_clock clock;
+  const double now= std::chrono::duration<double>( clock::now().time_since_epoch() ).count();
+  lua_pushnumber( L, now );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+static int usage( const char * name )
+{
+  fprintf( stderr, "usage: %s [--options n] [--repeat n] [--scale x] [--filter text] [script.lua]\n", name );
+  return 2;
+}
+
+//---------------------------------------------------------------------------
+int main( int argc, char ** argv )
+{
+  int options= 0;
+  int repeat= 5;
+  double scale= 1.0;
+  const char * filter= "";
+  const char * script= QPB_BENCH_SCRIPT;
+  for (int i=1; i< argc; ++i) {
+    const char * arg= argv[i];
+    const bool has_value= i+1 < argc;
+    if (!strcmp( arg, "--options" ) && has_value) {
+      options= atoi( argv[++i] );
+    }
+    else if (!strcmp( arg, "--repeat" ) && has_value) {
+      repeat= atoi( argv[++i] );
+    }
+    else if (!strcmp( arg, "--scale" ) && has_value) {
+      scale= atof( argv[++i] );
+    }
+    else if (!strcmp( arg, "--filter" ) && has_value) {
+      filter= argv[++i];
+    }
+    else if (arg[0]=='-') {
+      return usage( argv[0] );
+    }
+    else {
+      script= arg;
+    }
+  }
+  if (repeat < 1 || scale <= 0) {
+    return usage( argv[0] );
+  }
+
+  int ret=0;
+  // qpb outlives the state, so the messages' finalizers can still reach it.
+  Qpb qpb( options );
+  lua_State * L= luaL_newstate();
+  luaL_openlibs( L );
+  const google::protobuf::Descriptor * descs[]= { bench::Record::descriptor() };
+  qpb.register_descriptors( L, descs, 1 );
+
+  lua_createtable( L, 0, 6 );
+  lua_pushcfunction( L, bench_clock );
+  lua_setfield( L, -2, "clock" );
+  lua_pushinteger( L, options );
+  lua_setfield( L, -2, "options" );
+  lua_pushboolean( L, (options & QPB_FIELD_PROPERTIES)!=0 );
+  lua_setfield( L, -2, "properties" );
+  lua_pushinteger( L, repeat );
+  lua_setfield( L, -2, "repeat" );
+  lua_pushnumber( L, scale );
+  lua_setfield( L, -2, "scale" );
+  lua_pushstring( L, filter );
+  lua_setfield( L, -2, "filter" );
+  lua_setglobal( L, "BENCH" );
+
+  if (luaL_loadfile( L, script ) || lua_pcall( L, 0, 0, 0 )) {
+    fprintf( stderr, "%s\n", lua_tostring( L, -1 ) );
+    ret=1;
+  }
+  lua_close( L );
+  return ret;
+}
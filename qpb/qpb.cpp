@@ -10,13 +10,23 @@
  */
 #include "qpb.h"
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
 #include "qpb_array.h"
 #include "qpb_message.h"
+#include "qpb_arena.h"
+#include "qpb_table.h"
+#include "qpb_json.h"
+#include "qpb_mask.h"
+#include "qpb_view.h"
+#include "qpb_map.h"
+#include "qpb_stream.h"
+#include "qpb_pool.h"
+#include "qpb_stats.h"
+#include "qpb_workers.h"
 
-extern "C" {
-#include <lua.h>
-#include <lauxlib.h>
-}
+#include "qpb_lua.h"
 
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/message.h>
@@ -25,17 +35,8 @@ extern "C" {
 
 using namespace google::protobuf;
 
-//---------------------------------------------------------------------------
-#define MATCH(key, a,b,c) (key[0] ==a && key[1] ==b && key[2] ==c && key[3] =='_')
-
 //---------------------------------------------------------------------------
 // pb arrays from lua to c++ 
-//---------------------------------------------------------------------------
-static int qpb_array_collect( lua_State * L ) {
-  QpbArray * array= QpbArray::GetUserData(L);
-  return array->collect(L);
-}
-
 //---------------------------------------------------------------------------
 static int qpb_array_set( lua_State * L ) { 
   QpbArray * array= QpbArray::GetUserData(L);
@@ -54,6 +55,127 @@ static int qpb_array_size( lua_State * L ) {
   return array->size( L );
 }
 
+//---------------------------------------------------------------------------
+static int qpb_array_slice( lua_State * L ) { 
+  QpbArray * array= QpbArray::GetUserData(L);
+  return array->slice( L );
+}
+
+//---------------------------------------------------------------------------
+static int qpb_array_extend( lua_State * L ) { 
+  QpbArray * array= QpbArray::GetUserData(L);
+  return array->extend( L );
+}
+
+//---------------------------------------------------------------------------
+static int qpb_array_reserve( lua_State * L ) { 
+  QpbArray * array= QpbArray::GetUserData(L);
+  return array->reserve( L );
+}
+
+//---------------------------------------------------------------------------
+static int qpb_array_fill( lua_State * L ) { 
+  QpbArray * array= QpbArray::GetUserData(L);
+  return array->fill( L );
+}
+
+//---------------------------------------------------------------------------
+// for i,v in ipairs( a ), for i,v in pairs( a )
+static int qpb_array_ipairs( lua_State * L ) { 
+  QpbArray * array= QpbArray::GetUserData(L);
+  return array->iterate( L, true );
+}
+
+//---------------------------------------------------------------------------
+// for v in a:values()
+static int qpb_array_values( lua_State * L ) { 
+  QpbArray * array= QpbArray::GetUserData(L);
+  return array->iterate( L, false );
+}
+
+//---------------------------------------------------------------------------
+// pb maps from lua to c++
+//---------------------------------------------------------------------------
+
+// m[key]
+static int qpb_map_get( lua_State * L ) {
+  return QpbMap::GetUserData(L)->get( L );
+}
+
+// m[key]= value
+static int qpb_map_set( lua_State * L ) {
+  return QpbMap::GetUserData(L)->set( L );
+}
+
+// #m
+static int qpb_map_size( lua_State * L ) {
+  return QpbMap::GetUserData(L)->size( L );
+}
+
+// for k,v in pairs( m )
+static int qpb_map_pairs( lua_State * L ) {
+  return QpbMap::GetUserData(L)->iterate( L );
+}
+
+// print( m )
+static int qpb_map_to_string( lua_State * L ) {
+  return QpbMap::GetUserData(L)->to_string( L );
+}
+
+//---------------------------------------------------------------------------
+// string views from lua to c++
+//---------------------------------------------------------------------------
+
+// #view
+static int qpb_view_size( lua_State * L ) {
+  return QpbView::GetUserData(L)->size( L );
+}
+
+// view:sub( [i [, j]] )
+static int qpb_view_sub( lua_State * L ) {
+  return QpbView::GetUserData(L)->sub( L );
+}
+
+// view:byte( [i [, j]] )
+static int qpb_view_byte( lua_State * L ) {
+  return QpbView::GetUserData(L)->byte( L );
+}
+
+// view:find( text [, init] )
+static int qpb_view_find( lua_State * L ) {
+  return QpbView::GetUserData(L)->find( L );
+}
+
+// view:write( fd or file )
+static int qpb_view_write( lua_State * L ) {
+  return QpbView::GetUserData(L)->write( L );
+}
+
+// print( view )
+static int qpb_view_to_string( lua_State * L ) {
+  return QpbView::GetUserData(L)->to_string( L );
+}
+
+// builder:append( text, ... )
+static int qpb_view_append( lua_State * L ) {
+  return QpbView::GetUserData(L)->append( L );
+}
+
+// builder:reserve( n )
+static int qpb_view_reserve( lua_State * L ) {
+  return QpbView::GetUserData(L)->reserve( L );
+}
+
+// builder:truncate( n )
+static int qpb_view_truncate( lua_State * L ) {
+  return QpbView::GetUserData(L)->truncate( L );
+}
+
+// builder:write_at( i, text )
+static int qpb_view_write_at( lua_State * L ) {
+  return QpbView::GetUserData(L)->write_at( L );
+}
+
 //---------------------------------------------------------------------------
 // print( pb )
 static int qpb_array_to_string( lua_State * L ) {
@@ -71,15 +193,22 @@ static int qpb_array_index( lua_State * L )
   QpbArray * array= QpbArray::GetUserData(L);
   // if its a number ( not simply convertible )
   // treat it like a normal indexed get
+  // past either end reads nil, like a table; lua 5.3's ipairs relies on that to stop.
   if (lua_type(L,2)==LUA_TNUMBER) {
-    array->get(L);
+    const int index= (int) lua_tointeger(L,2);
+    if (index>=1 && index<=array->size()) {
+      array->get_raw(L, index);
+    }
+    else {
+      lua_pushnil(L);
+    }
   }
   else 
   // if its a string key ( not simply convertible )
   // look up in the metatable the named function
   if (lua_type(L,2)==LUA_TSTRING) {
     lua_getmetatable( L,1 ); // we know its the right table or we wouldnt be here
-    lua_pushvalue( L,2 ),lua_gettable( L,1 );  // push table[key], 
+    lua_pushvalue( L,2 ),lua_rawget( L,-2 );  // push metatable[key], 
     lua_remove( L, -2 ); // remove the metatable, leaving whatever we had, func or nil
   }
   return 1;
@@ -105,12 +234,16 @@ static int qpb_next( lua_State * L ) {
 }
 
 // for _i,<val> in qpb.ipairs( msg:array )
+// same as ipairs( msg:array ), for luas that ignore __ipairs
 static int qpb_ipairs( lua_State * L )  {
   QpbArray * array= QpbArray::GetUserData(L, QPB_ARRAY_IPAIRS);
-  lua_pushcfunction( L, qpb_next ); // iterator function
-  lua_pushvalue(L,  QPB_ARRAY_IPAIRS ); // invarient
-  lua_pushinteger(L, 0 ); // initial value
-  return 3;
+  return array->iterate( L, true );
+}
+
+// for k,v in qpb.pairs( msg:map )
+// same as pairs( msg:map ), for luas that ignore __pairs
+static int qpb_pairs( lua_State * L )  {
+  return QpbMap::GetUserData(L, QPB_MAP_PAIRS)->iterate( L );
 }
 
 // return the owner index of the passed message
@@ -128,14 +261,213 @@ static int qpb_alloc( lua_State * L ) {
   return qpb->alloc(L);
 }
 
+// pb= qpb.decode( name, bytes [, mask] );
+static int qpb_decode( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  return qpb->decode(L);
+}
+
+// pb= qpb.decode_lazy( name, bytes );
+static int qpb_decode_lazy( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  return qpb->decode_lazy(L);
+}
+
+// pbs= qpb.decode_batch( name, { bytes, ... } );
+static int qpb_decode_batch( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  return qpb->decode_batch(L);
+}
+
+// { bytes, ... }= qpb.encode_batch( { pb, ... } );
+static int qpb_encode_batch( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  return qpb->encode_batch(L);
+}
+
+// pb= qpb.from_table( name, t );
+static int qpb_from_table( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  return qpb->from_table(L);
+}
+
+// pb= qpb.from_json( name, json );
+static int qpb_from_json( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  return qpb->from_json(L);
+}
+
+// values= qpb.enum( name ); values.RED == 0
+static int qpb_enum( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  return qpb->enum_values(L);
+}
+
+// token= qpb.detach( pb );
+static int qpb_detach( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  return qpb->detach(L);
+}
+
+// pb= qpb.attach( token );
+static int qpb_attach( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  return qpb->attach(L);
+}
+
+// stats= qpb.pool_stats(); stats.hits, stats.misses, ...
+static int qpb_pool_stats( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  return qpb->pool_stats(L);
+}
+
+// stats= qpb.stats(); stats.bytes_encoded, stats.fields[ "Person.name" ], ...
+static int qpb_stats( lua_State * L ) {
+#ifdef QPB_STATS
+  return QpbStats::Push(L);
+#else
+  lua_createtable( L, 0, 1 );
+  lua_pushboolean( L, 0 );
+  lua_setfield( L, -2, "enabled" );
+  return 1;
+#endif
+}
+
+// qpb.reset_stats();
+static int qpb_reset_stats( lua_State * L ) {
+#ifdef QPB_STATS
+  QpbStats::Reset();
+#endif
+  return 0;
+}
+
+// arena= qpb.arena();
+static int qpb_arena( lua_State * L ) {
+  return QpbArenaScope::PushScope(L);
+}
+
+// bytes= qpb.encode( pb );
+static int qpb_encode( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L, QPB_ENCODE_MESSAGE);
+  return msg->encode(L);
+}
+
+//---------------------------------------------------------------------------
+// arena scopes from lua to c++ 
+//---------------------------------------------------------------------------
+
+// delete arena, or arena:close()
+static int qpb_arena_close( lua_State * L ) {
+  QpbArenaScope* scope= QpbArenaScope::GetUserData(L);
+  return scope->close(L);
+}
+
+// print( arena )
+static int qpb_arena_to_string( lua_State * L ) {
+  QpbArenaScope* scope= QpbArenaScope::GetUserData(L);
+  return scope->to_string(L);
+}
+
+// pb= arena:new( name )
+static int qpb_arena_alloc( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  QpbArena* arena= QpbArenaScope::GetUserData(L)->arena(L);
+  lua_remove( L, QPB_ARENA_SELF ); // leaves the same parameters as qpb.new
+  return qpb->alloc(L, arena);
+}
+
+// pb= arena:decode( name, bytes [, mask] )
+static int qpb_arena_decode( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  QpbArena* arena= QpbArenaScope::GetUserData(L)->arena(L);
+  lua_remove( L, QPB_ARENA_SELF ); // leaves the same parameters as qpb.decode
+  return qpb->decode(L, arena);
+}
+
+// reader= qpb.reader( path_or_fd, name )
+static int qpb_reader( lua_State * L ) {
+  Qpb*qpb= Qpb::GetUpValue(L);
+  return qpb->reader(L);
+}
+
+// writer= qpb.writer( path_or_fd )
+static int qpb_writer( lua_State * L ) {
+  return QpbWriter::PushWriter(L);
+}
+
+//---------------------------------------------------------------------------
+// readers and writers from lua to c++ 
+//---------------------------------------------------------------------------
+static int qpb_reader_close( lua_State * L ) {
+  QpbReader* reader= QpbReader::GetUserData(L);
+  return reader->close(L);
+}
+
+static int qpb_reader_to_string( lua_State * L ) {
+  QpbReader* reader= QpbReader::GetUserData(L);
+  return reader->to_string(L);
+}
+
+// pb= reader:read()
+static int qpb_reader_read( lua_State * L ) {
+  QpbReader* reader= QpbReader::GetUserData(L);
+  return reader->read(L);
+}
+
+// pb= reader:message()
+static int qpb_reader_message( lua_State * L ) {
+  QpbReader* reader= QpbReader::GetUserData(L);
+  return reader->message(L);
+}
+
+// for pb in reader:records() do
+static int qpb_reader_records( lua_State * L ) {
+  QpbReader::GetUserData(L);
+  lua_pushcfunction( L, qpb_reader_read ); // iterator function
+  lua_pushvalue( L, QPB_STREAM_SELF ); // invarient
+  return 2;
+}
+
+static int qpb_writer_close( lua_State * L ) {
+  QpbWriter* writer= QpbWriter::GetUserData(L);
+  return writer->close(L);
+}
+
+static int qpb_writer_to_string( lua_State * L ) {
+  QpbWriter* writer= QpbWriter::GetUserData(L);
+  return writer->to_string(L);
+}
+
+// writer:write( pb )
+static int qpb_writer_write( lua_State * L ) {
+  QpbWriter* writer= QpbWriter::GetUserData(L);
+  return writer->write(L);
+}
+
+static int qpb_writer_flush( lua_State * L ) {
+  QpbWriter* writer= QpbWriter::GetUserData(L);
+  return writer->flush(L);
+}
+
 //---------------------------------------------------------------------------
 // pb messages from lua to c++ 
 //---------------------------------------------------------------------------
 
+// any use of a detached handle
+static int qpb_detached( lua_State * L ){
+  return QPB_ERR_DETACHED(L);
+}
+
+static int qpb_detached_to_string( lua_State * L ){
+  lua_pushfstring( L, "qpb: %p - detached", lua_touserdata( L, 1 ) );
+  return 1;
+}
+
 // delete pb
 static int qpb_msg_collect( lua_State * L ){
+  Qpb*qpb= Qpb::GetUpValue(L);
   QpbMessage* msg= QpbMessage::GetUserData(L);
-  return msg->collect(L);
+  return msg->collect(L, qpb->pool());
 }
 
 // print( pb )
@@ -144,36 +476,257 @@ static int qpb_msg_to_string( lua_State * L ) {
   return msg->to_string(L);
 }
 
-// pb:unknown_field()
-static int qpb_parse_closure( lua_State * L ) {
-  Qpb*qpb= Qpb::GetUpValue(L);
-  return qpb->parse_closure(L);
+// t= pb:to_table( [t] )
+static int qpb_msg_to_table( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  return msg->to_table( L );
+}
+
+// json= pb:to_json( [options] )
+static int qpb_msg_to_json( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  return msg->to_json( L );
+}
+
+// pb:merge_table( t )
+static int qpb_msg_merge_table( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  QpbMessage::Modified( L, QPB_MESSAGE_SELF, true );
+  return msg->merge_table( L, QPB_MERGE_TABLE_VALUE );
+}
+
+// pb:parse_from( bytes [, mask] )
+static int qpb_msg_parse_from( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  luaL_checktype( L, QPB_PARSE_BYTES, LUA_TSTRING );
+  const QpbFieldMask* mask= 0;
+  if (!lua_isnoneornil( L, QPB_PARSE_MASK )) {
+    mask= Qpb::GetUpValue(L)->mask( L, msg->GetDescriptor(), QPB_PARSE_MASK );
+  }
+  QpbMessage::Modified( L, QPB_MESSAGE_SELF, true );
+  return msg->parse( L, QPB_PARSE_BYTES, mask );
 }
 
 // pb.unknown_field
-static int qpb_msg_index( lua_State * L ) 
+// the per-type method table only misses for names that aren't fields of the message
+static int qpb_msg_unknown( lua_State * L ) 
 {
-  Qpb*qpb= Qpb::GetUpValue(L);
-  lua_pushlightuserdata( L, qpb );  // prepares the QPB_CLASS_UPVALUE
-  lua_pushvalue( L, QPB_META_FIELD ); // prepares the QPB_FIELD_UPVALUE
-  lua_pushcclosure( L, qpb_parse_closure, 2 ); // closure with 2 upvalues, pops values.
-  return 1;
+  const char * key= lua_tostring( L, QPB_META_FIELD );
+  return QPB_ERR_FIELD( L, key ? key : "?" );
+}
+
+//---------------------------------------------------------------------------
+// pb_a.set_field( pb_b, value ) would otherwise hand reflection a field from the wrong type
+static const FieldDescriptor* qpb_checkfield( lua_State * L, const QpbMessage* msg, const FieldDescriptor* field ) 
+{
+  if (field->containing_type() != msg->GetDescriptor()) {
+    QPB_ERR_MESSAGE( L, msg->GetDescriptor()->full_name().c_str() );
+  }
+  return field;
+}
+
+//---------------------------------------------------------------------------
+// lookup the field named by the key in the per-type table held as an upvalue
+// returns NULL if the name isn't a field; the looked up value is left on the stack.
+static const FieldDescriptor* qpb_lookup( lua_State * L ) 
+{
+  lua_pushvalue( L, QPB_META_FIELD );
+  lua_rawget( L, lua_upvalueindex( QPB_FIELDS_UPVALUE ) );
+  return (const FieldDescriptor*) (lua_islightuserdata( L, -1 ) ? lua_touserdata( L, -1 ) : 0);
+}
+
+// pb.field, when qpb was created with QPB_FIELD_PROPERTIES
+// methods are still found by name, plain field names read the value.
+static int qpb_msg_property( lua_State * L ) 
+{
+  int ret=1;
+  const FieldDescriptor* field= qpb_lookup( L );
+  if (field) {
+    QpbMessage* msg= QpbMessage::GetUserData(L);
+    lua_settop( L, QPB_MESSAGE_SELF );
+    QPB_STAT_ACCESS( op_property, field );
+    ret= QPB_STAT_DONE( msg->property( L, qpb_checkfield( L, msg, field ) ) );
+  }
+  else 
+  if (lua_isnil( L, -1 )) {
+    ret= qpb_msg_unknown( L );
+  }
+  return ret;
+}
+
+// pb.field= value
+static int qpb_msg_assign( lua_State * L ) 
+{
+  int ret=0;
+  const FieldDescriptor* field= qpb_lookup( L );
+  if (!field) {
+    ret= qpb_msg_unknown( L );
+  }
+  else {
+    QpbMessage* msg= QpbMessage::GetUserData(L);
+    lua_settop( L, QPB_META_VALUE );
+    lua_remove( L, QPB_META_FIELD ); // leaves ( pb, value ), the same as pb:set_field( value )
+    QPB_STAT_ACCESS( op_assign, field );
+    ret= QPB_STAT_DONE( msg->assign( L, qpb_checkfield( L, msg, field ) ) );
+  }
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// pre-bound field methods:
+// each closure carries the FieldDescriptor it was registered for,
+// and the name of the method decides which operation it performs.
+//---------------------------------------------------------------------------
+static const FieldDescriptor* qpb_upfield( lua_State * L, const QpbMessage* msg ) 
+{
+  const FieldDescriptor* field= (const FieldDescriptor*) lua_touserdata( L, lua_upvalueindex( QPB_FIELD_UPVALUE ) );
+  return qpb_checkfield( L, msg, field );
+}
+
+// pb:field(), pb:field( index )
+static int qpb_field_get( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  const FieldDescriptor* field= qpb_upfield( L, msg );
+  QPB_STAT_ACCESS( op_get, field );
+  return QPB_STAT_DONE( msg->get( L, field ) );
+}
+
+// pb:has_field()
+static int qpb_field_has( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  const FieldDescriptor* field= qpb_upfield( L, msg );
+  QPB_STAT_ACCESS( op_has, field );
+  return QPB_STAT_DONE( msg->has( L, field ) );
+}
+
+// pb:set_field( value ), pb:set_field( index, value )
+static int qpb_field_set( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  const FieldDescriptor* field= qpb_upfield( L, msg );
+  QPB_STAT_ACCESS( op_set, field );
+  return QPB_STAT_DONE( msg->set( L, field ) );
+}
+
+// pb:add_field( value )
+static int qpb_field_add( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  const FieldDescriptor* field= qpb_upfield( L, msg );
+  QPB_STAT_ACCESS( op_add, field );
+  return QPB_STAT_DONE( msg->add( L, field ) );
+}
+
+// pb:field_size()
+static int qpb_field_size( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  const FieldDescriptor* field= qpb_upfield( L, msg );
+  QPB_STAT_ACCESS( op_size, field );
+  return QPB_STAT_DONE( msg->size( L, field ) );
+}
+
+// pb:clear_field()
+static int qpb_field_clear( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  const FieldDescriptor* field= qpb_upfield( L, msg );
+  QPB_STAT_ACCESS( op_clear, field );
+  return QPB_STAT_DONE( msg->clear( L, field ) );
+}
+
+// pb:mutable_field(), pb:mutable_field( index )
+static int qpb_field_mutable( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  const FieldDescriptor* field= qpb_upfield( L, msg );
+  QPB_STAT_ACCESS( op_mutable, field );
+  return QPB_STAT_DONE( msg->get_mutable( L, field ) );
+}
+
+// pb:release_field()
+static int qpb_field_release( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  const FieldDescriptor* field= qpb_upfield( L, msg );
+  QPB_STAT_ACCESS( op_release, field );
+  return QPB_STAT_DONE( msg->release( L, field ) );
+}
+
+// pb:view_field(), pb:view_field( index )
+static int qpb_field_view( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  const FieldDescriptor* field= qpb_upfield( L, msg );
+  QPB_STAT_ACCESS( op_view, field );
+  return QPB_STAT_DONE( msg->view( L, field ) );
+}
+
+// pb:set_allocated_field( child )
+static int qpb_field_set_allocated( lua_State * L ) {
+  QpbMessage* msg= QpbMessage::GetUserData(L);
+  const FieldDescriptor* field= qpb_upfield( L, msg );
+  QPB_STAT_ACCESS( op_set_allocated, field );
+  return QPB_STAT_DONE( msg->set_allocated( L, field ) );
 }
 
+// https://developers.google.com/protocol-buffers/docs/reference/cpp-generated#message
+// the methods are registered in this order, and a later name replaces an earlier one.
+// so, the same as the old string parsing, 'has_foo' is has( foo ) even if there's a field named 'has_foo'
+static const struct QpbFieldOp {
+  const char * prefix;
+  const char * suffix;
+  lua_CFunction func;
+} qpb_field_ops[]= {
+  { "",         "",      qpb_field_get }, // plain name: a value get, an array proxy get, or array index get.
+  { "set_allocated_", "", qpb_field_set_allocated },
+  { "release_", "",      qpb_field_release },
+  { "mutable_", "",      qpb_field_mutable },
+  { "clear_",   "",      qpb_field_clear },
+  { "",         "_size", qpb_field_size },
+  { "add_",     "",      qpb_field_add },
+  { "set_",     "",      qpb_field_set },
+  { "has_",     "",      qpb_field_has },
+  { "view_",    "",      qpb_field_view }, // string and bytes fields only
+  { 0 }
+};
+
 //---------------------------------------------------------------------------
 // Qpb
 //---------------------------------------------------------------------------
 Qpb::~Qpb() 
 {
+  delete _workers;
+  for (mask_map::iterator it= _masks.begin(); it!= _masks.end(); ++it) {
+    delete it->second;
+  }
+  // pooled and unclaimed messages belong to the factory's prototypes
+  for (token_map::iterator it= _tokens.begin(); it!= _tokens.end(); ++it) {
+    delete it->second;
+  }
+  delete _pool;
   if (_factory) {
     delete _factory;
   }
 }
 
 //---------------------------------------------------------------------------
-Qpb::Qpb() 
-  : _factory(0)
+Qpb::Qpb( int options ) 
+  : _factory( new DynamicMessageFactory() )
+  , _pool( (options & QPB_MESSAGE_POOL) ? new QpbPool( 16 ) : 0 )
+  , _workers( 0 )
+  , _batch_threads( std::max( (int) std::thread::hardware_concurrency()-1, 0 ) )
+  , _options(options)
+  , _last_token(0)
+{
+}
+
+//---------------------------------------------------------------------------
+void Qpb::set_batch_threads( int threads )
+{
+  std::lock_guard<std::mutex> lock( _lock );
+  _batch_threads= threads;
+}
+
+//---------------------------------------------------------------------------
+void Qpb::set_pool_limit( int limit )
 {
+  if (_pool) {
+    _pool->SetLimit( limit );
+  }
 }
 
 //---------------------------------------------------------------------------
@@ -184,17 +737,10 @@ Qpb * Qpb::GetUpValue( lua_State * L )
 }
 
 //---------------------------------------------------------------------------
-/**
- * allocate a new QpbMessage as userdata, return it to the user
- */
-int Qpb::alloc(lua_State*L) const
+// find a registered type by its full name, or failing that its short name
+const Qpb::Descriptor* Qpb::find( const char * name ) const
 {
-  int ret=0;
-  
-  // name of pb type
-  const char * name= luaL_checkstring( L, QPB_NEW_PBNAME );
-
-  // find the type
+  std::lock_guard<std::mutex> lock( _lock );
   const Descriptor* desc= 0;
   descriptor_map::const_iterator it= _fullnames.find( name );
   if (it != _fullnames.end()) {
@@ -206,110 +752,688 @@ int Qpb::alloc(lua_State*L) const
       desc= it->second;
     }
   }
-
-  if (!desc) {
-      lua_pop( L, -1 );
-      QPB_ERR_TYPE(L,name);
-  }
-  else {
-  // create an instance of the type type
-    const Message* prototype= _factory->GetPrototype( desc );
-    Message * msg= prototype ? prototype->New(): 0;
-    if (!msg) {
-      lua_pop( L, -1 );
-      QPB_ERR_ALLOC(L);
+  if (!desc && (_options & QPB_LAZY_REGISTRATION)) {
+    // by full name, or by name within the package of one of the registered files.
+    for (size_t i=0; !desc && i< _files.size(); ++i) {
+      const FileDescriptor* file= _files[i];
+      desc= file->pool()->FindMessageTypeByName( name );
+      if (!desc && !file->package().empty()) {
+        desc= file->pool()->FindMessageTypeByName( file->package() + "." + name );
+      }
     }
-    else {
-      // return it.
-      ret= QpbMessage::PushMsg( L, msg, QpbMessage::unowned );
-    }      
-  }      
+    if (desc) {
+      _fullnames[ desc->full_name() ]= desc;
+      if (desc->full_name()!=name) {
+        _shortnames[ name ]= desc;
+      }
+    }
+  }
+  return desc;
+}
 
-  return ret;
+//---------------------------------------------------------------------------
+const Qpb::EnumDescriptor* Qpb::find_enum( const char * name ) const
+{
+  std::lock_guard<std::mutex> lock( _lock );
+  const EnumDescriptor* desc= 0;
+  enum_map::const_iterator it= _fullenums.find( name );
+  if (it != _fullenums.end()) {
+      desc= it->second;
+  }
+  else {
+    it= _shortenums.find( name );
+    if (it != _shortenums.end()) {
+      desc= it->second;
+    }
+  }
+  if (!desc && (_options & QPB_LAZY_REGISTRATION)) {
+    for (size_t i=0; !desc && i< _files.size(); ++i) {
+      const FileDescriptor* file= _files[i];
+      desc= file->pool()->FindEnumTypeByName( name );
+      if (!desc && !file->package().empty()) {
+        desc= file->pool()->FindEnumTypeByName( file->package() + "." + name );
+      }
+    }
+    if (desc) {
+      _fullenums[ desc->full_name() ]= desc;
+      if (desc->full_name()!=name) {
+        _shortenums[ name ]= desc;
+      }
+    }
+  }
+  return desc;
 }
 
 //---------------------------------------------------------------------------
-// the unknown field access always returns this function
-// we then expect user data as the first parameter
-// second parameter depends on the operation
-// set takes a value...
+/**
+ * the prototype of the type named at stack index 'name'; raises a lua error for unknown types.
+ * the state's cache maps the names it has already used to their prototypes, 
+ * so the shared maps, and the factory's lock, are only visited once per name and state.
+ */
+const Qpb::Message* Qpb::prototype( lua_State*L, int name ) const
+{
+  const char * str= luaL_checkstring( L, name );
+  lua_rawgetp( L, LUA_REGISTRYINDEX, this );
+  lua_pushvalue( L, name );
+  lua_rawget( L, -2 );
+  const Message* prototype= (const Message*) lua_touserdata( L, -1 );
+  lua_pop( L, 1 );
+  if (!prototype) {
+    const Descriptor* desc= find( str );
+    if (!desc) {
+      QPB_ERR_TYPE(L,str);
+    }
+    prototype= _factory->GetPrototype( desc );
+    if (!prototype) {
+      QPB_ERR_ALLOC(L);
+    }
+    lua_pushvalue( L, name );
+    lua_pushlightuserdata( L, const_cast<Message*>(prototype) );
+    lua_rawset( L, -3 );
+  }
+  lua_pop( L, 1 );
+  return prototype;
+}
+
+//---------------------------------------------------------------------------
+/**
+ * create a new, unowned, message of the type named at stack index 'name'; raises a lua error on failure.
+ */
+Qpb::Message* Qpb::create( lua_State*L, int name, QpbArena* arena ) const
+{
+  Message * msg= 0;
+  const Message* prototype= this->prototype( L, name );
+  {
+    // create an instance of the type type
+    if (prototype && _pool && !arena) {
+      msg= _pool->New( prototype );
+    }
+    else {
+      msg= prototype ? prototype->New( arena ? arena->GetArena() : 0 ): 0;
+    }
+    if (!msg) {
+      QPB_ERR_ALLOC(L);
+    }
+    QPB_STAT( messages_allocated );
+  }      
+  return msg;
+}
 
-#define parselen( x ) (sizeof(x)/sizeof(*x)-1)
-static const char parse_clear[]= "clear_";
-static const char parse_size[]= "_size";
-static const char parse_mute[]="mutable_";
-static const char parse_release[]="release_";
+//---------------------------------------------------------------------------
+/**
+ * allocate a new QpbMessage as userdata, return it to the user
+ */
+int Qpb::alloc(lua_State*L, QpbArena* arena) const
+{
+  // name of pb type
+  Message * msg= create( L, QPB_NEW_PBNAME, arena );
+  // return it.
+  return QpbMessage::PushMsg( L, msg, QpbMessage::unowned, arena );
+}
 
+//---------------------------------------------------------------------------
+/**
+ * allocate a new QpbMessage, and fill it from the wire format string
+ */
+int Qpb::decode(lua_State*L, QpbArena* arena) const
+{
+  luaL_checktype( L, QPB_DECODE_BYTES, LUA_TSTRING );
+  lua_settop( L, QPB_DECODE_MASK ); // the message is pushed after the optional mask
+  Message * msg= create( L, QPB_DECODE_PBNAME, arena );
+  // push first, so that lua owns the message if the parse raises an error
+  QpbMessage::PushMsg( L, msg, QpbMessage::unowned, arena );
+  QpbMessage* handle= QpbMessage::GetUserData( L, -1 );
+  const QpbFieldMask* mask= lua_isnil( L, QPB_DECODE_MASK ) ? 0 : this->mask( L, msg->GetDescriptor(), QPB_DECODE_MASK );
+  handle->parse( L, QPB_DECODE_BYTES, mask );
+  return 1;
+}
 
-// https://developers.google.com/protocol-buffers/docs/reference/cpp-generated#message
-int Qpb::parse_closure(lua_State*L) const
+//---------------------------------------------------------------------------
+/**
+ * allocate a new QpbMessage that parses each of its fields from the wire format string on first use
+ */
+int Qpb::decode_lazy(lua_State*L) const
 {
-  int ret=0;
-  QpbMessage* handle= QpbMessage::GetUserData(L);
-  if (handle) {
-    size_t keylen;
-    const char * key= luaL_checklstring( L, lua_upvalueindex( QPB_FIELD_UPVALUE ), &keylen );
-    if (key) {
-      const int _sizetail=keylen-parselen(parse_size);
-    /**
-     * TODO: 
-     *      enum listings via Foo_descriptor, and Foo_IsValid(int)
-     */
-      if (MATCH(key, 'h','a','s')){
-        const FieldDescriptor*field= handle->field( L, key+4 );
-        ret= handle->has( L, field );
-      }
-      else
-      if (MATCH(key, 's','e','t')){
-        const FieldDescriptor*field= handle->field( L, key+4 );
-        ret= handle->set( L,  field ); 
-      }
-      else
-      if (MATCH(key, 'a','d','d')){
-        const FieldDescriptor*field= handle->field( L, key+4 );
-        ret= handle->add( L,  field );
-      }
-      else
-      if (_sizetail>0 && strcmp(key+_sizetail, "_size")==0) {
-        char* name_nosize= (char*) alloca( _sizetail+1 );
-        if (!name_nosize) {
-          QPB_ERR_ALLOC( L );
+  luaL_checktype( L, QPB_DECODE_LAZY_BYTES, LUA_TSTRING );
+  Message * msg= create( L, QPB_DECODE_LAZY_PBNAME, 0 );
+  QpbMessage::PushMsg( L, msg, QpbMessage::unowned );
+  QpbMessage* handle= QpbMessage::GetUserData( L, -1 );
+  handle->parse_lazy( L, QPB_DECODE_LAZY_BYTES );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+const QpbFieldMask* Qpb::mask( lua_State*L, const Descriptor* desc, int idx ) const
+{
+  idx= lua_absindex( L, idx );
+  luaL_checktype( L, idx, LUA_TTABLE );
+  // the paths, one per line, make the key
+  const int count= (int) lua_rawlen( L, idx );
+  luaL_checkstack( L, 2*count, "QPB: too many paths" );
+  for (int i=1; i<= count; ++i) {
+    lua_rawgeti( L, idx, i );
+    if (lua_type( L, -1 )!=LUA_TSTRING) {
+      luaL_argerror( L, idx, "expected a table of field paths" );
+    }
+    lua_pushliteral( L, "\n" );
+  }
+  lua_concat( L, 2*count );
+  const int key= lua_gettop( L );
+
+  // registry[QPB_MASK_CACHE][desc][key]
+  lua_getfield( L, LUA_REGISTRYINDEX, QPB_MASK_CACHE );
+  if (lua_isnil( L, -1 )) {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, QPB_MASK_CACHE );
+  }
+  lua_rawgetp( L, -1, desc );
+  if (lua_isnil( L, -1 )) {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_pushvalue( L, -1 );
+    lua_rawsetp( L, -3, desc );
+  }
+  const int cache= lua_gettop( L );
+  lua_pushvalue( L, key );
+  lua_rawget( L, cache );
+  const QpbFieldMask* mask= (const QpbFieldMask*) lua_touserdata( L, -1 );
+  lua_pop( L, 1 );
+
+  if (!mask) {
+    {
+      size_t len=0;
+      const char* paths= lua_tolstring( L, key, &len );
+      const mask_map::key_type name( desc, std::string( paths, len ) );
+      std::string bad;
+      {
+        std::lock_guard<std::mutex> lock( _lock );
+        mask_map::const_iterator it= _masks.find( name );
+        if (it!= _masks.end()) {
+          mask= it->second;
         }
         else {
-          strncpy( name_nosize, key, _sizetail );
-          name_nosize[_sizetail]=0;
-          const FieldDescriptor*field= handle->field( L, name_nosize );
-          ret= handle->size( L, field );
-        }              
+          QpbFieldMask* compiled= QpbFieldMask::Compile( desc, name.second, &bad );
+          if (compiled) {
+            _masks[name]= compiled;
+          }
+          mask= compiled;
+        }
       }
-      else
-      if (strncmp(key, parse_clear, parselen(parse_clear))==0) {
-        const FieldDescriptor*field= handle->field( L, key+parselen(parse_clear) );
-        ret= handle->clear( L, field );
+      // pushed once unlocked: a lua error here would otherwise skip the unlock
+      if (!mask) {
+        lua_pushlstring( L, bad.data(), bad.size() );
       }
-      else
-      if (strncmp(key, parse_mute, parselen(parse_mute))==0) {
-        const FieldDescriptor*field= handle->field( L, key+parselen(parse_mute) );
-        ret= handle->get_mutable( L, field );
+    }
+    if (!mask) {
+      QPB_ERR_MASK( L, desc->full_name().c_str(), lua_tostring( L, -1 ) );
+    }
+    lua_pushvalue( L, key );
+    lua_pushlightuserdata( L, const_cast<QpbFieldMask*>( mask ) );
+    lua_rawset( L, cache );
+  }
+  lua_settop( L, key-1 );
+  return mask;
+}
+
+//---------------------------------------------------------------------------
+QpbWorkers* Qpb::workers() const
+{
+  std::lock_guard<std::mutex> lock( _lock );
+  if (!_workers) {
+    _workers= new QpbWorkers( _batch_threads );
+  }
+  return _workers;
+}
+
+//---------------------------------------------------------------------------
+// the per message state of a batch lives in a lua userdata, rather than in c++ containers:
+// lua errors skip c++ destructors, and the batches raise errors of their own.
+struct QpbDecodeJob {
+  google::protobuf::Message* msg;
+  const char* bytes;
+  size_t size;
+  bool parsed;
+};
+
+struct QpbEncodeJob {
+  const google::protobuf::Message* msg;
+  size_t size;
+  char* bytes; // in the batch's buffer, also a userdata
+  bool encoded;
+};
+
+//---------------------------------------------------------------------------
+/**
+ * a table of new QpbMessages, one per wire format string; 
+ * the handles are pushed first, so that lua owns the messages if a parse fails.
+ */
+int Qpb::decode_batch(lua_State*L) const
+{
+  luaL_checktype( L, QPB_DECODE_BATCH_BYTES, LUA_TTABLE );
+  const int count= (int) lua_rawlen( L, QPB_DECODE_BATCH_BYTES );
+  for (int i=0; i< count; ++i) {
+    lua_rawgeti( L, QPB_DECODE_BATCH_BYTES, i+1 );
+    if (lua_type( L, -1 )!=LUA_TSTRING) {
+      luaL_argerror( L, QPB_DECODE_BATCH_BYTES, "expected a table of strings" );
+    }
+    lua_pop( L, 1 );
+  }
+  prototype( L, QPB_DECODE_BATCH_PBNAME ); // raises for unknown types
+  QpbDecodeJob* jobs= (QpbDecodeJob*) lua_newuserdata( L, count * sizeof(QpbDecodeJob) );
+  lua_createtable( L, count, 0 );
+  size_t total=0;
+  for (int i=0; i< count; ++i) {
+    // the strings stay in the table, and lua doesn't move them
+    QpbDecodeJob & job= jobs[i];
+    lua_rawgeti( L, QPB_DECODE_BATCH_BYTES, i+1 );
+    job.bytes= lua_tolstring( L, -1, &job.size );
+    job.parsed= false;
+    total+= job.size;
+    lua_pop( L, 1 );
+    job.msg= create( L, QPB_DECODE_BATCH_PBNAME, 0 );
+    QpbMessage::PushMsg( L, job.msg, QpbMessage::unowned );
+    lua_rawseti( L, -2, i+1 );
+  }
+  workers()->Run( count, [jobs]( int i ) {
+    jobs[i].parsed= jobs[i].msg->ParseFromArray( jobs[i].bytes, (int) jobs[i].size );
+  } );
+  QPB_STAT_ADD( bytes_decoded, total );
+  for (int i=0; i< count; ++i) {
+    if (!jobs[i].parsed) {
+      QPB_ERR_PARSE_BATCH( L, lua_tostring( L, QPB_DECODE_BATCH_PBNAME ), i+1 );
+    }
+  }
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+/**
+ * a table of wire format strings, one per message. 
+ * lua's buffers can't be filled off its own thread: the workers size every message, 
+ * then serialize it into one shared buffer, and each string is copied from there.
+ */
+int Qpb::encode_batch(lua_State*L) const
+{
+  luaL_checktype( L, QPB_ENCODE_BATCH_MESSAGES, LUA_TTABLE );
+  const int count= (int) lua_rawlen( L, QPB_ENCODE_BATCH_MESSAGES );
+  QpbEncodeJob* jobs= (QpbEncodeJob*) lua_newuserdata( L, count * sizeof(QpbEncodeJob) );
+  for (int i=0; i< count; ++i) {
+    // the handles stay in the table, keeping the messages alive
+    lua_rawgeti( L, QPB_ENCODE_BATCH_MESSAGES, i+1 );
+    if (lua_type( L, -1 )!=LUA_TUSERDATA) {
+      luaL_argerror( L, QPB_ENCODE_BATCH_MESSAGES, "expected a table of messages" );
+    }
+    jobs[i].msg= &QpbMessage::GetUserData( L, -1 )->GetMessage( L );
+    jobs[i].encoded= false;
+    lua_pop( L, 1 );
+  }
+  workers()->Run( count, [jobs]( int i ) {
+    jobs[i].encoded= jobs[i].msg->IsInitialized();
+    jobs[i].size= jobs[i].encoded ? jobs[i].msg->ByteSizeLong() : 0;
+  } );
+  size_t total=0;
+  for (int i=0; i< count; ++i) {
+    if (!jobs[i].encoded) {
+      const Message & msg= *jobs[i].msg;
+      lua_pushstring( L, msg.InitializationErrorString().c_str() );
+      QPB_ERR_UNINITIALIZED_BATCH( L, msg.GetDescriptor()->full_name().c_str(), i+1, lua_tostring( L, -1 ) );
+    }
+    total+= jobs[i].size;
+  }
+  char* buffer= (char*) lua_newuserdata( L, total );
+  for (int i=0; i< count; ++i) {
+    jobs[i].bytes= buffer;
+    buffer+= jobs[i].size;
+  }
+  // ByteSizeLong cached the sizes; nothing can change the messages until the copies are made.
+  workers()->Run( count, [jobs]( int i ) {
+    jobs[i].msg->SerializeWithCachedSizesToArray( reinterpret_cast<uint8_t*>( jobs[i].bytes ) );
+  } );
+  lua_createtable( L, count, 0 );
+  for (int i=0; i< count; ++i) {
+    lua_pushlstring( L, jobs[i].bytes, jobs[i].size );
+    lua_rawseti( L, -2, i+1 );
+  }
+  QPB_STAT_ADD( bytes_encoded, total );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+/**
+ * allocate a new QpbMessage, and fill it from a lua table
+ */
+int Qpb::from_table(lua_State*L) const
+{
+  luaL_checktype( L, QPB_FROM_TABLE_VALUE, LUA_TTABLE );
+  Message * msg= create( L, QPB_FROM_TABLE_PBNAME, 0 );
+  // push first, so that lua owns the message if the merge raises an error
+  QpbMessage::PushMsg( L, msg, QpbMessage::unowned );
+  QpbTable::MergeTable( L, msg, QPB_FROM_TABLE_VALUE );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+/**
+ * allocate a new QpbMessage, and fill it from json text
+ */
+int Qpb::from_json(lua_State*L) const
+{
+  luaL_checktype( L, QPB_FROM_JSON_VALUE, LUA_TSTRING );
+  Message * msg= create( L, QPB_FROM_JSON_PBNAME, 0 );
+  // push first, so that lua owns the message if the parse raises an error
+  QpbMessage::PushMsg( L, msg, QpbMessage::unowned );
+  QpbJson::MergeJson( L, msg, QPB_FROM_JSON_VALUE );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+/**
+ * open a record reader, with the message it reuses for every record
+ */
+int Qpb::reader(lua_State*L) const
+{
+  Message * msg= create( L, QPB_READER_PBNAME, 0 );
+  QpbMessage::PushMsg( L, msg, QpbMessage::unowned );
+  return QpbReader::PushReader( L, msg );
+}
+
+//---------------------------------------------------------------------------
+/**
+ * move a top level message out of lua, in exchange for a token.
+ */
+int Qpb::detach(lua_State*L)
+{
+  QpbMessage* handle= QpbMessage::GetUserData( L, QPB_DETACH_MESSAGE );
+  Message * msg= handle->detach( L, QPB_DETACH_MESSAGE );
+  long long token=0;
+  {
+    std::lock_guard<std::mutex> lock( _lock );
+    token= ++_last_token;
+    _tokens[token]= msg;
+  }
+  lua_pushinteger( L, (lua_Integer) token );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+/**
+ * claim a detached message; each token can be attached once.
+ */
+int Qpb::attach(lua_State*L)
+{
+  const long long token= (long long) luaL_checkinteger( L, QPB_ATTACH_TOKEN );
+  const Descriptor* desc= 0;
+  {
+    std::lock_guard<std::mutex> lock( _lock );
+    token_map::const_iterator it= _tokens.find( token );
+    desc= it!=_tokens.end() ? it->second->GetDescriptor() : 0;
+  }
+  if (!desc) {
+    QPB_ERR_TOKEN( L, lua_tostring( L, QPB_ATTACH_TOKEN ) );
+  }
+  // make sure the type is known here before taking the message, PushMsg shouldn't fail with it
+  PushRegistered( L, desc );
+  if (lua_type( L, -1 )!= LUA_TTABLE) {
+    QPB_ERR_TYPE( L, desc->full_name().c_str() );
+  }
+  lua_pop( L, 1 );
+  Message * msg= 0;
+  {
+    std::lock_guard<std::mutex> lock( _lock );
+    token_map::iterator it= _tokens.find( token );
+    if (it!=_tokens.end()) {
+      msg= it->second;
+      _tokens.erase( it );
+    }
+  }
+  if (!msg) {
+    QPB_ERR_TOKEN( L, lua_tostring( L, QPB_ATTACH_TOKEN ) ); // another state got there first
+  }
+  return QpbMessage::PushMsg( L, msg, QpbMessage::unowned );
+}
+
+//---------------------------------------------------------------------------
+/**
+ * the message pool's counters; an empty table without QPB_MESSAGE_POOL.
+ */
+int Qpb::pool_stats(lua_State*L) const
+{
+  int ret=0;
+  if (_pool) {
+    ret= _pool->push_stats( L );
+  }
+  else {
+    lua_newtable( L );
+    ret=1;
+  }
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+/**
+ * a new table of an enum's values by name
+ */
+int Qpb::enum_values(lua_State*L) const
+{
+  const char * name= luaL_checkstring( L, QPB_ENUM_NAME );
+  const EnumDescriptor* desc= find_enum( name );
+  if (!desc) {
+    QPB_ERR_TYPE( L, name );
+  }
+  const int count= desc->value_count();
+  lua_createtable( L, 0, count );
+  for (int i=0; i< count; ++i) {
+    const EnumValueDescriptor* eval= desc->value(i);
+    lua_pushinteger( L, eval->number() );
+    lua_setfield( L, -2, eval->name().c_str() );
+  }
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// the registry keeps a table for each enum keyed by its descriptor ( see LUA_PUSH_ENUM, LUA_TO_ENUM ):
+// the array part has each value's name ( or number with QPB_ENUM_INTEGERS ) at the value's index+1,
+// the hash part each value's EnumValueDescriptor by name.
+void Qpb::register_enum( lua_State*L, const EnumDescriptor *desc ) const
+{
+  lua_rawgetp( L, LUA_REGISTRYINDEX, desc );
+  const bool registered= !lua_isnil( L, -1 );
+  lua_pop( L, 1 );
+  if (!registered) {
+    {
+      std::lock_guard<std::mutex> lock( _lock );
+      _fullenums[ desc->full_name() ]= desc;
+      _shortenums[ desc->name() ]= desc;
+    }
+
+    const bool integers= (_options & QPB_ENUM_INTEGERS)!=0;
+    const int count= desc->value_count();
+    lua_createtable( L, count, count );
+    for (int i=0; i< count; ++i) {
+      const EnumValueDescriptor* eval= desc->value(i);
+      const std::string & name= eval->name();
+      if (integers) {
+        lua_pushinteger( L, eval->number() );
       }
-      else
-      if (strncmp(key, parse_release, parselen(parse_release))==0) {
-        const FieldDescriptor*field= handle->field( L, key+ parselen(parse_release) );
-        ret= handle->release( L, field );
-      }      
-      // plain name, could be: a value get, an array proxy get, or array index value set.
       else {
-        const FieldDescriptor*field= handle->field( L, key );
-        ret= handle->get(L, field);
+        lua_pushlstring( L, name.c_str(), name.size() );
       }
-    }        
-  }      
-  return ret;
-}    
+      lua_rawseti( L, -2, i+1 );
+      lua_pushlstring( L, name.c_str(), name.size() );
+      lua_pushlightuserdata( L, const_cast<EnumValueDescriptor*>(eval) );
+      lua_rawset( L, -3 );
+    }
+    lua_rawsetp( L, LUA_REGISTRYINDEX, desc );
+  }
+}
 
 //---------------------------------------------------------------------------
-// register the descriptor, and its contents
-int Qpb::register_recurse( const Descriptor *desc )
+// a single type, and the enums it uses; its message fields register when they're first used.
+void Qpb::register_type( lua_State*L, const Descriptor *desc ) const
+{
+  register_metatable( L, desc );
+  for (int i=0;i< desc->enum_type_count(); ++i) {
+    register_enum( L, desc->enum_type(i) );
+  }
+  for (int i=0;i< desc->field_count(); ++i) {
+    const FieldDescriptor* field= desc->field(i);
+    if (field->type()==FieldDescriptor::TYPE_ENUM) {
+      register_enum( L, field->enum_type() );
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+static Qpb* qpb_lazy( lua_State*L )
+{
+  lua_getfield( L, LUA_REGISTRYINDEX, QPB_LAZY_REGISTRY );
+  Qpb* qpb= (Qpb*) lua_touserdata( L, -1 );
+  lua_pop( L, 1 );
+  return qpb;
+}
+
+//---------------------------------------------------------------------------
+void Qpb::PushRegistered( lua_State*L, const Descriptor *desc )
+{
+  lua_rawgetp( L, LUA_REGISTRYINDEX, desc );
+  if (lua_isnil( L, -1 )) {
+    const Qpb* qpb= qpb_lazy( L );
+    if (qpb) {
+      lua_pop( L, 1 );
+      qpb->register_type( L, desc );
+      lua_rawgetp( L, LUA_REGISTRYINDEX, desc );
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+void Qpb::PushRegistered( lua_State*L, const EnumDescriptor *desc )
+{
+  lua_rawgetp( L, LUA_REGISTRYINDEX, desc );
+  if (lua_isnil( L, -1 )) {
+    const Qpb* qpb= qpb_lazy( L );
+    if (qpb) {
+      lua_pop( L, 1 );
+      qpb->register_enum( L, desc );
+      lua_rawgetp( L, LUA_REGISTRYINDEX, desc );
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+// build the metatable for a single message type, and store it in the registry keyed by descriptor.
+// every field accessor is created here, once, so that pb:set_field( value )
+// is a plain table lookup followed by a call to an already resolved (operation, field) pair.
+void Qpb::register_metatable( lua_State*L, const Descriptor *desc ) const
+{
+  /**
+   * TODO: 
+   *      enum listings via Foo_descriptor, and Foo_IsValid(int)
+   */
+  static luaL_Reg qpb_member_fun[]= {
+    { "__gc", qpb_msg_collect },
+    { "__tostring", qpb_msg_to_string },
+    { 0 }
+  };
+  static luaL_Reg qpb_message_fun[]= {
+    { "parse_from", qpb_msg_parse_from },
+    { "to_table", qpb_msg_to_table },
+    { "merge_table", qpb_msg_merge_table },
+    { "to_json", qpb_msg_to_json },
+    { 0 }
+  };
+
+  lua_createtable( L, 0, 4 );
+  const int metatable= lua_gettop(L);
+  lua_pushlightuserdata( L, const_cast<Qpb*>(this) );  // prepare QPB_CLASS_UPVALUE
+  luaL_setfuncs( L, qpb_member_fun, 1 );
+
+  // marks the table as a qpb message metatable ( see QpbMessage::GetUserData )
+  lua_pushlightuserdata( L, const_cast<Descriptor*>(desc) );
+  lua_setfield( L, metatable, QPB_MESSAGE_METATABLE );
+
+  // the method table: pb.method hits this directly via __index
+  // with QPB_FIELD_PROPERTIES the plain field names map to the field itself,
+  // and __index is a function which reads the field when it finds one.
+  const bool properties= (_options & QPB_FIELD_PROPERTIES)!=0;
+  const int field_count= desc->field_count();
+  lua_createtable( L, 0, field_count * (sizeof(qpb_field_ops)/sizeof(*qpb_field_ops)-1) + 1 );
+  const int methods= lua_gettop(L);
+  // message methods go in first, so a field with the same name takes precedence.
+  lua_pushlightuserdata( L, const_cast<Qpb*>(this) );  // prepare QPB_CLASS_UPVALUE
+  luaL_setfuncs( L, qpb_message_fun, 1 );
+  lua_createtable( L, 0, field_count );
+  const int fields= lua_gettop(L);
+  for (int i=0;i< field_count; ++i) {
+    const FieldDescriptor* field= desc->field(i);
+    assert( field );
+    const std::string & name= field->lowercase_name();
+    for (const QpbFieldOp* op= qpb_field_ops; op->func; ++op) {
+      if (op->func==qpb_field_view && field->cpp_type()!=FieldDescriptor::CPPTYPE_STRING) {
+        continue;
+      }
+      const std::string method= op->prefix + name + op->suffix;
+      lua_pushlstring( L, method.c_str(), method.size() );
+      if (properties && op->func==qpb_field_get) {
+        lua_pushlightuserdata( L, const_cast<FieldDescriptor*>(field) );
+      }
+      else {
+        lua_pushlightuserdata( L, const_cast<Qpb*>(this) );  // prepare QPB_CLASS_UPVALUE
+        lua_pushlightuserdata( L, const_cast<FieldDescriptor*>(field) );  // prepare QPB_FIELD_UPVALUE
+        lua_pushcclosure( L, op->func, 2 );
+        QPB_STAT( closures );
+      }        
+      lua_rawset( L, methods );
+    }
+    lua_pushlstring( L, name.c_str(), name.size() );
+    lua_pushlightuserdata( L, const_cast<FieldDescriptor*>(field) );
+    lua_rawset( L, fields );
+  }
+  
+  // pb.field= value
+  lua_pushlightuserdata( L, const_cast<Qpb*>(this) );  // prepare QPB_CLASS_UPVALUE
+  lua_insert( L, fields );                             // ... and QPB_FIELDS_UPVALUE
+  lua_pushcclosure( L, qpb_msg_assign, 2 );
+  lua_setfield( L, metatable, "__newindex" );
+
+  if (properties) {
+    lua_pushlightuserdata( L, const_cast<Qpb*>(this) );  // prepare QPB_CLASS_UPVALUE
+    lua_insert( L, methods );                            // ... and QPB_FIELDS_UPVALUE
+    lua_pushcclosure( L, qpb_msg_property, 2 );
+  }
+  else {
+    // names that miss the method table aren't fields of this message
+    lua_createtable( L, 0, 1 );
+    lua_pushcfunction( L, qpb_msg_unknown );
+    lua_setfield( L, -2, "__index" );
+    lua_setmetatable( L, methods );
+  }    
+  lua_setfield( L, metatable, "__index" );
+
+  // borrowed handles have nothing to finalize: their metatable is a copy without __gc,
+  // so the collector can free them in a single pass ( see QpbMessage::PushMsg )
+  lua_createtable( L, 0, 4 );
+  lua_pushnil( L );
+  while (lua_next( L, metatable )) {
+    if (lua_type( L, -2 )==LUA_TSTRING && strcmp( lua_tostring( L, -2 ), "__gc" )==0) {
+      lua_pop( L, 1 );
+    }
+    else {
+      lua_pushvalue( L, -2 );
+      lua_insert( L, -2 );
+      lua_rawset( L, -4 );
+    }
+  }
+  lua_rawsetp( L, metatable, desc );
+
+  lua_rawsetp( L, LUA_REGISTRYINDEX, desc ); // pops the metatable
+}
+
+//---------------------------------------------------------------------------
+// record the names of the descriptor, its enums, and the types of its fields; the caller holds _lock.
+int Qpb::register_names( const Descriptor *desc )
 {
   int ambiguous_names=0;
   
@@ -321,13 +1445,24 @@ int Qpb::register_recurse( const Descriptor *desc )
       ++ambiguous_names;
     }
     _shortnames[ shortname ]= desc;
+    for (int i=0;i< desc->enum_type_count(); ++i) {
+      const EnumDescriptor* enum_type= desc->enum_type(i);
+      _fullenums[ enum_type->full_name() ]= enum_type;
+      _shortenums[ enum_type->name() ]= enum_type;
+    }
     for (int i=0;i< desc->field_count(); ++i) {
       const FieldDescriptor* field= desc->field(i);
       assert( field );
       if (field->type()==FieldDescriptor::TYPE_MESSAGE) {
         const Descriptor* fieldtype= field->message_type();
         assert( fieldtype );
-        ambiguous_names+= register_recurse( fieldtype );
+        ambiguous_names+= register_names( fieldtype );
+      }
+      else
+      if (field->type()==FieldDescriptor::TYPE_ENUM) {
+        const EnumDescriptor* enum_type= field->enum_type();
+        _fullenums[ enum_type->full_name() ]= enum_type;
+        _shortenums[ enum_type->name() ]= enum_type;
       }
     }
   }      
@@ -356,62 +1491,213 @@ static void qpb_register( lua_State* L, const char * table, luaL_Reg*reglist, vo
 // c++ public main method
 //---------------------------------------------------------------------------
 int Qpb::register_descriptors( lua_State*L, const char * name, const Descriptor **descs, int count )
+{
+  const int ambiguous_names= add_descriptors( descs, count );
+  bind( L, name );
+  return ambiguous_names;
+}
+
+//---------------------------------------------------------------------------
+int Qpb::add_descriptors( const Descriptor **descs, int count )
 {
   int ambiguous_names=0;
+  std::lock_guard<std::mutex> lock( _lock );
+  if (_options & QPB_LAZY_REGISTRATION) {
+    // just remember where to find them
+    for (int i=0; i< count;++i) {
+      const FileDescriptor * file= descs[i]->file();
+      if (std::find( _files.begin(), _files.end(), file )==_files.end()) {
+        _files.push_back( file );
+      }
+    }
+  }
+  else {
+    for (int i=0; i< count;++i) {
+      ambiguous_names+= register_names( descs[i] );
+    }     
+  }
+  return ambiguous_names;
+}
+
+//---------------------------------------------------------------------------
+void Qpb::bind( lua_State*L, const char * name )
+{
+  // types a state hasn't seen yet register when they're first used ( see PushRegistered )
+  lua_pushlightuserdata( L, this );
+  lua_setfield( L, LUA_REGISTRYINDEX, QPB_LAZY_REGISTRY );
 
-  // register the descriptions
-  for (int i=0; i< count;++i) {
-    const Descriptor * desc= descs[i];
-    ambiguous_names+=register_recurse( desc );
-  }     
-
-  // create the message factory and the metatables
-  // we only need to do this once.
-  if (!_factory) {
-    _factory= new DynamicMessageFactory();
-    if (_factory) {
-
-      // create the library type
-      static luaL_Reg qpb_class_fun[] = {
-        { "new", qpb_alloc },
-        { "next", qpb_next },
-        { "ipairs", qpb_ipairs },
-        { "index", qpb_index },
-        { 0 }
-      };
-      
-      //luaL_openlib( L, name, qpb_class_fun, 1 );   // create a table in the registry @ 'type' with the passed named c-functions
-      lua_newtable( L );
-      lua_pushlightuserdata( L, this );  // prepare QPB_CLASS_UPVALUE
-      luaL_setfuncs( L, qpb_class_fun, 1);
-      lua_setglobal( L, name );
-      //lua_pop( L, 1 ); // openlib removes upvalues, but returns result
-      
-      // create the qpb message type
-      static luaL_Reg qpb_member_fun[]= {
-        { "__gc", qpb_msg_collect },
-        { "__tostring", qpb_msg_to_string },
-        { "__index", qpb_msg_index },
-        { 0 }
-      };
-      qpb_register( L, QPB_MESSAGE_METATABLE, qpb_member_fun, this);
-      
-      // create the array proxy type
-      static luaL_Reg qpb_array_fun[]= {
-        { "__gc", qpb_array_collect },
-        { "__index", qpb_array_index }, // a[i]= 5, a:set(i,5)
-        { "__newindex", qpb_array_set  },
-        { "__len", qpb_array_size },
-        { "__tostring", qpb_array_to_string }, 
-        { "set", qpb_array_set }, // a:set -> no. b/c these dont exist on a,
-        { "get", qpb_array_get }, // they exist on 
-        { "size", qpb_array_size },
-        { 0 }
-      };
-      qpb_register( L, QPB_ARRAY_METATABLE, qpb_array_fun, 0);
-    }      
+  // the state's cache of type names ( see prototype() )
+  lua_rawgetp( L, LUA_REGISTRYINDEX, this );
+  const bool bound= lua_istable( L, -1 );
+  lua_pop( L, 1 );
+  if (!bound) {
+    lua_newtable( L );
+    lua_rawsetp( L, LUA_REGISTRYINDEX, this );
   }
 
-  return ambiguous_names;
+  // the metatables of every recorded type, unless they're registered as they're used
+  if (!(_options & QPB_LAZY_REGISTRATION)) {
+    std::vector<const Descriptor*> descs;
+    {
+      std::lock_guard<std::mutex> lock( _lock );
+      descs.reserve( _fullnames.size() );
+      for (descriptor_map::const_iterator it= _fullnames.begin(); it!= _fullnames.end(); ++it) {
+        descs.push_back( it->second );
+      }
+    }
+    for (size_t i=0; i< descs.size(); ++i) {
+      lua_rawgetp( L, LUA_REGISTRYINDEX, descs[i] );
+      const bool registered= !lua_isnil( L, -1 );
+      lua_pop( L, 1 );
+      if (!registered) {
+        register_type( L, descs[i] );
+      }
+    }
+  }
+
+  // create the library type
+  static luaL_Reg qpb_class_fun[] = {
+    { "new", qpb_alloc },
+    { "decode", qpb_decode },
+    { "decode_lazy", qpb_decode_lazy },
+    { "encode", qpb_encode },
+    { "decode_batch", qpb_decode_batch },
+    { "encode_batch", qpb_encode_batch },
+    { "arena", qpb_arena },
+    { "from_table", qpb_from_table },
+    { "from_json", qpb_from_json },
+    { "enum", qpb_enum },
+    { "pool_stats", qpb_pool_stats },
+    { "detach", qpb_detach },
+    { "attach", qpb_attach },
+    { "stats", qpb_stats },
+    { "reset_stats", qpb_reset_stats },
+    { "reader", qpb_reader },
+    { "writer", qpb_writer },
+    { "next", qpb_next },
+    { "ipairs", qpb_ipairs },
+    { "pairs", qpb_pairs },
+    { "index", qpb_index },
+    { 0 }
+  };
+  
+  //luaL_openlib( L, name, qpb_class_fun, 1 );   // create a table in the registry @ 'type' with the passed named c-functions
+  lua_newtable( L );
+  lua_pushlightuserdata( L, this );  // prepare QPB_CLASS_UPVALUE
+  luaL_setfuncs( L, qpb_class_fun, 1);
+  lua_setglobal( L, name );
+  //lua_pop( L, 1 ); // openlib removes upvalues, but returns result
+  
+  // note: each message type gets its own metatable, see register_metatable()
+  
+  // create the array proxy type
+  // arrays are always borrowed, so there's no __gc
+  static luaL_Reg qpb_array_fun[]= {
+    { "__index", qpb_array_index }, // a[i]= 5, a:set(i,5)
+    { "__newindex", qpb_array_set  },
+    { "__len", qpb_array_size },
+    { "__tostring", qpb_array_to_string }, 
+    { "__ipairs", qpb_array_ipairs },
+    { "__pairs", qpb_array_ipairs },
+    { "set", qpb_array_set }, // a:set -> no. b/c these dont exist on a,
+    { "get", qpb_array_get }, // they exist on 
+    { "size", qpb_array_size },
+    { "slice", qpb_array_slice },
+    { "extend", qpb_array_extend },
+    { "reserve", qpb_array_reserve },
+    { "fill", qpb_array_fill },
+    { "values", qpb_array_values },
+    { 0 }
+  };
+  qpb_register( L, QPB_ARRAY_METATABLE, qpb_array_fun, 0);
+
+  // create the map proxy type; borrowed, like arrays.
+  // every string indexes a key of a string map, so there are no methods, only metamethods.
+  static luaL_Reg qpb_map_fun[]= {
+    { "__index", qpb_map_get },
+    { "__newindex", qpb_map_set },
+    { "__len", qpb_map_size },
+    { "__pairs", qpb_map_pairs },
+    { "__tostring", qpb_map_to_string },
+    { 0 }
+  };
+  qpb_register( L, QPB_MAP_METATABLE, qpb_map_fun, 0);
+
+  // create the string view type, which is also the builder of mutable_ strings; views are borrowed too
+  static luaL_Reg qpb_view_fun[]= {
+    { "__len", qpb_view_size },
+    { "__tostring", qpb_view_to_string },
+    { "size", qpb_view_size },
+    { "sub", qpb_view_sub },
+    { "byte", qpb_view_byte },
+    { "find", qpb_view_find },
+    { "write", qpb_view_write },
+    { "append", qpb_view_append },
+    { "reserve", qpb_view_reserve },
+    { "truncate", qpb_view_truncate },
+    { "write_at", qpb_view_write_at },
+    { 0 }
+  };
+  qpb_register( L, QPB_VIEW_METATABLE, qpb_view_fun, 0);
+  luaL_getmetatable( L, QPB_VIEW_METATABLE );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" ); // view:sub -> metatable.sub
+  lua_pop( L, 1 );
+
+  // create the arena scope type
+  static luaL_Reg qpb_arena_fun[]= {
+    { "__gc", qpb_arena_close },
+    { "__close", qpb_arena_close }, // local arena <close> = qpb.arena()
+    { "__tostring", qpb_arena_to_string },
+    { "new", qpb_arena_alloc },
+    { "decode", qpb_arena_decode },
+    { "close", qpb_arena_close },
+    { 0 }
+  };
+  qpb_register( L, QPB_ARENA_METATABLE, qpb_arena_fun, this);
+  luaL_getmetatable( L, QPB_ARENA_METATABLE );
+  lua_pushvalue( L, -1 );
+  lua_setfield( L, -2, "__index" ); // arena:new -> metatable.new
+  lua_pop( L, 1 );
+
+  // handles that gave their message to QPB.detach, or whose message was released, replaced, or cleared away
+  static luaL_Reg qpb_detached_fun[]= {
+    { "__index", qpb_detached },
+    { "__newindex", qpb_detached },
+    { "__len", qpb_detached },
+    { "__tostring", qpb_detached_to_string },
+    { 0 }
+  };
+  qpb_register( L, QPB_DETACHED_METATABLE, qpb_detached_fun, 0);
+
+  // create the stream types
+  static luaL_Reg qpb_reader_fun[]= {
+    { "__gc", qpb_reader_close },
+    { "__close", qpb_reader_close },
+    { "__tostring", qpb_reader_to_string },
+    { "read", qpb_reader_read },
+    { "records", qpb_reader_records },
+    { "message", qpb_reader_message },
+    { "close", qpb_reader_close },
+    { 0 }
+  };
+  qpb_register( L, QPB_READER_METATABLE, qpb_reader_fun, 0);
+  static luaL_Reg qpb_writer_fun[]= {
+    { "__gc", qpb_writer_close },
+    { "__close", qpb_writer_close },
+    { "__tostring", qpb_writer_to_string },
+    { "write", qpb_writer_write },
+    { "flush", qpb_writer_flush },
+    { "close", qpb_writer_close },
+    { 0 }
+  };
+  qpb_register( L, QPB_WRITER_METATABLE, qpb_writer_fun, 0);
+  const char * streams[]= { QPB_READER_METATABLE, QPB_WRITER_METATABLE };
+  for (int i=0; i< 2; ++i) {
+    luaL_getmetatable( L, streams[i] );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, -2, "__index" ); // reader:read -> metatable.read
+    lua_pop( L, 1 );
+  }
 }
 
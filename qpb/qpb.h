@@ -14,20 +14,32 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <mutex>
 
 #include "qpb_forwards.h"
 
 struct QpbMessage;
+struct QpbArena;
+struct QpbPool;
+struct QpbWorkers;
+struct QpbFieldMask;
 
 class Qpb {
 public:
   typedef google::protobuf::Descriptor Descriptor;
+  typedef google::protobuf::Message Message;
+  typedef google::protobuf::EnumDescriptor EnumDescriptor;
+  typedef google::protobuf::FileDescriptor FileDescriptor;
   
   ~Qpb();
-  Qpb();
+  /**
+   * @param options QpbOptions flags
+   */
+  Qpb( int options= QPB_DEFAULT_OPTIONS );
 
   /**
-   * Register a series of the protobuf types with lua.
+   * Register a series of the protobuf types with lua: add_descriptors(), then bind().
    *
    * @param L lua state to register with
    * @param descs array of descriptors ( via userMessageType.descriptor() )
@@ -41,19 +53,115 @@ public:
 
   int register_descriptors( lua_State*, const char * name, const Descriptor **descs, int count );
 
-  int alloc(lua_State*) const;
-  int parse_closure(lua_State*) const;
+  /**
+   * Record a series of protobuf types, and the types they use, without touching any lua state.
+   * Safe to call from any thread; states see the new types from their next bind(),
+   * or when a message of that type first reaches them.
+   *
+   * @return count of ambiguous shortnames; the last shortname registered wins 
+   */
+  int add_descriptors( const Descriptor **descs, int count );
+
+  /**
+   * Install the library table, and the metatables of the recorded types, into a lua state.
+   * A single Qpb can be bound to many states, each running on its own thread: 
+   * the names and message prototypes are shared, only the lua side is built per state.
+   */
+  void bind( lua_State*, const char * name= QPB_GLOBAL_LIBARAY );
+
+  /**
+   * @param arena optional arena to allocate the message from
+   */
+  int alloc(lua_State*, QpbArena* arena= 0) const;
+  int decode(lua_State*, QpbArena* arena= 0) const;
+  /**
+   * QPB.decode_lazy: the message keeps the bytes, and parses each top level field the first time it's used.
+   * encoding it before any change returns the same bytes.
+   */
+  int decode_lazy(lua_State*) const;
+
+  /**
+   * QPB.decode_batch and QPB.encode_batch: handles are made on the calling thread, 
+   * the parsing and serializing is spread across the worker threads ( see set_batch_threads ).
+   */
+  int decode_batch(lua_State*) const;
+  int encode_batch(lua_State*) const;
+  int from_table(lua_State*) const;
+  int from_json(lua_State*) const;
+  int enum_values(lua_State*) const;
+  int reader(lua_State*) const;
+  int pool_stats(lua_State*) const;
+
+  /**
+   * token= QPB.detach( pb ) hands a top level message off, without a copy, 
+   * to pb= QPB.attach( token ) in any state bound to this Qpb.
+   */
+  int detach(lua_State*);
+  int attach(lua_State*);
   static Qpb* GetUpValue(lua_State *);
 
+  /**
+   * with QPB_MESSAGE_POOL, the most collected messages kept for reuse per type ( default 16 )
+   */
+  void set_pool_limit( int limit );
+  QpbPool* pool() const {
+    return _pool;
+  }
+
+  /**
+   * threads for the batch functions, besides the calling one; takes effect if set before the first batch.
+   * defaults to one less than the hardware's; 0 runs batches on the calling thread only.
+   */
+  void set_batch_threads( int threads );
+
+  /**
+   * the field mask for desc made of the table of paths at idx ( see QpbFieldMask ).
+   * compiled once for all bound states, and cached by each state; raises a lua error for unknown fields.
+   */
+  const QpbFieldMask* mask( lua_State*, const Descriptor* desc, int idx ) const;
+
+  /**
+   * push the registry entry of a message type ( its metatable ), or of an enum ( see register_enum );
+   * a type the state hasn't registered yet is registered on first use ( always so with QPB_LAZY_REGISTRATION ).
+   * pushes nil for unknown types.
+   */
+  static void PushRegistered( lua_State*, const Descriptor* );
+  static void PushRegistered( lua_State*, const EnumDescriptor* );
+
 protected:
-  int register_recurse( const Descriptor *desc );
-  typedef google::protobuf::Message Message;
+  const Descriptor* find( const char * name ) const;
+  const EnumDescriptor* find_enum( const char * name ) const;
+  const Message* prototype( lua_State*, int name ) const;
+  Message* create( lua_State*, int name, QpbArena* arena ) const;
+  int register_names( const Descriptor *desc );
+  void register_metatable( lua_State*, const Descriptor *desc ) const;
+  void register_enum( lua_State*, const EnumDescriptor *desc ) const;
+  void register_type( lua_State*, const Descriptor *desc ) const;
+  QpbWorkers* workers() const;
   typedef google::protobuf::MessageFactory MessageFactory;
 
 private:
   MessageFactory* _factory; // booost scoped 
+  QpbPool* _pool;
+  mutable QpbWorkers* _workers; // started by the first batch
+  int _batch_threads;
+  int _options;
+  // guards the name maps, _files, _masks, _tokens, and _workers, which any of the bound states might be using.
+  // ( each state keeps its own cache of the names it has used, see prototype() )
+  mutable std::mutex _lock;
+  // with QPB_LAZY_REGISTRATION, the name maps fill in as types are looked up
   typedef std::map<std::string, const Descriptor*> descriptor_map;
-  descriptor_map _fullnames, _shortnames;
+  mutable descriptor_map _fullnames, _shortnames;
+  typedef std::map<std::string, const EnumDescriptor*> enum_map;
+  mutable enum_map _fullenums, _shortenums;
+  std::vector<const FileDescriptor*> _files; 
+  // compiled field masks, by type and newline separated paths
+  typedef std::map<std::pair<const Descriptor*, std::string>, QpbFieldMask*> mask_map;
+  mutable mask_map _masks;
+  // detached messages waiting to be attached
+  typedef std::map<long long, Message*> token_map;
+  token_map _tokens;
+  long long _last_token;
 };
 
 
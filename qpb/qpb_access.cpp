@@ -0,0 +1,271 @@
+/**
+ * @file qpb_access.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_access.h"
+#include "qpb.h"
+#include "qpb_message.h"
+#include "qpb_table.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/reflection.h>
+#include <google/protobuf/repeated_field.h>
+#include "qpb_lua.h"
+#include <string>
+
+using namespace google::protobuf;
+#include "qpb_convert.h"
+#include <memory>
+
+//---------------------------------------------------------------------------
+/**
+ * MutableRepeatedFieldRef has no Reserve(), 
+ * so reserving space reaches for the typed container ( deprecated, but still the only way in. )
+ */
+#if defined(_MSC_VER)
+#pragma warning( push )
+#pragma warning( disable : 4996 )
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+
+template <typename T> 
+static void qpb_reserve( Message* m, const FieldDescriptor* f, int count ) {
+  m->GetReflection()->MutableRepeatedField<T>( m, f )->Reserve( count );
+}
+template <> 
+void qpb_reserve<std::string>( Message* m, const FieldDescriptor* f, int count ) {
+  m->GetReflection()->MutableRepeatedPtrField<std::string>( m, f )->Reserve( count );
+}
+template <> 
+void qpb_reserve<Message>( Message* m, const FieldDescriptor* f, int count ) {
+  m->GetReflection()->MutableRepeatedPtrField<Message>( m, f )->Reserve( count );
+}
+
+#if defined(_MSC_VER)
+#pragma warning( pop )
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+//---------------------------------------------------------------------------
+/**
+ * the value stored for lua values of type T; enums are stored as their numbers.
+ */
+template <typename T> 
+struct QpbElement {
+  typedef T Storage;
+  static T To( lua_State* L, const Message*, const FieldDescriptor*, int idx ) {
+    return QpbConvert<T>::To( L, idx );
+  }
+};
+
+template <> 
+struct QpbElement<EnumValueDescriptor> {
+  typedef int32 Storage;
+  static int32 To( lua_State* L, const Message* m, const FieldDescriptor* f, int idx ) {
+    return LUA_TO_ENUM( f, L, idx )->number();
+  }
+};
+
+//---------------------------------------------------------------------------
+/**
+ * bulk access to a repeated field of value type T, 
+ * one call from lua converts every element straight into the field.
+ */
+template <typename T>
+struct QpbBulk {
+  typedef QpbElement<T> E;
+  typedef typename E::Storage S;
+
+  static void Reserve( lua_State* L, Message* m, const FieldDescriptor* f, int count ) {
+    qpb_reserve<S>( m, f, count );
+  }
+  // append table[1..count]
+  static void Extend( lua_State* L, Message* m, const FieldDescriptor* f, int table, int count ) {
+    MutableRepeatedFieldRef<S> ref= m->GetReflection()->GetMutableRepeatedFieldRef<S>( m, f );
+    qpb_reserve<S>( m, f, ref.size() + count );
+    for (int i=1; i<= count; ++i) {
+      lua_rawgeti( L, table, i );
+      ref.Add( E::To( L, m, f, -1 ) );
+      lua_pop( L, 1 );
+    }
+  }
+  // resize to count elements, all equal to the value at idx
+  static void Fill( lua_State* L, Message* m, const FieldDescriptor* f, int idx, int count ) {
+    const S val= E::To( L, m, f, idx );
+    MutableRepeatedFieldRef<S> ref= m->GetReflection()->GetMutableRepeatedFieldRef<S>( m, f );
+    while (ref.size() > count) {
+      ref.RemoveLast();
+    }
+    const int size= ref.size();
+    for (int i=0; i< size; ++i) {
+      ref.Set( i, val );
+    }
+    qpb_reserve<S>( m, f, count );
+    for (int i=size; i< count; ++i) {
+      ref.Add( val );
+    }
+  }
+};
+
+// sub-messages are either other messages ( copied ), or tables ( see QpbTable::MergeTable )
+template <>
+struct QpbBulk<Message> {
+  static void Reserve( lua_State* L, Message* m, const FieldDescriptor* f, int count ) {
+    qpb_reserve<Message>( m, f, count );
+  }
+  static void Extend( lua_State* L, Message* m, const FieldDescriptor* f, int table, int count ) {
+    // check every message before adding any, so a bad element leaves the field as it was.
+    for (int i=1; i<= count; ++i) {
+      lua_rawgeti( L, table, i );
+      if (!lua_istable( L, -1 )) {
+        LUA_TO_MESSAGE( f, L, -1 );
+      }
+      lua_pop( L, 1 );
+    }
+    const Reflection * reflect= m->GetReflection();
+    qpb_reserve<Message>( m, f, reflect->FieldSize( *m, f ) + count );
+    for (int i=1; i<= count; ++i) {
+      lua_rawgeti( L, table, i );
+      if (lua_istable( L, -1 )) {
+        QpbTable::MergeTable( L, reflect->AddMessage( m, f ), -1 );
+      }
+      else {
+        const QpbCopySource src( LUA_TO_MESSAGE( L, -1 ), m, 0 );
+        reflect->AddMessage( m, f )->CopyFrom( src.get() );
+        QPB_STAT( deep_copies );
+      }
+      lua_pop( L, 1 );
+    }
+  }
+  static void Fill( lua_State* L, Message* m, const FieldDescriptor* f, int idx, int count ) {
+    // copy the value first: it might be an element that's about to be removed.
+    const Message & src= LUA_TO_MESSAGE( f, L, idx );
+    std::unique_ptr<Message> val( src.New() );
+    val->CopyFrom( src );
+    const Reflection * reflect= m->GetReflection();
+    while (reflect->FieldSize( *m, f ) > count) {
+      reflect->RemoveLast( m, f );
+    }
+    const int size= reflect->FieldSize( *m, f );
+    for (int i=0; i< size; ++i) {
+      reflect->MutableRepeatedMessage( m, f, i )->CopyFrom( *val );
+    }
+    qpb_reserve<Message>( m, f, count );
+    for (int i=size; i< count; ++i) {
+      reflect->AddMessage( m, f )->CopyFrom( *val );
+    }
+    QPB_STAT_ADD( deep_copies, 1 + count );
+  }
+};
+
+//---------------------------------------------------------------------------
+/**
+ * direct access to the elements of a repeated field of value type T, 
+ * without going back through reflection for each one.
+ * RepeatedFieldRef reads each element through a virtual call, so this holds the typed container too.
+ */
+#if defined(_MSC_VER)
+#pragma warning( push )
+#pragma warning( disable : 4996 )
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+
+template <typename T>
+struct QpbIterate {
+  typedef typename QpbElement<T>::Storage S;
+  typedef RepeatedField<S> Field;
+
+  static const void* Container( const Message& m, const FieldDescriptor* f ) {
+    return &m.GetReflection()->GetRepeatedField<S>( m, f );
+  }
+  static int PushElement( lua_State* L, const void* c, const FieldDescriptor* f, int index ) {
+    const Field* rf= (const Field*) c;
+    return index < rf->size() ? QpbConvert<S>::Push( L, rf->Get( index ) ) : 0;
+  }
+};
+
+template <>
+int QpbIterate<EnumValueDescriptor>::PushElement( lua_State* L, const void* c, const FieldDescriptor* f, int index ) {
+  const Field* rf= (const Field*) c;
+  return index < rf->size() ? LUA_PUSH_ENUM( L, f->enum_type()->FindValueByNumber( rf->Get( index ) ) ) : 0;
+}
+
+template <>
+struct QpbIterate<std::string> {
+  typedef RepeatedPtrField<std::string> Field;
+
+  static const void* Container( const Message& m, const FieldDescriptor* f ) {
+    return &m.GetReflection()->GetRepeatedPtrField<std::string>( m, f );
+  }
+  static int PushElement( lua_State* L, const void* c, const FieldDescriptor* f, int index ) {
+    const Field* rf= (const Field*) c;
+    return index < rf->size() ? QpbConvert<std::string>::Push( L, rf->Get( index ) ) : 0;
+  }
+};
+
+// sub-messages are pushed as handles whose owner is at QPB_OWNER_SELF
+template <>
+struct QpbIterate<Message> {
+  typedef RepeatedPtrField<Message> Field;
+
+  static const void* Container( const Message& m, const FieldDescriptor* f ) {
+    return &m.GetReflection()->GetRepeatedPtrField<Message>( m, f );
+  }
+  static int PushElement( lua_State* L, const void* c, const FieldDescriptor* f, int index ) {
+    const Field* rf= (const Field*) c;
+    return index < rf->size() ? LUA_PUSH_MESSAGE( L, rf->Get( index ), index ) : 0;
+  }
+};
+
+#if defined(_MSC_VER)
+#pragma warning( pop )
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+
+//---------------------------------------------------------------------------
+#define QPB_ACCESSOR( T ) { \
+  QpbAccess<T>::Get, \
+  QpbAccess<T>::GetRepeated, \
+  QpbAccess<T>::Set, \
+  QpbAccess<T>::SetRepeated, \
+  QpbAccess<T>::Add, \
+  QpbBulk<T>::Reserve, \
+  QpbBulk<T>::Extend, \
+  QpbBulk<T>::Fill, \
+  QpbIterate<T>::Container, \
+  QpbIterate<T>::PushElement, \
+}
+
+// indexed by FieldDescriptor::CppType
+static const QpbAccessor qpb_accessors[FieldDescriptor::MAX_CPPTYPE+1]= {
+  { 0 },
+  QPB_ACCESSOR( int32 ),                // CPPTYPE_INT32
+  QPB_ACCESSOR( int64 ),                // CPPTYPE_INT64
+  QPB_ACCESSOR( uint32 ),               // CPPTYPE_UINT32
+  QPB_ACCESSOR( uint64 ),               // CPPTYPE_UINT64
+  QPB_ACCESSOR( double ),               // CPPTYPE_DOUBLE
+  QPB_ACCESSOR( float ),                // CPPTYPE_FLOAT
+  QPB_ACCESSOR( bool ),                 // CPPTYPE_BOOL
+  QPB_ACCESSOR( EnumValueDescriptor ),  // CPPTYPE_ENUM
+  QPB_ACCESSOR( std::string ),          // CPPTYPE_STRING
+  QPB_ACCESSOR( Message ),              // CPPTYPE_MESSAGE
+};
+
+//---------------------------------------------------------------------------
+const QpbAccessor& QpbAccessor::For( const FieldDescriptor* field )
+{
+  return qpb_accessors[ field->cpp_type() ];
+}
@@ -0,0 +1,48 @@
+/**
+ * @file qpb_access.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_ACCESS_H__
+#define __QPB_ACCESS_H__
+
+#include "qpb_forwards.h"
+
+//---------------------------------------------------------------------------
+/**
+ * the lua conversion functions for one field value type.
+ * a table of these, indexed by cpp type, replaces a switch on field->cpp_type() per access.
+ *
+ * the index is the element of a repeated field, idx the lua stack index of a new value.
+ */
+struct QpbAccessor
+{
+  typedef google::protobuf::Message Message;
+  typedef google::protobuf::FieldDescriptor FieldDescriptor;
+
+  int (*get)( lua_State*, const Message&, const FieldDescriptor* );
+  int (*get_repeated)( lua_State*, const Message&, const FieldDescriptor*, int index );
+  void (*set)( lua_State*, Message*, const FieldDescriptor*, int idx );
+  void (*set_repeated)( lua_State*, Message*, const FieldDescriptor*, int index, int idx );
+  void (*add)( lua_State*, Message*, const FieldDescriptor*, int idx );
+
+  // bulk operations on a whole repeated field, see QpbArray.
+  void (*reserve)( lua_State*, Message*, const FieldDescriptor*, int count );
+  void (*extend)( lua_State*, Message*, const FieldDescriptor*, int table, int count );
+  void (*fill)( lua_State*, Message*, const FieldDescriptor*, int idx, int count );
+
+  // iteration, see QpbIterator: the typed repeated container of a field,
+  // and a push of its element; push_element returns 0 past the end of the container.
+  const void* (*container)( const Message&, const FieldDescriptor* );
+  int (*push_element)( lua_State*, const void* container, const FieldDescriptor*, int index );
+
+  static const QpbAccessor& For( const FieldDescriptor* );
+};
+
+#endif // #ifndef __QPB_ACCESS_H__
@@ -0,0 +1,100 @@
+/**
+ * @file qpb_arena.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_arena.h"
+
+#include <google/protobuf/arena.h>
+#include "qpb_lua.h"
+
+using namespace google::protobuf;
+
+//---------------------------------------------------------------------------
+// QpbArena
+//---------------------------------------------------------------------------
+QpbArena::QpbArena()
+  : _arena( new Arena() )
+  , _refs(1)
+{
+}
+
+//---------------------------------------------------------------------------
+QpbArena::~QpbArena()
+{
+  delete _arena;
+}
+
+//---------------------------------------------------------------------------
+QpbArena* QpbArena::New()
+{
+  return new QpbArena();
+}
+
+//---------------------------------------------------------------------------
+void QpbArena::release()
+{
+  if (--_refs==0) {
+    delete this;
+  }
+}
+
+//---------------------------------------------------------------------------
+// QpbArenaScope
+//---------------------------------------------------------------------------
+int QpbArenaScope::PushScope( lua_State * L )
+{
+  // lua 'throws' on failed allocation
+  QpbArenaScope* scope= (QpbArenaScope*)lua_newuserdata( L, sizeof(QpbArenaScope) );
+  scope->_arena= 0; // in case New() throws
+  luaL_getmetatable( L, QPB_ARENA_METATABLE ); // fetch the object metatable
+  lua_setmetatable( L, -2 ); // set the metatable of the user data
+  scope->_arena= QpbArena::New();
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+QpbArenaScope* QpbArenaScope::GetUserData( lua_State * L, int idx ) 
+{
+  QpbArenaScope* scope= (QpbArenaScope*) luaL_checkudata( L, idx, QPB_ARENA_METATABLE );
+  return scope;
+}
+
+//---------------------------------------------------------------------------
+int QpbArenaScope::collect( lua_State * L )
+{
+  return close( L );
+}
+
+//---------------------------------------------------------------------------
+// the scope gives up its reference; 
+// messages allocated from the arena keep it alive until they are collected.
+int QpbArenaScope::close( lua_State * L )
+{
+  if (_arena) {
+    _arena->release();
+    _arena= 0;
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+int QpbArenaScope::to_string( lua_State * L ) const
+{
+  lua_pushfstring( L, "qpb: %p - arena%s", this, _arena ? "" : " (closed)" );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+QpbArena* QpbArenaScope::arena( lua_State * L ) const
+{
+  if (!_arena) {
+    QPB_ERR_ARENA_CLOSED( L );
+  }
+  return _arena;
+}
@@ -0,0 +1,70 @@
+/**
+ * @file qpb_arena.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_ARENA_H__
+#define __QPB_ARENA_H__
+
+#include "qpb_forwards.h"
+
+class Qpb;
+
+//---------------------------------------------------------------------------
+/**
+ * reference counted protobuf arena.
+ * held by the lua arena scope, and by every top level message allocated from it;
+ * the arena's memory is freed in bulk once the scope is closed and all of its messages are collected.
+ */
+struct QpbArena
+{
+  typedef google::protobuf::Arena Arena;
+
+  static QpbArena* New();
+  void retain() {
+    ++_refs;
+  }
+  void release();
+
+  Arena* GetArena() const {
+    return _arena;
+  }
+
+private:
+  QpbArena(); 
+  ~QpbArena();
+  Arena* _arena;
+  int _refs;
+};
+
+//---------------------------------------------------------------------------
+/**
+ * POD-like type managed by lua, the lua side of an arena: 
+ * local arena= QPB.arena(); local pb= arena:new( name )
+ */
+struct QpbArenaScope
+{
+  static int PushScope( lua_State* );
+  static QpbArenaScope* GetUserData( lua_State *, int idx= QPB_ARENA_SELF );
+
+  int collect(lua_State*);
+  int close(lua_State*);
+  int to_string(lua_State*) const;
+
+  /**
+   * @return the arena, raises an error if the scope has been closed
+   */
+  QpbArena* arena(lua_State*) const;
+
+private:
+  QpbArenaScope(); // unimplemented
+  QpbArena* _arena;
+};
+
+#endif // #ifndef __QPB_ARENA_H__
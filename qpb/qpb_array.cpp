@@ -9,13 +9,12 @@
  * See License.txt for complete information.
  */
 #include "qpb_array.h"
+#include "qpb.h"
 #include "qpb_message.h"
+#include "qpb_access.h"
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/message.h>
-extern "C" {
-#include <lua.h>
-#include <lauxlib.h>
-}
+#include "qpb_lua.h"
 #include <string>
 
 using namespace google::protobuf;
@@ -25,12 +24,28 @@ using namespace google::protobuf;
 //---------------------------------------------------------------------------
 int QpbArray::PushProxy( lua_State* L, const QpbRef & msg, const FieldDescriptor *field )
 {
+  // each array is only wrapped once per tree ( see QpbMessage::PushMsg )
+  msg.PushSlot( L, QPB_OWNER_SELF, 1 + field->index() );
+  lua_rawgetp( L, -1, msg.Key() );
+  const QpbArray* cached= (const QpbArray*) luaL_testudata( L, -1, QPB_ARRAY_METATABLE );
+  if (cached && cached->_field==field) {
+    lua_remove( L, -2 ); // the cache
+    return 1;
+  }
+  lua_pop( L, 1 );
+  const int cache= lua_gettop( L );
+
   // lua 'throws' on failed allocation
   QpbArray* proxy= (QpbArray*)lua_newuserdata( L, sizeof(QpbArray) );
+  QPB_STAT( handles_array );
   luaL_getmetatable( L, QPB_ARRAY_METATABLE ); // fetch the object metatable
   lua_setmetatable( L, -2 ); // set the metatable of the user data
   proxy->_msg= msg;
   proxy->_field= field;
+  QpbRef::SetOwner( L, -1, QPB_OWNER_SELF );
+  lua_pushvalue( L, -1 );
+  lua_rawsetp( L, cache, msg.Key() );
+  lua_remove( L, cache );
   return 1;
 }
 
@@ -49,35 +64,36 @@ int QpbArray::to_string( lua_State * L ) const
   return 1;
 }
 
-//---------------------------------------------------------------------------
-int QpbArray::collect( lua_State * L ) 
-{
-  return 0;
-}  
-
 //---------------------------------------------------------------------------
 int QpbArray::get( lua_State * L ) const
 {
   int index = luaL_checkint(L, QPB_ARRAY_INDEX);
-  return ArrayGet( L, _msg, _field, index );
+  QPB_STAT_ACCESS( op_array_get, _field );
+  return QPB_STAT_DONE( ArrayGet( L, _msg, _field, index ) );
 }
 
 //---------------------------------------------------------------------------
+// the caller has already checked the index against size()
 int QpbArray::get_raw( lua_State * L, int index ) const
 {
-  return ArrayGet( L, _msg, _field, index );
+  QPB_STAT_ACCESS( op_array_get, _field );
+  return QPB_STAT_DONE( QpbAccessor::For( _field ).get_repeated( L, _msg, _field, index-1 ) );
 }
 
 //---------------------------------------------------------------------------
 int QpbArray::set( lua_State * L )
 {
+  int ret=0;
   Message* msg= _msg.demute(L);
   if (msg) {
     int index = luaL_checkint(L, QPB_ARRAY_INDEX);
     lua_pushvalue( L, QPB_ARRAY_VALUE );
+    QPB_STAT_ACCESS( op_array_set, _field );
+    QpbMessage::Modified( L, QPB_ARRAY_SELF, nested() );
     ArraySet( L, msg, _field, index );
+    ret= QPB_STAT_DONE( 0 );
   }    
-  return 0;
+  return ret;
 }
 
 //---------------------------------------------------------------------------
@@ -96,17 +112,126 @@ int QpbArray::size( lua_State * L ) const
   return 1;
 }
 
+//---------------------------------------------------------------------------
+bool QpbArray::nested() const
+{
+  return _field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE;
+}
+
 //---------------------------------------------------------------------------
 int QpbArray::clear( lua_State * L )
 {
   Message* msg= _msg.demute(L);
   if (msg) {
     const Reflection * reflect= msg->GetReflection();
+    QpbMessage::Modified( L, QPB_ARRAY_SELF, nested() );
     reflect->ClearField(msg, _field);
   }
   return 0;
 }
 
+//---------------------------------------------------------------------------
+// a:slice( [i [, j [, table]]] ) returns elements i through j as multiple values;
+// with a table ( or true for a new one ) they are stored there instead.
+// like string.sub, negative indices count back from the end.
+int QpbArray::slice( lua_State * L ) const
+{
+  int ret=0;
+  const int size= this->size();
+  int from= luaL_optint( L, QPB_ARRAY_SLICE_FROM, 1 );
+  int to= luaL_optint( L, QPB_ARRAY_SLICE_TO, size );
+  if (from < 0) {
+    from+= size+1;
+  }
+  if (to < 0) {
+    to+= size+1;
+  }
+  if (from < 1) {
+    from= 1;
+  }
+  if (to > size) {
+    to= size;
+  }
+  const int count= to >= from ? to-from+1 : 0;
+  const QpbAccessor & access= QpbAccessor::For( _field );
+  
+  if (lua_toboolean( L, QPB_ARRAY_SLICE_TABLE )) {
+    if (lua_istable( L, QPB_ARRAY_SLICE_TABLE )) {
+      lua_pushvalue( L, QPB_ARRAY_SLICE_TABLE );
+    }
+    else {
+      lua_createtable( L, count, 0 );
+    }
+    const int table= lua_gettop( L );
+    for (int i=0; i< count; ++i) {
+      access.get_repeated( L, _msg, _field, from-1+i );
+      lua_rawseti( L, table, i+1 );
+    }
+    ret= 1;
+  }
+  else {
+    luaL_checkstack( L, count, "QPB: slice too large, use a table" );
+    for (int i=0; i< count; ++i) {
+      access.get_repeated( L, _msg, _field, from-1+i );
+    }
+    ret= count;
+  }
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// a:extend( table ) appends table[1..#table]
+int QpbArray::extend( lua_State * L )
+{
+  luaL_checktype( L, QPB_ARRAY_EXTEND_TABLE, LUA_TTABLE );
+  Message* msg= _msg.demute(L);
+  if (msg) {
+    const int count= (int) lua_rawlen( L, QPB_ARRAY_EXTEND_TABLE );
+    QpbMessage::Modified( L, QPB_ARRAY_SELF, nested() );
+    QpbAccessor::For( _field ).extend( L, msg, _field, QPB_ARRAY_EXTEND_TABLE, count );
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// a:reserve( n ) makes room for n elements in total
+int QpbArray::reserve( lua_State * L )
+{
+  const int count= luaL_checkint( L, QPB_ARRAY_RESERVE_COUNT );
+  Message* msg= _msg.demute(L);
+  if (msg && count > 0) {
+    QpbAccessor::For( _field ).reserve( L, msg, _field, count );
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// a:fill( value [, n] ) sets every element to value, resizing the array to n elements when given.
+int QpbArray::fill( lua_State * L )
+{
+  luaL_checkany( L, QPB_ARRAY_FILL_VALUE );
+  const int count= luaL_optint( L, QPB_ARRAY_FILL_COUNT, size() );
+  Message* msg= _msg.demute(L);
+  if (msg) {
+    if (count < 0) {
+      QPB_ERR_RANGE( L, _field->name().c_str(), count, size() );
+    }
+    QpbMessage::Modified( L, QPB_ARRAY_SELF, nested() );
+    QpbAccessor::For( _field ).fill( L, msg, _field, QPB_ARRAY_FILL_VALUE, count );
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// for i,v in ipairs( a ), for i,v in pairs( a ), and for v in a:values()
+int QpbArray::iterate( lua_State * L, bool indexed ) const
+{
+  QpbIterator::PushIterator( L, QPB_ARRAY_SELF, indexed );
+  lua_pushvalue( L, QPB_ARRAY_SELF ); // invarient; keeps the array's owner at QPB_OWNER_SELF for message elements
+  lua_pushnil( L );
+  return 3;
+}
+
 //---------------------------------------------------------------------------
 int QpbArray::ArrayGet( lua_State *L, const Message & msg, const FieldDescriptor*field, int index )
 {
@@ -118,62 +243,7 @@ int QpbArray::ArrayGet( lua_State *L, const Message & msg, const FieldDescriptor
     QPB_ERR_RANGE( L, field->name().c_str(), index, size );
   }
   else {
-    switch ( field->cpp_type() ) {
-      case FieldDescriptor::CPPTYPE_INT32: {
-        int32 val= reflect->GetRepeatedInt32( msg, field, index );
-        ret= LUA_PUSH_INT32( L, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_INT64: {
-        int64 val= reflect->GetRepeatedInt64( msg, field, index );
-        ret= LUA_PUSH_INT64( L, val );
-      }
-      break;
-      case FieldDescriptor::CPPTYPE_UINT32: {
-        uint32 val= reflect->GetRepeatedUInt32( msg, field, index );
-        ret= LUA_PUSH_UINT32( L, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_UINT64: {
-        uint64 val= reflect->GetRepeatedUInt64( msg, field, index );
-        ret= LUA_PUSH_UINT64( L, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_DOUBLE: {
-        double val= reflect->GetRepeatedDouble( msg, field, index );
-        ret= LUA_PUSH_DOUBLE( L, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_FLOAT: {
-        float val= reflect->GetRepeatedFloat( msg, field, index );
-        ret= LUA_PUSH_FLOAT( L, val );
-      }
-      break;  
-      case FieldDescriptor::CPPTYPE_BOOL: {
-        bool val= reflect->GetRepeatedBool( msg, field, index );
-        ret= LUA_PUSH_BOOL( L, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_ENUM: {
-        const EnumValueDescriptor* val= reflect->GetRepeatedEnum( msg, field, index );
-        ret= LUA_PUSH_ENUM(L,val);
-      }
-      break;
-      case FieldDescriptor::CPPTYPE_STRING: {
-        std::string scratch;
-        const std::string& val= reflect->GetRepeatedStringReference( msg, field, index, &scratch );
-        ret= LUA_PUSH_STRING( L, val );
-      }              
-      break;
-      case FieldDescriptor::CPPTYPE_MESSAGE: {
-        const Message& val= reflect->GetRepeatedMessage( msg, field, index );
-        ret= LUA_PUSH_MESSAGE( L, val, index );
-      }
-      break;
-      default:
-        QPB_ERR_TYPE( L, field->name().c_str() );
-      break;
-    }          
+    ret= QpbAccessor::For( field ).get_repeated( L, msg, field, index );
   }    
   return ret;
 }
@@ -194,67 +264,63 @@ void QpbArray::ArraySet( lua_State *L, Message * msg, const FieldDescriptor*fiel
     QPB_ERR_RANGE( L, field->name().c_str(), index, size );
   }
   else {
-    switch ( field->cpp_type() ) {
-      case FieldDescriptor::CPPTYPE_INT32:{
-        const int32 val= LUA_TO_INT32(L,-1);
-        reflect->SetRepeatedInt32( msg, field, index, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_INT64:{
-        const int64 val= LUA_TO_INT64( L, -1 );
-        reflect->SetRepeatedInt64( msg, field, index, val);
-      }
-      break;
-      case FieldDescriptor::CPPTYPE_UINT32:{
-        const uint32 val= LUA_TO_UINT32( L, -1 );
-        reflect->SetRepeatedUInt32( msg, field, index, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_UINT64:{
-        const uint64 val= LUA_TO_UINT64( L, -1 );
-        reflect->SetRepeatedUInt64( msg, field, index, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_DOUBLE:{
-        const double val= LUA_TO_DOUBLE( L, -1 );
-        reflect->SetRepeatedDouble( msg, field, index, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_FLOAT:{
-        const float val= LUA_TO_FLOAT( L, -1 );
-        reflect->SetRepeatedFloat( msg, field, index, val );
-      }
-      break;  
-      case FieldDescriptor::CPPTYPE_BOOL:{
-        const bool val= LUA_TO_BOOL( L, -1 );
-        reflect->SetRepeatedBool( msg, field, index, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_ENUM: {
-        const EnumValueDescriptor* val= LUA_TO_ENUM( msg, field, L, -1 );
-        reflect->SetRepeatedEnum( msg, field, index, val );
-      }
-      break;
-      case FieldDescriptor::CPPTYPE_STRING: {
-        const std::string & val= LUA_TO_STRING( L, -1 );
-        reflect->SetRepeatedString( msg, field, index, val );
-      }              
-      break;
-      case FieldDescriptor::CPPTYPE_MESSAGE: {
-        Message* dst= reflect->MutableRepeatedMessage( msg, field, index );
-        if (!dst) {
-          QPB_ERR_MESSAGE(L, field->name().c_str() );
-        }
-        else {
-          const Message& val= LUA_TO_MESSAGE( L, -1 );
-          dst->CopyFrom( val );
-        }                  
-      }
-      break;
-      default:
-        QPB_ERR_TYPE( L, field->name().c_str() );
-      break;
-    }
+    QpbAccessor::For( field ).set_repeated( L, msg, field, index, -1 );
   }    
-  lua_pop( L, -1 );
+  lua_pop( L, 1 );
+}
+
+//---------------------------------------------------------------------------
+// QpbIterator
+//---------------------------------------------------------------------------
+static int qpb_iterator_next( lua_State * L )
+{
+  QpbIterator * it= (QpbIterator*) lua_touserdata( L, lua_upvalueindex( QPB_ITERATOR_UPVALUE ) );
+  // the generic for passes the array as its invarient, but the function might be called by hand:
+  lua_settop( L, 0 );
+  lua_pushvalue( L, lua_upvalueindex( QPB_ITERATOR_ARRAY_UPVALUE ) );
+  return it->next( L );
+}
+
+//---------------------------------------------------------------------------
+int QpbIterator::PushIterator( lua_State * L, int idx, bool indexed )
+{
+  idx= lua_absindex( L, idx );
+  const QpbArray* array= QpbArray::GetUserData( L, idx );
+  const Message& msg= array->_msg;
+  QpbIterator* it= (QpbIterator*) lua_newuserdata( L, sizeof(QpbIterator) );
+  it->_access= &QpbAccessor::For( array->_field );
+  it->_container= it->_access->container( msg, array->_field );
+  it->_field= array->_field;
+  it->_size= array->size();
+  it->_next= 0;
+  it->_indexed= indexed;
+  lua_pushvalue( L, idx );
+  lua_pushcclosure( L, qpb_iterator_next, 2 );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+int QpbIterator::next( lua_State * L )
+{
+  int ret=0;
+  // the array at 1 lost its message mid loop
+  const QpbArray* array= (const QpbArray*) lua_touserdata( L, 1 );
+  if (array->_field!=_field) {
+    QPB_ERR_DETACHED( L );
+  }
+  // stop at the size when the loop started; push_element stops early if the array shrinks.
+  if (_next < _size) {
+    if (_indexed) {
+      lua_pushinteger( L, _next+1 );
+    }
+    const int pushed= _access->push_element( L, _container, _field, _next );
+    if (pushed) {
+      ret= pushed + (_indexed ? 1 : 0);
+      ++_next;
+    }
+    else {
+      _next= _size;
+    }
+  }
+  return ret;
 }
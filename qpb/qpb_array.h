@@ -16,6 +16,7 @@
 #include "qpb_ref.h"
 
 struct QpbMessage;
+struct QpbAccessor;
 
 //---------------------------------------------------------------------------
 /**
@@ -34,7 +35,6 @@ struct QpbArray
   }
   
   static QpbArray* GetUserData( lua_State *, int idx= QPB_ARRAY_SELF );
-  int collect(lua_State*);
 
   int size() const;
   int size( lua_State * ) const;
@@ -42,18 +42,56 @@ struct QpbArray
   int get_raw( lua_State *, int idx ) const;
   int set( lua_State * );
   int clear( lua_State * );
+  int slice( lua_State * ) const;
+  int extend( lua_State * );
+  int reserve( lua_State * );
+  int fill( lua_State * );
+  int iterate( lua_State *, bool indexed ) const;
   int to_string( lua_State*) const;
+
+  /**
+   * the array's message was handed to another state, or is going away ( see QpbMessage::detach, QpbMessage::Invalidate ); loops over it stop.
+   */
+  void detach() {
+    _field= 0;
+  }
   
   static int ArrayGet( lua_State *, const Message &, const FieldDescriptor*, int i );
   static void ArraySet( lua_State *, Message *, const FieldDescriptor*, int i );
 
 private:
+  friend struct QpbIterator;
   static int PushProxy( lua_State*, const QpbRef&, const FieldDescriptor *);
+  // writing the elements of a message array can change the maps inside them ( see QpbMessage::Modified )
+  bool nested() const;
   
   QpbArray(); // unimplemented
   QpbRef _msg;
   const FieldDescriptor *_field;  
 };
 
+//---------------------------------------------------------------------------
+/**
+ * POD-like type managed by lua, the state of a loop over an array.
+ * the field's container and size are fetched once, when the loop starts.
+ */
+struct QpbIterator
+{
+  typedef google::protobuf::Message Message;
+  typedef google::protobuf::FieldDescriptor FieldDescriptor;
+
+  // pushes an iterator function over the array at idx
+  static int PushIterator( lua_State *, int idx, bool indexed );
+  int next( lua_State * );
+
+private:
+  QpbIterator(); // unimplemented
+  const QpbAccessor* _access;
+  const void* _container;
+  const FieldDescriptor *_field;
+  int _size;
+  int _next;
+  bool _indexed; // push the index along with the value 
+};
 
 #endif // #ifndef __QPB_ARRAY_H__
@@ -4,7 +4,7 @@
  * \internal
  * Copyright (c) 2012, everMany, LLC.
  * All rights reserved.
- * 
+ *
  * Code licensed under the "New BSD" (BSD 3-Clause) License
  * See License.txt for complete information.
  */
@@ -12,108 +12,264 @@
 #ifndef __QPB_CONVERT_H__
 #define __QPB_CONVERT_H__
 
+//#include "qpb.h"
 //#include "qpb_message.h"
 //#include <google/protobuf/descriptor.h>
 //#include <google/protobuf/message.h>
 //#include <lua.h>
 //#include <string>
 // using namespace google::protobuf;
+#include "qpb_stats.h"
 
 //---------------------------------------------------------------------------
 /**
- * conversions from lua to protobuf types
+ * conversions between lua and protobuf types
  *
  * i played with the idea of using printf and scanf for 64bit numbers
  * ex. lua_pushfstring( L, "%"PRId64, val )
- * but since lua internally handles numbers as doubles 
- * it seems like its better not to convert to string
+ * but lua 5.3 and later have native 64 bit integers, so 64 bit fields use those and round trip losslessly.
+ * ( uint64 values above 2^63 read as negative integers, the same as lua's own unsigned handling )
+ * earlier versions handle numbers as doubles, there 64 bit values are exact up to 2^53.
  */
-#define LUA_TO_INT32( L, idx )  lua_tointeger(L,idx)
+#if LUA_VERSION_NUM >= 503
+#define QPB_NATIVE_INT64 1
+#endif
 
-#define LUA_TO_INT64( L, idx ) ((int64) lua_tonumber( L, idx ))
+// lua_tointeger refuses floats with a fractional part, qpb truncates them like older luas did.
+inline lua_Integer qpb_tointeger( lua_State* L, int idx ) {
+  int isnum=0;
+  lua_Integer val= lua_tointegerx( L, idx, &isnum );
+  return isnum ? val : (lua_Integer) lua_tonumber( L, idx );
+}
 
-#define LUA_TO_UINT32( L, idx ) ((uint32) lua_tointeger(L,idx))
+template <typename T> struct QpbConvert;
 
-#define LUA_TO_UINT64( L, idx ) ((uint64) lua_tonumber( L, idx ))
+template <> struct QpbConvert<int32> {
+  static int32 To( lua_State* L, int idx ) {
+    return (int32) qpb_tointeger( L, idx );
+  }
+  static int Push( lua_State* L, int32 val ) {
+    lua_pushinteger( L, val );
+    return 1;
+  }
+};
 
-#define LUA_TO_DOUBLE( L, idx ) lua_tonumber(L,idx)
+template <> struct QpbConvert<uint32> {
+  static uint32 To( lua_State* L, int idx ) {
+    return (uint32) qpb_tointeger( L, idx );
+  }
+  static int Push( lua_State* L, uint32 val ) {
+    lua_pushinteger( L, val );
+    return 1;
+  }
+};
 
-#define LUA_TO_FLOAT( L, idx )  ((float)lua_tonumber(L,idx))
+template <> struct QpbConvert<int64> {
+  static int64 To( lua_State* L, int idx ) {
+#ifdef QPB_NATIVE_INT64
+    return (int64) qpb_tointeger( L, idx );
+#else
+    return (int64) lua_tonumber( L, idx );
+#endif
+  }
+  static int Push( lua_State* L, int64 val ) {
+#ifdef QPB_NATIVE_INT64
+    lua_pushinteger( L, (lua_Integer) val );
+#else
+    lua_pushnumber( L, (lua_Number) val );
+#endif
+    return 1;
+  }
+};
 
-#define LUA_TO_BOOL( L, idx )   lua_toboolean(L,idx)!=0
+template <> struct QpbConvert<uint64> {
+  static uint64 To( lua_State* L, int idx ) {
+#ifdef QPB_NATIVE_INT64
+    return (uint64) qpb_tointeger( L, idx );
+#else
+    return (uint64) lua_tonumber( L, idx );
+#endif
+  }
+  static int Push( lua_State* L, uint64 val ) {
+#ifdef QPB_NATIVE_INT64
+    lua_pushinteger( L, (lua_Integer) val );
+#else
+    lua_pushnumber( L, (lua_Number) val );
+#endif
+    return 1;
+  }
+};
 
-inline const EnumValueDescriptor * LUA_TO_ENUM( const Message*msg, const FieldDescriptor*field, lua_State* L, int idx ){
-  const char * ename= lua_tostring(L,idx);
-  const EnumValueDescriptor * eval= msg->GetDescriptor()->FindEnumValueByName( ename );
-  if (!eval) {
-    QPB_ERR_FIELD_ENUM( L, field->name().c_str(), ename );
+template <> struct QpbConvert<double> {
+  static double To( lua_State* L, int idx ) {
+    return lua_tonumber( L, idx );
   }
-  return eval;
-}
+  static int Push( lua_State* L, double val ) {
+    lua_pushnumber( L, val );
+    return 1;
+  }
+};
 
-inline std::string LUA_TO_STRING( lua_State* L, int idx ) {
-  size_t len=0;
-  const char * str= lua_tolstring(L, idx, &len);
-  return std::string( str, len );
-}
+template <> struct QpbConvert<float> {
+  static float To( lua_State* L, int idx ) {
+    return (float) lua_tonumber( L, idx );
+  }
+  static int Push( lua_State* L, float val ) {
+    lua_pushnumber( L, val );
+    return 1;
+  }
+};
 
-inline const Message & LUA_TO_MESSAGE( lua_State * L, int idx ) {
-  const QpbMessage *handle= QpbMessage::GetUserData( L, idx );
-  return handle->GetMessage();
-}  
+template <> struct QpbConvert<bool> {
+  static bool To( lua_State* L, int idx ) {
+    return lua_toboolean( L, idx )!=0;
+  }
+  static int Push( lua_State* L, bool val ) {
+    lua_pushboolean( L, val );
+    return 1;
+  }
+};
+
+template <> struct QpbConvert<std::string> {
+  static std::string To( lua_State* L, int idx ) {
+    size_t len=0;
+    const char * str= lua_tolstring( L, idx, &len );
+    return std::string( str, len );
+  }
+  static int Push( lua_State* L, const std::string & str ) {
+    lua_pushlstring( L, str.c_str(), str.size() );
+    return 1;
+  }
+};
 
 //---------------------------------------------------------------------------
 /**
- * conversions to lua from protobuf types
+ * enums, and messages, need more than just the value
  */
-inline int LUA_PUSH_INT32( lua_State* L, int32 val ) {
-  lua_pushinteger( L, val );
-  return 1;
-}  
-
-inline int LUA_PUSH_INT64( lua_State* L, int64 val ) {
-  lua_pushnumber( L, (lua_Number)val );
-  return 1;
+// enums are looked up through the per-enum table qpb registers ( see Qpb::register_enum ):
+// the value names, or numbers, by value index; and the EnumValueDescriptor by name.
+// lua strings are interned, so the name lookup never rehashes the string.
+inline const EnumValueDescriptor * LUA_TO_ENUM( const FieldDescriptor*field, lua_State* L, int idx ){
+  const EnumDescriptor * etype= field->enum_type();
+  const EnumValueDescriptor * eval= 0;
+  idx= lua_absindex( L, idx );
+  if (lua_type( L, idx )==LUA_TNUMBER) {
+    eval= etype->FindValueByNumber( (int) qpb_tointeger( L, idx ) );
+  }
+  else {
+    Qpb::PushRegistered( L, etype );
+    if (lua_istable( L, -1 )) {
+      lua_pushvalue( L, idx );
+      lua_rawget( L, -2 );
+      eval= (const EnumValueDescriptor *) lua_touserdata( L, -1 );
+      lua_pop( L, 1 );
+    }
+    lua_pop( L, 1 );
+  }
+  if (!eval) {
+    const char * ename= lua_tostring( L, idx );
+    QPB_ERR_FIELD_ENUM( L, field->name().c_str(), ename ? ename : luaL_typename( L, idx ) );
+  }
+  return eval;
 }
 
-inline int LUA_PUSH_UINT32( lua_State* L, uint32 val ) {
-  lua_pushinteger( L, val );
+inline int LUA_PUSH_ENUM( lua_State* L, const EnumValueDescriptor* eval ) {
+  if (eval) {
+    const EnumDescriptor * etype= eval->type();
+    const int index= eval->index();
+    Qpb::PushRegistered( L, etype );
+    if (!lua_istable( L, -1 )) {
+      lua_pop( L, 1 );
+      lua_pushstring( L, eval->name().c_str() );
+    }
+    else {
+      if (index>=0 && index < etype->value_count() && etype->value( index )==eval) {
+        lua_rawgeti( L, -1, index+1 );
+      }
+      else {
+        // values outside the .proto ( ex. from a newer sender ) aren't in the table, 
+        // push them the same way the table does: as a number, or a name.
+        lua_rawgeti( L, -1, 1 );
+        const bool numbers= lua_type( L, -1 )==LUA_TNUMBER;
+        lua_pop( L, 1 );
+        if (numbers) {
+          lua_pushinteger( L, eval->number() );
+        }
+        else {
+          lua_pushstring( L, eval->name().c_str() );
+        }
+      }
+      lua_remove( L, -2 );
+    }
+  } else {
+    lua_pushnil(L);
+  }
   return 1;
 }
 
-inline int LUA_PUSH_UINT64( lua_State* L, uint64 val ) {
-  lua_pushnumber( L, (lua_Number)val );
-  return 1;
+inline const Message & LUA_TO_MESSAGE( lua_State * L, int idx ) {
+  const QpbMessage *handle= QpbMessage::GetUserData( L, idx );
+  return handle->GetMessage( L );
 }
 
-inline int LUA_PUSH_DOUBLE( lua_State* L, double val ) {
-  lua_pushnumber( L, val );
-  return 1;
+// the message at idx, which has to be of the field's type
+inline const Message & LUA_TO_MESSAGE( const FieldDescriptor*field, lua_State * L, int idx ) {
+  const Message & msg= LUA_TO_MESSAGE( L, idx );
+  if (msg.GetDescriptor()!=field->message_type()) {
+    QPB_ERR_MESSAGE( L, msg.GetDescriptor()->full_name().c_str() );
+  }
+  return msg;
 }
 
-inline int LUA_PUSH_FLOAT( lua_State* L, float val ) {
-  lua_pushnumber( L, val );
-  return 1;
+// true if sub is msg, or one of the messages inside it
+inline bool QPB_CONTAINS( const Message & msg, const Message * sub ) {
+  if (&msg==sub) {
+    return true;
+  }
+  const Descriptor* desc= msg.GetDescriptor();
+  const Reflection* reflect= msg.GetReflection();
+  for (int i=0; i< desc->field_count(); ++i) {
+    const FieldDescriptor* field= desc->field(i);
+    if (field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE) {
+      if (field->is_repeated()) {
+        const int count= reflect->FieldSize( msg, field );
+        for (int k=0; k< count; ++k) {
+          if (QPB_CONTAINS( reflect->GetRepeatedMessage( msg, field, k ), sub )) {
+            return true;
+          }
+        }
+      }
+      else 
+      if (reflect->HasField( msg, field ) && QPB_CONTAINS( reflect->GetMessage( msg, field ), sub )) {
+        return true;
+      }
+    }
+  }
+  return false;
 }
 
-inline int LUA_PUSH_BOOL( lua_State* L, bool val ) {
-  lua_pushboolean( L, val );
-  return 1;
-}  
-
-inline int LUA_PUSH_ENUM( lua_State* L, const EnumValueDescriptor* eval ) {
-  if (eval) {
-    lua_pushstring( L, eval->name().c_str() );
-  } else {
-    lua_pushnil(L);
+// the source of a message copy into a field of parent, whose current value ( if any ) is old.
+// protobuf won't copy between messages that contain one another,
+// so a src that holds parent, or that lies inside old, is copied out first.
+class QpbCopySource {
+public:
+  QpbCopySource( const Message & src, const Message * parent, const Message * old ) : _src( &src ), _copy( 0 ) {
+    if (QPB_CONTAINS( src, parent ) || (old && QPB_CONTAINS( *old, &src ))) {
+      _copy= src.New();
+      _copy->CopyFrom( src );
+      _src= _copy;
+    }
   }
-  return 1;    
-}  
-
-inline int LUA_PUSH_STRING( lua_State* L, const std::string & str ) {
-  lua_pushlstring( L,str.c_str(), str.size() );
-  return 1;
-}  
+  ~QpbCopySource() {
+    delete _copy;
+  }
+  const Message & get() const {
+    return *_src;
+  }
+private:
+  const Message * _src;
+  Message * _copy;
+};
 
 inline int LUA_PUSH_MESSAGE( lua_State * L, const Message & msg, int owner ) {
   return QpbMessage::PushMsg( L, QpbRef(msg), owner );
@@ -124,4 +280,121 @@ inline int LUA_PUSH_MESSAGE( lua_State * L, Message * msg, int owner ) {
   return QpbMessage::PushMsg( L, QpbRef(msg), owner  );
 }
 
+//---------------------------------------------------------------------------
+/**
+ * the reflection calls for each field value type
+ */
+template <typename T> struct QpbReflect;
+
+#define QPB_REFLECT( T, Name ) \
+template <> struct QpbReflect<T> { \
+  static T Get( const Reflection* r, const Message& m, const FieldDescriptor* f ) { \
+    return r->Get##Name( m, f ); \
+  } \
+  static T GetRepeated( const Reflection* r, const Message& m, const FieldDescriptor* f, int i ) { \
+    return r->GetRepeated##Name( m, f, i ); \
+  } \
+  static void Set( const Reflection* r, Message* m, const FieldDescriptor* f, const T& v ) { \
+    r->Set##Name( m, f, v ); \
+  } \
+  static void SetRepeated( const Reflection* r, Message* m, const FieldDescriptor* f, int i, const T& v ) { \
+    r->SetRepeated##Name( m, f, i, v ); \
+  } \
+  static void Add( const Reflection* r, Message* m, const FieldDescriptor* f, const T& v ) { \
+    r->Add##Name( m, f, v ); \
+  } \
+};
+
+QPB_REFLECT( int32, Int32 )
+QPB_REFLECT( int64, Int64 )
+QPB_REFLECT( uint32, UInt32 )
+QPB_REFLECT( uint64, UInt64 )
+QPB_REFLECT( double, Double )
+QPB_REFLECT( float, Float )
+QPB_REFLECT( bool, Bool )
+QPB_REFLECT( std::string, String )
+#undef QPB_REFLECT
+
+//---------------------------------------------------------------------------
+/**
+ * lua access to a field of value type T; see QpbAccessor.
+ * the index is the element of a repeated field, idx the lua stack index of a new value.
+ */
+template <typename T>
+struct QpbAccess {
+  typedef QpbReflect<T> R;
+  typedef QpbConvert<T> C;
+
+  static int Get( lua_State* L, const Message& m, const FieldDescriptor* f ) {
+    return C::Push( L, R::Get( m.GetReflection(), m, f ) );
+  }
+  static int GetRepeated( lua_State* L, const Message& m, const FieldDescriptor* f, int index ) {
+    return C::Push( L, R::GetRepeated( m.GetReflection(), m, f, index ) );
+  }
+  static void Set( lua_State* L, Message* m, const FieldDescriptor* f, int idx ) {
+    R::Set( m->GetReflection(), m, f, C::To( L, idx ) );
+  }
+  static void SetRepeated( lua_State* L, Message* m, const FieldDescriptor* f, int index, int idx ) {
+    R::SetRepeated( m->GetReflection(), m, f, index, C::To( L, idx ) );
+  }
+  static void Add( lua_State* L, Message* m, const FieldDescriptor* f, int idx ) {
+    R::Add( m->GetReflection(), m, f, C::To( L, idx ) );
+  }
+};
+
+// strings are read by reference
+template <> inline int QpbAccess<std::string>::Get( lua_State* L, const Message& m, const FieldDescriptor* f ) {
+  std::string scratch;
+  return C::Push( L, m.GetReflection()->GetStringReference( m, f, &scratch ) );
+}
+template <> inline int QpbAccess<std::string>::GetRepeated( lua_State* L, const Message& m, const FieldDescriptor* f, int index ) {
+  std::string scratch;
+  return C::Push( L, m.GetReflection()->GetRepeatedStringReference( m, f, index, &scratch ) );
+}
+
+template <>
+struct QpbAccess<EnumValueDescriptor> {
+  static int Get( lua_State* L, const Message& m, const FieldDescriptor* f ) {
+    return LUA_PUSH_ENUM( L, m.GetReflection()->GetEnum( m, f ) );
+  }
+  static int GetRepeated( lua_State* L, const Message& m, const FieldDescriptor* f, int index ) {
+    return LUA_PUSH_ENUM( L, m.GetReflection()->GetRepeatedEnum( m, f, index ) );
+  }
+  static void Set( lua_State* L, Message* m, const FieldDescriptor* f, int idx ) {
+    m->GetReflection()->SetEnum( m, f, LUA_TO_ENUM( f, L, idx ) );
+  }
+  static void SetRepeated( lua_State* L, Message* m, const FieldDescriptor* f, int index, int idx ) {
+    m->GetReflection()->SetRepeatedEnum( m, f, index, LUA_TO_ENUM( f, L, idx ) );
+  }
+  static void Add( lua_State* L, Message* m, const FieldDescriptor* f, int idx ) {
+    m->GetReflection()->AddEnum( m, f, LUA_TO_ENUM( f, L, idx ) );
+  }
+};
+
+// sub-messages are returned as handles, and set by copying a handle's message
+template <>
+struct QpbAccess<Message> {
+  static int Get( lua_State* L, const Message& m, const FieldDescriptor* f ) {
+    return LUA_PUSH_MESSAGE( L, m.GetReflection()->GetMessage( m, f ), QpbMessage::message_owner );
+  }
+  static int GetRepeated( lua_State* L, const Message& m, const FieldDescriptor* f, int index ) {
+    return LUA_PUSH_MESSAGE( L, m.GetReflection()->GetRepeatedMessage( m, f, index ), index );
+  }
+  static void Set( lua_State* L, Message* m, const FieldDescriptor* f, int idx ) {
+    const QpbCopySource src( LUA_TO_MESSAGE( f, L, idx ), m, &m->GetReflection()->GetMessage( *m, f ) );
+    m->GetReflection()->MutableMessage( m, f )->CopyFrom( src.get() );
+    QPB_STAT( deep_copies );
+  }
+  static void SetRepeated( lua_State* L, Message* m, const FieldDescriptor* f, int index, int idx ) {
+    const QpbCopySource src( LUA_TO_MESSAGE( f, L, idx ), m, &m->GetReflection()->GetRepeatedMessage( *m, f, index ) );
+    m->GetReflection()->MutableRepeatedMessage( m, f, index )->CopyFrom( src.get() );
+    QPB_STAT( deep_copies );
+  }
+  static void Add( lua_State* L, Message* m, const FieldDescriptor* f, int idx ) {
+    const QpbCopySource src( LUA_TO_MESSAGE( f, L, idx ), m, 0 );
+    m->GetReflection()->AddMessage( m, f )->CopyFrom( src.get() );
+    QPB_STAT( deep_copies );
+  }
+};
+
 #endif // #ifndef __QPB_CONVERT_H__
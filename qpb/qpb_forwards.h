@@ -19,49 +19,141 @@ namespace google {
     class MessageFactory;
     class Descriptor;
     class FieldDescriptor;
+    class EnumDescriptor;
+    class FileDescriptor;
+    class Arena;
   }
 };
 
 #define QPB_GLOBAL_LIBARAY    "QPB"
 #define QPB_MESSAGE_METATABLE "qpb.proto.buffer.message"
 #define QPB_ARRAY_METATABLE   "qpb.proto.buffer.array"
+#define QPB_MAP_METATABLE     "qpb.proto.buffer.map"
+#define QPB_VIEW_METATABLE    "qpb.proto.buffer.view"
+#define QPB_ARENA_METATABLE   "qpb.proto.buffer.arena"
+#define QPB_READER_METATABLE  "qpb.proto.buffer.reader"
+#define QPB_WRITER_METATABLE  "qpb.proto.buffer.writer"
+#define QPB_DETACHED_METATABLE "qpb.proto.buffer.detached"
+#define QPB_OWNER_TABLE       "qpb.proto.buffer.owners"
+#define QPB_CACHE_TABLE       "qpb.proto.buffer.caches"
+#define QPB_CACHE_METATABLE   "qpb.proto.buffer.cache"
+#define QPB_MAP_INDEX_TABLE   "qpb.proto.buffer.mapindex"
+#define QPB_LAZY_REGISTRY     "qpb.proto.buffer.lazy"
+#define QPB_MASK_CACHE        "qpb.proto.buffer.masks"
 
 enum QpbMutation {
   QPB_IMMUTABLE,
   QPB_MUTABLE,
 };
 
+// flags for the Qpb constructor
+enum QpbOptions {
+  QPB_DEFAULT_OPTIONS=0,
+  // pb.field reads the field's value ( rather than returning the pb:field() getter method )
+  // pb.field= value is always available.
+  QPB_FIELD_PROPERTIES= 1<<0,
+  // enum fields read as their numbers ( rather than their names ), see QPB.enum()
+  // either is accepted for writes.
+  QPB_ENUM_INTEGERS= 1<<1,
+  // register_descriptors only records the descriptors' files;
+  // each type is found in their DescriptorPool, and registered, the first time it's used.
+  QPB_LAZY_REGISTRATION= 1<<2,
+  // collected top level messages are cleared and kept for reuse by QPB.new ( see QpbPool )
+  QPB_MESSAGE_POOL= 1<<3,
+};
+
 
 // all of the permissible parameters indicies
 // to the various qpb functions
 enum QpbParameters 
 {
+  // sub-messages and arrays are pushed by methods on their parent, 
+  // they keep the root of the parent at this index alive. ( see QpbRef::SetOwner )
+  QPB_OWNER_SELF = 1,
+
   QPB_CLASS_UPVALUE = 1,
-  QPB_FIELD_UPVALUE = 2,  // index sets an upvalue of the fieldname 
+  QPB_FIELD_UPVALUE = 2,  // field methods carry the FieldDescriptor they operate on
+  QPB_FIELDS_UPVALUE = 2, // __index and __newindex carry the per-type name lookup table
 
   // qpb global object:
   QPB_NEW_PBNAME =1, // pb= qpb.new( pbname )
+  QPB_DECODE_PBNAME =1, // pb= qpb.decode( pbname, bytes )
+  QPB_DECODE_BYTES =2,
+  QPB_DECODE_MASK =3,  // pb= qpb.decode( pbname, bytes, { "field", "field.sub_field", ... } )
+  QPB_DECODE_LAZY_PBNAME =1, // pb= qpb.decode_lazy( pbname, bytes )
+  QPB_DECODE_LAZY_BYTES =2,
+  QPB_ENCODE_MESSAGE =1, // bytes= qpb.encode( pb )
+  QPB_DECODE_BATCH_PBNAME =1, // pbs= qpb.decode_batch( pbname, { bytes, ... } )
+  QPB_DECODE_BATCH_BYTES =2,
+  QPB_ENCODE_BATCH_MESSAGES =1, // { bytes, ... }= qpb.encode_batch( { pb, ... } )
+  QPB_FROM_TABLE_PBNAME =1, // pb= qpb.from_table( pbname, table )
+  QPB_FROM_TABLE_VALUE =2,
+  QPB_FROM_JSON_PBNAME =1, // pb= qpb.from_json( pbname, json )
+  QPB_FROM_JSON_VALUE =2,
+  QPB_ENUM_NAME =1, // values= qpb.enum( enumname )
+  QPB_READER_FILE =1, // reader= qpb.reader( path_or_fd, pbname )
+  QPB_READER_PBNAME =2,
+  QPB_WRITER_FILE =1, // writer= qpb.writer( path_or_fd )
+  QPB_DETACH_MESSAGE =1, // token= qpb.detach( pb )
+  QPB_ATTACH_TOKEN =1, // pb= qpb.attach( token )
 
   // pb message userdata:
   // __index for unknown fields:
   QPB_META_TABLE=1, // pb.fieldname => pb.__index( metatable, fieldname )
   QPB_META_FIELD=2,
+  QPB_META_VALUE=3, // pb.fieldname= value => pb.__newindex( pb, fieldname, value )
 
-  // pb message __index returns a closure to handle requests for data from the fieldname
+  // pb message __index is a per-type table of pre-bound field methods
   // ex. pb:repeated_field( 5 ) is a request for the 5 value in an array
-  // index returns pb.repeated_field returns the closure, 
-  // (pb, 5) gets sent to the qpb_msg_parse_closure.
+  // index returns pb.repeated_field returns the method, 
+  // (pb, 5) gets sent to the method's operation.
   QPB_MESSAGE_SELF=1,        // pb:....
   QPB_SET_REPEATED_INDEX=2,  // pb:set_field( index, value )
   QPB_SET_REPEATED_VALUE=3,
   QPB_SET_VALUE=2,           // pb:set_field( value )
   QPB_APPEND_VALUE=2,        // pb:add_field( value ); 
   QPB_GET_REPEATED_INDEX=2,  // pb:get_field( index )
+  QPB_PARSE_BYTES=2,         // pb:parse_from( bytes [, mask] )
+  QPB_PARSE_MASK=3,
+  QPB_TO_TABLE_REUSE=2,      // pb:to_table( [table] )
+  QPB_MERGE_TABLE_VALUE=2,   // pb:merge_table( table )
+  QPB_TO_JSON_OPTIONS=2,     // pb:to_json( [options] )
 
   // pb array proxy:
   QPB_ARRAY_SELF =1,         // array:
   QPB_ARRAY_INDEX=2,         // array[index], array:get(index)
   QPB_ARRAY_VALUE=3,         // array[index]= value, array:set(index, value)
+  QPB_ARRAY_SLICE_FROM=2,    // array:slice( [i [, j [, table]]] )
+  QPB_ARRAY_SLICE_TO=3,
+  QPB_ARRAY_SLICE_TABLE=4,
+  QPB_ARRAY_EXTEND_TABLE=2,  // array:extend( table )
+  QPB_ARRAY_RESERVE_COUNT=2, // array:reserve( n )
+  QPB_ARRAY_FILL_VALUE=2,    // array:fill( value [, n] )
+  QPB_ARRAY_FILL_COUNT=3,
+
+  // pb string view:
+  QPB_VIEW_SELF =1,          // view:
+  QPB_VIEW_FROM=2,           // view:sub( [i [, j]] ), view:byte( [i [, j]] )
+  QPB_VIEW_TO=3,
+  QPB_VIEW_FIND_TEXT=2,      // view:find( text [, init] )
+  QPB_VIEW_FIND_INIT=3,
+  QPB_VIEW_WRITE_FILE=2,     // view:write( fd or file )
+  QPB_VIEW_APPEND_TEXT=2,    // builder:append( text, ... )
+  QPB_VIEW_RESERVE_COUNT=2,  // builder:reserve( n )
+  QPB_VIEW_TRUNCATE_SIZE=2,  // builder:truncate( n )
+  QPB_VIEW_WRITE_AT=2,       // builder:write_at( i, text )
+  QPB_VIEW_WRITE_AT_TEXT=3,
+
+  // pb map proxy:
+  QPB_MAP_SELF=1,            // m:
+  QPB_MAP_KEY=2,             // m[key], m[key]= value
+  QPB_MAP_VALUE=3,
+  QPB_MAP_PAIRS=1,           // qpb.pairs( m )
+
+  // map iterator closures ( see QpbMap::iterate )
+  QPB_MAP_ITERATOR_MAP_UPVALUE=1,
+  QPB_MAP_ITERATOR_KEYS_UPVALUE=2,
+  QPB_MAP_ITERATOR_AT_UPVALUE=3,
 
   // qpb array iteration
   QPB_NEXT_INVARIENT=1,
@@ -70,8 +162,19 @@ enum QpbParameters
   // qpb array ipairs
   QPB_ARRAY_IPAIRS=1,
 
+  // array iterator closures ( see QpbIterator )
+  QPB_ITERATOR_UPVALUE=1,
+  QPB_ITERATOR_ARRAY_UPVALUE=2,
+
   // qpb message index lookup
   QPB_MESSAGE_INDEX=1,
+
+  // qpb arena scope:
+  QPB_ARENA_SELF=1,          // arena:new( pbname ), arena:decode( pbname, bytes )
+
+  // qpb reader and writer:
+  QPB_STREAM_SELF=1,         // reader:read(), writer:write( pb )
+  QPB_WRITE_MESSAGE=2,
 };
 
 #define QPB_ERR_ALLOC(L)    luaL_error( L, "QPB: couldn't allocate memory.")
@@ -84,13 +187,33 @@ enum QpbParameters
 #define QPB_ERR_REPEATED_FIELD( L, name ) luaL_error( L, "QPB: field %s not a repeated field", (const char*) name )
 #define QPB_ERR_FIELD_ENUM( L, field, ename ) luaL_error( L, "QPB: enum name %s invalid for field %s", (const char*) ename, (const char*) field )
 #define QPB_ERR_ADD_MESSAGE( L, name ) luaL_error( L, "QPB: add message returns a new message, it doesnt append one. for field: %s", (const char*) (name) );
+#define QPB_ERR_ALLOCATED(L, name) luaL_error( L, "QPB: set_allocated needs a top level message of the field's type for field %s", (const char*) (name) );
 #define QPB_ERR_RELEASE(L, name) luaL_error( L, "QPB: invalid release request for field %s", (const char*) (name) );
 #define QPB_ERR_MUTABLE(L, name) luaL_error( L, "QPB: invalid mutable request for field %s", (const char*) (name) );
+#define QPB_ERR_MAP_KEY(L, name, type) luaL_error( L, "QPB: invalid %s key for map field %s", (const char*) (type), (const char*) (name) );
+#define QPB_ERR_MAP_VALUE(L, name, type) luaL_error( L, "QPB: invalid %s value for map field %s", (const char*) (type), (const char*) (name) );
+#define QPB_ERR_ASSIGN_REPEATED(L, name) luaL_error( L, "QPB: can't assign to repeated field %s, use its array", (const char*) (name) );
+#define QPB_ERR_NESTED(L) luaL_error( L, "QPB: table nested too deeply" );
+#define QPB_ERR_ADD_MAP(L, name) luaL_error( L, "QPB: can't add to map field %s, set its keys instead", (const char*) (name) );
+#define QPB_ERR_PARSE(L, name) luaL_error( L, "QPB: couldn't parse %s", (const char*) (name) );
+#define QPB_ERR_PARSE_BATCH(L, name, i) luaL_error( L, "QPB: couldn't parse %s at batch index %d", (const char*) (name), (int) (i) );
+#define QPB_ERR_UNINITIALIZED_BATCH(L, name, i, missing) luaL_error( L, "QPB: %s at batch index %d is missing required fields: %s", (const char*) (name), (int) (i), (const char*) (missing) );
+#define QPB_ERR_MASK(L, name, path) luaL_error( L, "QPB: %s has no field %s", (const char*) (name), (const char*) (path) );
+#define QPB_ERR_JSON(L, name, what, at) luaL_error( L, "QPB: couldn't parse json for %s: %s at %d", (const char*) (name), (const char*) (what), (int) (at) );
+#define QPB_ERR_UNINITIALIZED(L, name, missing) luaL_error( L, "QPB: %s is missing required fields: %s", (const char*) (name), (const char*) (missing) );
+#define QPB_ERR_ARENA_CLOSED(L) luaL_error( L, "QPB: arena has been closed." );
+#define QPB_ERR_OPEN(L, path, err) luaL_error( L, "QPB: couldn't open %s: %s", (const char*) (path), (const char*) (err) );
+#define QPB_ERR_READ(L, err) luaL_error( L, "QPB: read failed: %s", (const char*) (err) );
+#define QPB_ERR_SLICE(L) luaL_error( L, "QPB: view slice too long" );
+#define QPB_ERR_WRITE(L, err) luaL_error( L, "QPB: write failed: %s", (const char*) (err) );
+#define QPB_ERR_STREAM_CLOSED(L) luaL_error( L, "QPB: stream has been closed." );
+#define QPB_ERR_DETACH(L) luaL_error( L, "QPB: only top level messages, not allocated from an arena, can be detached." );
+#define QPB_ERR_DETACHED(L) luaL_error( L, "QPB: message has been detached." );
+#define QPB_ERR_TOKEN(L, token) luaL_error( L, "QPB: no detached message for token %s", (const char*) (token) );
 #define QPB_ERR_RANGE(L, name, i, size ) luaL_error( L, "QPB: %d out of range %d for field %s", i, size, (const char*) (name) );
 
-// protobuf defines string* msg:add_string(), string* mutable_string()
-// and allows the user to mutate the string contents; 
-// qpb would need a string proxy like the array proxy to support that.
+// pb:mutable_string() and pb:add_string() return a builder over the field's std::string;
+// a field stored as a cord has no std::string to change.
 #define QPB_ERR_MUTE_STRING( L, name )  luaL_error( L, "QPB: mutable strings not supported: %s", (const char*) (name) );
 
 #endif // #ifndef __QPB_FORWARDS_H__
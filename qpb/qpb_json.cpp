@@ -0,0 +1,863 @@
+/**
+ * @file qpb_json.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ *
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_json.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include "qpb_lua.h"
+#include <errno.h>
+#include <float.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+using namespace google::protobuf;
+
+static const char qpb_base64[]= "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+//---------------------------------------------------------------------------
+// message to json
+//---------------------------------------------------------------------------
+
+/**
+ * appends json to a lua buffer; nothing else may touch the lua stack while it's in use.
+ */
+struct QpbJsonWriter
+{
+  QpbJsonWriter( luaL_Buffer* b )
+    : _b( b )
+    , _proto_names( false )
+    , _enum_ints( false )
+    , _defaults( false ) {
+  }
+
+  void message( const Message & msg );
+
+  luaL_Buffer* _b;
+  bool _proto_names;
+  bool _enum_ints;
+  bool _defaults;
+
+private:
+  void raw( const char * s, size_t len ) {
+    luaL_addlstring( _b, s, len );
+  }
+  void raw( const char * s ) {
+    luaL_addlstring( _b, s, strlen( s ) );
+  }
+  void string( const std::string & s );
+  void bytes( const std::string & s );
+  void real( double d, bool single );
+  void field( const Message & msg, const FieldDescriptor* field );
+  void value( const Message & msg, const FieldDescriptor* field, int index );
+  void key( const Message & pair, const FieldDescriptor* field );
+
+  std::string _scratch; // for GetStringReference, which seldom needs it
+};
+
+//---------------------------------------------------------------------------
+// runs of plain characters are copied in one go
+void QpbJsonWriter::string( const std::string & s )
+{
+  static const char hex[]= "0123456789abcdef";
+  luaL_addchar( _b, '"' );
+  const char * p= s.data(), * end= p + s.size(), * run= p;
+  for (; p< end; ++p) {
+    const unsigned char c= (unsigned char) *p;
+    if (c>=0x20 && c!='"' && c!='\\') {
+      continue;
+    }
+    raw( run, p-run );
+    run= p+1;
+    switch (c) {
+      case '"': raw( "\\\"", 2 ); break;
+      case '\\': raw( "\\\\", 2 ); break;
+      case '\b': raw( "\\b", 2 ); break;
+      case '\f': raw( "\\f", 2 ); break;
+      case '\n': raw( "\\n", 2 ); break;
+      case '\r': raw( "\\r", 2 ); break;
+      case '\t': raw( "\\t", 2 ); break;
+      default: {
+        const char u[]= { '\\', 'u', '0', '0', hex[c>>4], hex[c&15] };
+        raw( u, sizeof(u) );
+      }
+    }
+  }
+  raw( run, p-run );
+  luaL_addchar( _b, '"' );
+}
+
+//---------------------------------------------------------------------------
+// standard base64, with padding
+void QpbJsonWriter::bytes( const std::string & s )
+{
+  luaL_addchar( _b, '"' );
+  const unsigned char * p= (const unsigned char*) s.data();
+  size_t left= s.size();
+  for (; left>=3; p+=3, left-=3) {
+    const char out[]= { qpb_base64[p[0]>>2], qpb_base64[((p[0]&3)<<4) | (p[1]>>4)],
+                        qpb_base64[((p[1]&15)<<2) | (p[2]>>6)], qpb_base64[p[2]&63] };
+    raw( out, 4 );
+  }
+  if (left) {
+    const unsigned b1= left>1 ? p[1] : 0;
+    const char out[]= { qpb_base64[p[0]>>2], qpb_base64[((p[0]&3)<<4) | (b1>>4)],
+                        left>1 ? qpb_base64[(b1&15)<<2] : '=', '=' };
+    raw( out, 4 );
+  }
+  luaL_addchar( _b, '"' );
+}
+
+//---------------------------------------------------------------------------
+// the shortest text that reads back as the same value
+void QpbJsonWriter::real( double d, bool single )
+{
+  if (d!=d) {
+    raw( "\"NaN\"" );
+  }
+  else
+  if (d>DBL_MAX || d<-DBL_MAX) {
+    raw( d>0 ? "\"Infinity\"" : "\"-Infinity\"" );
+  }
+  else {
+    char buf[32];
+    int len= snprintf( buf, sizeof(buf), single ? "%.6g" : "%.15g", d );
+    const bool exact= single ? strtof( buf, 0 )==(float) d : strtod( buf, 0 )==d;
+    if (!exact) {
+      len= snprintf( buf, sizeof(buf), single ? "%.9g" : "%.17g", d );
+    }
+    raw( buf, len );
+  }
+}
+
+//---------------------------------------------------------------------------
+// a single value; index is the element for repeated fields, -1 otherwise.
+void QpbJsonWriter::value( const Message & msg, const FieldDescriptor* field, int index )
+{
+  const Reflection * reflect= msg.GetReflection();
+  const bool repeated= index>=0;
+  char buf[32];
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      raw( buf, snprintf( buf, sizeof(buf), "%d", (int) (repeated ? reflect->GetRepeatedInt32( msg, field, index ) : reflect->GetInt32( msg, field )) ) );
+    break;
+    case FieldDescriptor::CPPTYPE_UINT32:
+      raw( buf, snprintf( buf, sizeof(buf), "%u", (unsigned) (repeated ? reflect->GetRepeatedUInt32( msg, field, index ) : reflect->GetUInt32( msg, field )) ) );
+    break;
+    case FieldDescriptor::CPPTYPE_INT64:
+      raw( buf, snprintf( buf, sizeof(buf), "\"%lld\"", (long long) (repeated ? reflect->GetRepeatedInt64( msg, field, index ) : reflect->GetInt64( msg, field )) ) );
+    break;
+    case FieldDescriptor::CPPTYPE_UINT64:
+      raw( buf, snprintf( buf, sizeof(buf), "\"%llu\"", (unsigned long long) (repeated ? reflect->GetRepeatedUInt64( msg, field, index ) : reflect->GetUInt64( msg, field )) ) );
+    break;
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      real( repeated ? reflect->GetRepeatedDouble( msg, field, index ) : reflect->GetDouble( msg, field ), false );
+    break;
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      real( repeated ? reflect->GetRepeatedFloat( msg, field, index ) : reflect->GetFloat( msg, field ), true );
+    break;
+    case FieldDescriptor::CPPTYPE_BOOL:
+      raw( (repeated ? reflect->GetRepeatedBool( msg, field, index ) : reflect->GetBool( msg, field )) ? "true" : "false" );
+    break;
+    case FieldDescriptor::CPPTYPE_ENUM: {
+      const int number= repeated ? reflect->GetRepeatedEnumValue( msg, field, index ) : reflect->GetEnumValue( msg, field );
+      const EnumValueDescriptor* named= _enum_ints ? 0 : field->enum_type()->FindValueByNumber( number );
+      if (named) {
+        string( named->name() );
+      }
+      else {
+        raw( buf, snprintf( buf, sizeof(buf), "%d", number ) );
+      }
+    }
+    break;
+    case FieldDescriptor::CPPTYPE_STRING: {
+      const std::string & s= repeated ? reflect->GetRepeatedStringReference( msg, field, index, &_scratch ) : reflect->GetStringReference( msg, field, &_scratch );
+      if (field->type()==FieldDescriptor::TYPE_BYTES) {
+        bytes( s );
+      }
+      else {
+        string( s );
+      }
+    }
+    break;
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      message( repeated ? reflect->GetRepeatedMessage( msg, field, index ) : reflect->GetMessage( msg, field ) );
+    break;
+  }
+}
+
+//---------------------------------------------------------------------------
+// map keys are always strings
+void QpbJsonWriter::key( const Message & pair, const FieldDescriptor* field )
+{
+  const FieldDescriptor::CppType type= field->cpp_type();
+  if (type==FieldDescriptor::CPPTYPE_STRING || type==FieldDescriptor::CPPTYPE_INT64 || type==FieldDescriptor::CPPTYPE_UINT64) {
+    value( pair, field, -1 ); // already quoted
+  }
+  else {
+    luaL_addchar( _b, '"' );
+    value( pair, field, -1 );
+    luaL_addchar( _b, '"' );
+  }
+}
+
+//---------------------------------------------------------------------------
+// "name": value
+void QpbJsonWriter::field( const Message & msg, const FieldDescriptor* field )
+{
+  string( _proto_names ? field->name() : field->json_name() );
+  luaL_addchar( _b, ':' );
+  if (field->is_map()) {
+    const Reflection * reflect= msg.GetReflection();
+    const Descriptor * entry= field->message_type();
+    const int size= reflect->FieldSize( msg, field );
+    luaL_addchar( _b, '{' );
+    for (int i=0; i< size; ++i) {
+      const Message & pair= reflect->GetRepeatedMessage( msg, field, i );
+      if (i) {
+        luaL_addchar( _b, ',' );
+      }
+      key( pair, entry->map_key() );
+      luaL_addchar( _b, ':' );
+      value( pair, entry->map_value(), -1 );
+    }
+    luaL_addchar( _b, '}' );
+  }
+  else
+  if (field->is_repeated()) {
+    const int size= msg.GetReflection()->FieldSize( msg, field );
+    luaL_addchar( _b, '[' );
+    for (int i=0; i< size; ++i) {
+      if (i) {
+        luaL_addchar( _b, ',' );
+      }
+      value( msg, field, i );
+    }
+    luaL_addchar( _b, ']' );
+  }
+  else {
+    value( msg, field, -1 );
+  }
+}
+
+//---------------------------------------------------------------------------
+void QpbJsonWriter::message( const Message & msg )
+{
+  const Descriptor * desc= msg.GetDescriptor();
+  const Reflection * reflect= msg.GetReflection();
+  const int field_count= desc->field_count();
+  bool first= true;
+  luaL_addchar( _b, '{' );
+  for (int i=0; i< field_count; ++i) {
+    const FieldDescriptor * f= desc->field(i);
+    bool has= f->is_repeated() ? reflect->FieldSize( msg, f )>0 : reflect->HasField( msg, f );
+    if (!has && _defaults) {
+      // like protobuf's always_print_primitive_fields: not messages, nor the unset members of a oneof
+      has= f->is_repeated() || (f->cpp_type()!=FieldDescriptor::CPPTYPE_MESSAGE && !f->containing_oneof());
+    }
+    if (has) {
+      if (!first) {
+        luaL_addchar( _b, ',' );
+      }
+      first= false;
+      field( msg, f );
+    }
+  }
+  luaL_addchar( _b, '}' );
+}
+
+//---------------------------------------------------------------------------
+int QpbJson::ToJson( lua_State * L, const Message & msg, int options )
+{
+  luaL_Buffer b;
+  QpbJsonWriter writer( &b );
+  if (!lua_isnoneornil( L, options )) {
+    luaL_checktype( L, options, LUA_TTABLE );
+    lua_getfield( L, options, "proto_names" );
+    writer._proto_names= lua_toboolean( L, -1 )!=0;
+    lua_getfield( L, options, "enum_ints" );
+    writer._enum_ints= lua_toboolean( L, -1 )!=0;
+    lua_getfield( L, options, "defaults" );
+    writer._defaults= lua_toboolean( L, -1 )!=0;
+    lua_pop( L, 3 );
+  }
+  luaL_buffinit( L, &b );
+  writer.message( msg );
+  luaL_pushresult( &b );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// json to message
+//---------------------------------------------------------------------------
+
+/**
+ * a recursive descent parser, straight into the message's fields.
+ * lua errors would skip the destructors of the parser's strings,
+ * so a failure pushes its description and unwinds; MergeJson raises the error once the parser is gone.
+ */
+struct QpbJsonParser
+{
+  QpbJsonParser( lua_State * L, const char * json, size_t len )
+    : L( L )
+    , _begin( json )
+    , _p( json )
+    , _end( json + len )
+    , _depth( 0 ) {
+  }
+
+  // the whole text is one object
+  bool parse( Message * msg ) {
+    if (!message( msg )) {
+      return false;
+    }
+    space();
+    return _p==_end || fail( "trailing characters" );
+  }
+  int offset() const {
+    return (int) (_p - _begin);
+  }
+
+private:
+  bool fail( const char * what ) {
+    lua_pushstring( L, what );
+    return false;
+  }
+  void space() {
+    while (_p< _end && (*_p==' ' || *_p=='\t' || *_p=='\n' || *_p=='\r')) {
+      ++_p;
+    }
+  }
+  bool next( char c ) {
+    space();
+    if (_p< _end && *_p==c) {
+      ++_p;
+      return true;
+    }
+    return false;
+  }
+  bool literal( const char * word ) {
+    const size_t len= strlen( word );
+    space();
+    if ((size_t) (_end-_p)>=len && memcmp( _p, word, len )==0) {
+      _p+= len;
+      return true;
+    }
+    return false;
+  }
+  bool string( std::string * out );
+  bool number( const char ** text, size_t * len );
+  bool scalar( const char ** text, size_t * len, bool * quoted );
+  bool message( Message * msg );
+  bool field( Message * msg, const FieldDescriptor * field );
+  bool value( Message * msg, const FieldDescriptor * field, bool add );
+  bool assign( Message * msg, const FieldDescriptor * field, bool add, const char * text, size_t len, bool quoted );
+  const FieldDescriptor * find( const Descriptor * desc, const std::string & name ) const;
+
+  lua_State * L;
+  const char * _begin, * _p, * _end;
+  int _depth;
+  std::string _key, _text; // a field name, and an escaped value
+};
+
+//---------------------------------------------------------------------------
+static void qpb_utf8( std::string * out, unsigned long c )
+{
+  if (c< 0x80) {
+    out->push_back( (char) c );
+  }
+  else if (c< 0x800) {
+    out->push_back( (char) (0xC0 | (c>>6)) );
+    out->push_back( (char) (0x80 | (c&0x3F)) );
+  }
+  else if (c< 0x10000) {
+    out->push_back( (char) (0xE0 | (c>>12)) );
+    out->push_back( (char) (0x80 | ((c>>6)&0x3F)) );
+    out->push_back( (char) (0x80 | (c&0x3F)) );
+  }
+  else {
+    out->push_back( (char) (0xF0 | (c>>18)) );
+    out->push_back( (char) (0x80 | ((c>>12)&0x3F)) );
+    out->push_back( (char) (0x80 | ((c>>6)&0x3F)) );
+    out->push_back( (char) (0x80 | (c&0x3F)) );
+  }
+}
+
+//---------------------------------------------------------------------------
+static bool qpb_hex4( const char * p, unsigned long * out )
+{
+  unsigned long c=0;
+  for (int i=0; i< 4; ++i) {
+    const char h= p[i];
+    c<<= 4;
+    if (h>='0' && h<='9') c|= h-'0';
+    else if (h>='a' && h<='f') c|= h-'a'+10;
+    else if (h>='A' && h<='F') c|= h-'A'+10;
+    else return false;
+  }
+  *out= c;
+  return true;
+}
+
+//---------------------------------------------------------------------------
+// a quoted string; the unescaped contents go to out.
+bool QpbJsonParser::string( std::string * out )
+{
+  if (!next( '"' )) {
+    return fail( "expected a string" );
+  }
+  out->clear();
+  const char * run= _p;
+  while (_p< _end && *_p!='"') {
+    if ((unsigned char) *_p< 0x20) {
+      return fail( "control character in string" );
+    }
+    if (*_p!='\\') {
+      ++_p;
+      continue;
+    }
+    out->append( run, _p-run );
+    if (++_p==_end) {
+      break;
+    }
+    const char e= *_p++;
+    switch (e) {
+      case '"': case '\\': case '/': out->push_back( e ); break;
+      case 'b': out->push_back( '\b' ); break;
+      case 'f': out->push_back( '\f' ); break;
+      case 'n': out->push_back( '\n' ); break;
+      case 'r': out->push_back( '\r' ); break;
+      case 't': out->push_back( '\t' ); break;
+      case 'u': {
+        unsigned long c=0, low=0;
+        if (_end-_p< 4 || !qpb_hex4( _p, &c )) {
+          return fail( "bad unicode escape" );
+        }
+        _p+= 4;
+        // a surrogate pair makes up a single code point
+        if (c>=0xD800 && c<=0xDBFF && _end-_p>=6 && _p[0]=='\\' && _p[1]=='u' && qpb_hex4( _p+2, &low ) && low>=0xDC00 && low<=0xDFFF) {
+          c= 0x10000 + ((c-0xD800)<<10) + (low-0xDC00);
+          _p+= 6;
+        }
+        qpb_utf8( out, c );
+      }
+      break;
+      default:
+        return fail( "bad escape" );
+    }
+    run= _p;
+  }
+  if (_p==_end) {
+    return fail( "unterminated string" );
+  }
+  out->append( run, _p-run );
+  ++_p;
+  return true;
+}
+
+//---------------------------------------------------------------------------
+// the text of a json number, left in place
+bool QpbJsonParser::number( const char ** text, size_t * len )
+{
+  space();
+  const char * start= _p;
+  if (_p< _end && *_p=='-') ++_p;
+  const char * digits= _p;
+  while (_p< _end && *_p>='0' && *_p<='9') ++_p;
+  if (_p==digits) {
+    return fail( "expected a value" );
+  }
+  if (_p< _end && *_p=='.') {
+    ++_p;
+    while (_p< _end && *_p>='0' && *_p<='9') ++_p;
+  }
+  if (_p< _end && (*_p=='e' || *_p=='E')) {
+    ++_p;
+    if (_p< _end && (*_p=='+' || *_p=='-')) ++_p;
+    while (_p< _end && *_p>='0' && *_p<='9') ++_p;
+  }
+  *text= start;
+  *len= _p-start;
+  return true;
+}
+
+//---------------------------------------------------------------------------
+// a number, literal, or string; strings are unescaped into _text
+bool QpbJsonParser::scalar( const char ** text, size_t * len, bool * quoted )
+{
+  space();
+  *quoted= _p< _end && *_p=='"';
+  if (*quoted) {
+    if (!string( &_text )) {
+      return false;
+    }
+    *text= _text.data();
+    *len= _text.size();
+    return true;
+  }
+  if (literal( "true" )) {
+    *text= "true";
+    *len= 4;
+    return true;
+  }
+  if (literal( "false" )) {
+    *text= "false";
+    *len= 5;
+    return true;
+  }
+  return number( text, len );
+}
+
+//---------------------------------------------------------------------------
+// json numbers, or numbers in strings, for numeric fields
+static bool qpb_json_integer( const char * text, size_t len, bool is_signed, long long * s, unsigned long long * u )
+{
+  char buf[40];
+  if (len==0 || len>= sizeof(buf)) {
+    return false;
+  }
+  memcpy( buf, text, len );
+  buf[len]= 0;
+  char * end= 0;
+  errno= 0;
+  if (strpbrk( buf, ".eE" )) {
+    // 1e3 and 5.0 are integers too
+    const double d= strtod( buf, &end );
+    if (*end || d!=floor( d ) || (is_signed ? (d< -9223372036854775808.0 || d>= 9223372036854775808.0) : (d< 0 || d>= 18446744073709551616.0))) {
+      return false;
+    }
+    *s= is_signed ? (long long) d : 0;
+    *u= is_signed ? 0 : (unsigned long long) d;
+  }
+  else if (is_signed) {
+    *s= strtoll( buf, &end, 10 );
+  }
+  else {
+    if (buf[0]=='-') {
+      return false;
+    }
+    *u= strtoull( buf, &end, 10 );
+  }
+  return !*end && errno==0;
+}
+
+//---------------------------------------------------------------------------
+static bool qpb_json_real( const char * text, size_t len, double * d )
+{
+  char buf[64];
+  if (len==8 && memcmp( text, "Infinity", 8 )==0) {
+    *d= HUGE_VAL;
+  }
+  else if (len==9 && memcmp( text, "-Infinity", 9 )==0) {
+    *d= -HUGE_VAL;
+  }
+  else if (len==3 && memcmp( text, "NaN", 3 )==0) {
+    *d= NAN;
+  }
+  else {
+    if (len==0 || len>= sizeof(buf)) {
+      return false;
+    }
+    memcpy( buf, text, len );
+    buf[len]= 0;
+    char * end= 0;
+    *d= strtod( buf, &end );
+    if (*end) {
+      return false;
+    }
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------
+static int qpb_base64_digit( char c )
+{
+  if (c>='A' && c<='Z') return c-'A';
+  if (c>='a' && c<='z') return c-'a'+26;
+  if (c>='0' && c<='9') return c-'0'+52;
+  if (c=='+' || c=='-') return 62;
+  if (c=='/' || c=='_') return 63;
+  return -1;
+}
+
+//---------------------------------------------------------------------------
+// standard or url safe base64, padded or not
+static bool qpb_json_bytes( const char * text, size_t len, std::string * out )
+{
+  while (len && text[len-1]=='=') {
+    --len;
+  }
+  out->clear();
+  out->reserve( len*3/4 );
+  unsigned long bits=0;
+  int count=0;
+  for (size_t i=0; i< len; ++i) {
+    const int d= qpb_base64_digit( text[i] );
+    if (d<0) {
+      return false;
+    }
+    bits= (bits<<6) | d;
+    if (++count==4) {
+      out->push_back( (char) (bits>>16) );
+      out->push_back( (char) (bits>>8) );
+      out->push_back( (char) bits );
+      bits=0;
+      count=0;
+    }
+  }
+  if (count==1) {
+    return false;
+  }
+  if (count==2) {
+    out->push_back( (char) (bits>>4) );
+  }
+  if (count==3) {
+    out->push_back( (char) (bits>>10) );
+    out->push_back( (char) (bits>>2) );
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------
+// set or add a scalar field from its text
+bool QpbJsonParser::assign( Message * msg, const FieldDescriptor * field, bool add, const char * text, size_t len, bool quoted )
+{
+  const Reflection * reflect= msg->GetReflection();
+  long long s=0;
+  unsigned long long u=0;
+  double d=0;
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      if (!qpb_json_integer( text, len, true, &s, &u ) || s< INT32_MIN || s> INT32_MAX) {
+        return fail( "expected a 32 bit integer" );
+      }
+      add ? reflect->AddInt32( msg, field, (int32) s ) : reflect->SetInt32( msg, field, (int32) s );
+    break;
+    case FieldDescriptor::CPPTYPE_INT64:
+      if (!qpb_json_integer( text, len, true, &s, &u )) {
+        return fail( "expected a 64 bit integer" );
+      }
+      add ? reflect->AddInt64( msg, field, (int64) s ) : reflect->SetInt64( msg, field, (int64) s );
+    break;
+    case FieldDescriptor::CPPTYPE_UINT32:
+      if (!qpb_json_integer( text, len, false, &s, &u ) || u> UINT32_MAX) {
+        return fail( "expected an unsigned 32 bit integer" );
+      }
+      add ? reflect->AddUInt32( msg, field, (uint32) u ) : reflect->SetUInt32( msg, field, (uint32) u );
+    break;
+    case FieldDescriptor::CPPTYPE_UINT64:
+      if (!qpb_json_integer( text, len, false, &s, &u )) {
+        return fail( "expected an unsigned 64 bit integer" );
+      }
+      add ? reflect->AddUInt64( msg, field, (uint64) u ) : reflect->SetUInt64( msg, field, (uint64) u );
+    break;
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      if (!qpb_json_real( text, len, &d )) {
+        return fail( "expected a number" );
+      }
+      add ? reflect->AddDouble( msg, field, d ) : reflect->SetDouble( msg, field, d );
+    break;
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      if (!qpb_json_real( text, len, &d ) || (d==d && d>-HUGE_VAL && d<HUGE_VAL && (d> FLT_MAX || d< -FLT_MAX))) {
+        return fail( "expected a float" );
+      }
+      add ? reflect->AddFloat( msg, field, (float) d ) : reflect->SetFloat( msg, field, (float) d );
+    break;
+    case FieldDescriptor::CPPTYPE_BOOL: {
+      // map keys are the only quoted booleans
+      const bool t= len==4 && memcmp( text, "true", 4 )==0;
+      if (!t && !(len==5 && memcmp( text, "false", 5 )==0)) {
+        return fail( "expected a boolean" );
+      }
+      add ? reflect->AddBool( msg, field, t ) : reflect->SetBool( msg, field, t );
+    }
+    break;
+    case FieldDescriptor::CPPTYPE_ENUM: {
+      int number=0;
+      if (quoted) {
+        const EnumValueDescriptor* named= field->enum_type()->FindValueByName( std::string( text, len ) );
+        if (!named) {
+          return fail( "unknown enum value" );
+        }
+        number= named->number();
+      }
+      else {
+        if (!qpb_json_integer( text, len, true, &s, &u ) || s< INT32_MIN || s> INT32_MAX) {
+          return fail( "expected an enum" );
+        }
+        number= (int) s;
+      }
+      add ? reflect->AddEnumValue( msg, field, number ) : reflect->SetEnumValue( msg, field, number );
+    }
+    break;
+    case FieldDescriptor::CPPTYPE_STRING: {
+      if (!quoted) {
+        return fail( "expected a string" );
+      }
+      std::string value;
+      if (field->type()==FieldDescriptor::TYPE_BYTES) {
+        if (!qpb_json_bytes( text, len, &value )) {
+          return fail( "expected base64" );
+        }
+      }
+      else {
+        value.assign( text, len );
+      }
+      add ? reflect->AddString( msg, field, value ) : reflect->SetString( msg, field, value );
+    }
+    break;
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      return fail( "expected an object" );
+  }
+  return true;
+}
+
+//---------------------------------------------------------------------------
+// a single value: a message, or a scalar
+bool QpbJsonParser::value( Message * msg, const FieldDescriptor * field, bool add )
+{
+  if (field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE) {
+    const Reflection * reflect= msg->GetReflection();
+    return message( add ? reflect->AddMessage( msg, field ) : reflect->MutableMessage( msg, field ) );
+  }
+  const char * text= 0;
+  size_t len= 0;
+  bool quoted= false;
+  if (!scalar( &text, &len, &quoted )) {
+    return false;
+  }
+  // only strings, bytes, and enum names are quoted; but any number may be
+  if (!quoted && (text[0]=='t' || text[0]=='f') && field->cpp_type()!=FieldDescriptor::CPPTYPE_BOOL) {
+    return fail( "unexpected boolean" );
+  }
+  if (quoted && field->cpp_type()==FieldDescriptor::CPPTYPE_BOOL) {
+    return fail( "expected a boolean" );
+  }
+  return assign( msg, field, add, text, len, quoted );
+}
+
+//---------------------------------------------------------------------------
+// a field's whole value: an array for repeated fields, an object for maps
+bool QpbJsonParser::field( Message * msg, const FieldDescriptor * field )
+{
+  if (literal( "null" )) {
+    msg->GetReflection()->ClearField( msg, field );
+    return true;
+  }
+  if (field->is_map()) {
+    const Descriptor * entry= field->message_type();
+    if (!next( '{' )) {
+      return fail( "expected an object" );
+    }
+    if (next( '}' )) {
+      return true;
+    }
+    do {
+      Message * pair= msg->GetReflection()->AddMessage( msg, field );
+      if (!string( &_key ) || !assign( pair, entry->map_key(), false, _key.data(), _key.size(), true )) {
+        return false;
+      }
+      if (!next( ':' )) {
+        return fail( "expected ':'" );
+      }
+      if (!value( pair, entry->map_value(), false )) {
+        return false;
+      }
+    } while (next( ',' ));
+    return next( '}' ) || fail( "expected '}'" );
+  }
+  if (field->is_repeated()) {
+    if (!next( '[' )) {
+      return fail( "expected an array" );
+    }
+    if (next( ']' )) {
+      return true;
+    }
+    do {
+      if (!value( msg, field, true )) {
+        return false;
+      }
+    } while (next( ',' ));
+    return next( ']' ) || fail( "expected ']'" );
+  }
+  return value( msg, field, false );
+}
+
+//---------------------------------------------------------------------------
+// the .proto name, or the json name
+const FieldDescriptor * QpbJsonParser::find( const Descriptor * desc, const std::string & name ) const
+{
+  const FieldDescriptor * field= desc->FindFieldByName( name );
+  if (!field) {
+    field= desc->FindFieldByCamelcaseName( name );
+  }
+  for (int i=0; !field && i< desc->field_count(); ++i) {
+    if (desc->field(i)->json_name()==name) {
+      field= desc->field(i);
+    }
+  }
+  return field;
+}
+
+//---------------------------------------------------------------------------
+bool QpbJsonParser::message( Message * msg )
+{
+  if (++_depth> 100) {
+    return fail( "nested too deeply" );
+  }
+  if (!next( '{' )) {
+    return fail( "expected an object" );
+  }
+  if (!next( '}' )) {
+    const Descriptor * desc= msg->GetDescriptor();
+    do {
+      if (!string( &_key )) {
+        return false;
+      }
+      const FieldDescriptor * f= find( desc, _key );
+      if (!f) {
+        lua_pushfstring( L, "unknown field %s", _key.c_str() );
+        return false;
+      }
+      if (!next( ':' )) {
+        return fail( "expected ':'" );
+      }
+      if (!field( msg, f )) {
+        return false;
+      }
+    } while (next( ',' ));
+    if (!next( '}' )) {
+      return fail( "expected '}'" );
+    }
+  }
+  --_depth;
+  return true;
+}
+
+//---------------------------------------------------------------------------
+void QpbJson::MergeJson( lua_State * L, Message * msg, int idx )
+{
+  size_t len=0;
+  const char * json= luaL_checklstring( L, idx, &len );
+  int failed= -1;
+  {
+    QpbJsonParser parser( L, json, len );
+    if (!parser.parse( msg )) {
+      failed= parser.offset();
+    }
+  }
+  if (failed>=0) {
+    QPB_ERR_JSON( L, msg->GetDescriptor()->full_name().c_str(), lua_tostring( L, -1 ), failed );
+  }
+}
@@ -0,0 +1,46 @@
+/**
+ * @file qpb_json.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ *
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_JSON_H__
+#define __QPB_JSON_H__
+
+#include "qpb_forwards.h"
+
+//---------------------------------------------------------------------------
+/**
+ * whole message conversion to and from json text, following protobuf's json mapping:
+ * fields are named in lowerCamelCase, 64 bit integers are strings, bytes are base64,
+ * enums are value names, and maps are objects.
+ * the well known types ( Timestamp, Any, ... ) are written as ordinary messages.
+ */
+struct QpbJson
+{
+  typedef google::protobuf::Message Message;
+
+  /**
+   * push the json text of msg, written straight into a lua buffer.
+   * @param options stack index of an optional table:
+   *        proto_names= true names fields as the .proto does,
+   *        enum_ints= true writes enums as numbers,
+   *        defaults= true also writes unset scalar and repeated fields.
+   * @return 1
+   */
+  static int ToJson( lua_State*, const Message& msg, int options );
+
+  /**
+   * merge the json text at idx into msg, parsing the lua string in place.
+   * fields are accepted by either name; null leaves a field cleared.
+   * raises a lua error for malformed json, or json that doesn't fit msg.
+   */
+  static void MergeJson( lua_State*, Message* msg, int idx );
+};
+
+#endif // #ifndef __QPB_JSON_H__
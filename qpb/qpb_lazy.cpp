@@ -0,0 +1,129 @@
+/**
+ * @file qpb_lazy.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ *
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_lazy.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <limits.h>
+
+using namespace google::protobuf;
+using namespace google::protobuf::internal;
+
+//---------------------------------------------------------------------------
+// fields come first, then one group per oneof, and last the unknown fields
+static int qpb_lazy_group( const Descriptor* desc, const FieldDescriptor* field )
+{
+  int group= desc->field_count() + desc->oneof_decl_count();
+  if (field && !field->is_extension()) {
+    const OneofDescriptor* oneof= field->containing_oneof();
+    group= oneof ? desc->field_count() + oneof->index() : field->index();
+  }
+  return group;
+}
+
+//---------------------------------------------------------------------------
+QpbLazy* QpbLazy::Index( const Descriptor* desc, const char* bytes, size_t size )
+{
+  if (size > INT_MAX) {
+    return 0;
+  }
+  QpbLazy* lazy= new QpbLazy();
+  lazy->_bytes.assign( bytes, size );
+  const int groups= qpb_lazy_group( desc, 0 ) + 1;
+
+  // the tags in wire order, and the group of each
+  std::vector<int> wire;
+  std::vector<int> group_of;
+  std::vector<int> counts( groups, 0 );
+  io::CodedInputStream in( (const uint8*) lazy->_bytes.data(), (int) size );
+  bool ok= true;
+  while (ok) {
+    const int start= in.CurrentPosition();
+    const uint32 tag= in.ReadTag();
+    if (!tag) {
+      break;
+    }
+    ok= WireFormatLite::GetTagWireType( tag )!=WireFormatLite::WIRETYPE_END_GROUP && WireFormatLite::SkipField( &in, tag );
+    const int group= qpb_lazy_group( desc, desc->FindFieldByNumber( WireFormatLite::GetTagFieldNumber( tag ) ) );
+    wire.push_back( start );
+    group_of.push_back( group );
+    ++counts[group];
+  }
+  ok= ok && in.ConsumedEntireMessage();
+
+  // required fields are checked up front, the same as an eager parse would
+  for (int i=0; ok && i< desc->field_count(); ++i) {
+    const FieldDescriptor* field= desc->field(i);
+    ok= !field->is_required() || counts[ qpb_lazy_group( desc, field ) ]>0;
+  }
+  if (!ok) {
+    delete lazy;
+    return 0;
+  }
+
+  // a stable counting sort keeps the wire order within each group
+  lazy->_groups.resize( groups+1 );
+  lazy->_groups[0]= 0;
+  for (int g=0; g< groups; ++g) {
+    lazy->_groups[g+1]= lazy->_groups[g] + counts[g];
+    counts[g]= lazy->_groups[g];
+  }
+  lazy->_spans.resize( wire.size() );
+  for (size_t i=0; i< wire.size(); ++i) {
+    lazy->_spans[ counts[group_of[i]]++ ]= wire[i];
+  }
+  lazy->_parsed.assign( groups, false );
+  return lazy;
+}
+
+//---------------------------------------------------------------------------
+bool QpbLazy::Touch( Message* msg, const FieldDescriptor* field )
+{
+  const int group= qpb_lazy_group( msg->GetDescriptor(), field );
+  return _parsed[group] || Parse( msg, group );
+}
+
+//---------------------------------------------------------------------------
+bool QpbLazy::Complete( Message* msg )
+{
+  bool ok= true;
+  for (size_t g=0; g< _parsed.size(); ++g) {
+    if (!_parsed[g] && !Parse( msg, (int) g )) {
+      ok= false;
+    }
+  }
+  return ok;
+}
+
+//---------------------------------------------------------------------------
+// the spans of a group are in wire order, so one stream skips forward through them
+bool QpbLazy::Parse( Message* msg, int group )
+{
+  _parsed[group]= true;
+  const Descriptor* desc= msg->GetDescriptor();
+  const Reflection* reflect= msg->GetReflection();
+  io::CodedInputStream in( (const uint8*) _bytes.data(), (int) _bytes.size() );
+  bool ok= true;
+  for (int i= _groups[group]; ok && i< _groups[group+1]; ++i) {
+    ok= in.Skip( _spans[i] - in.CurrentPosition() );
+    const uint32 tag= ok ? in.ReadTag() : 0;
+    const int number= WireFormatLite::GetTagFieldNumber( tag );
+    const FieldDescriptor* field= desc->FindFieldByNumber( number );
+    if (!field && desc->IsExtensionNumber( number )) {
+      field= reflect->FindKnownExtensionByNumber( number );
+    }
+    ok= ok && WireFormat::ParseAndMergeField( tag, field, msg, &in );
+  }
+  return ok;
+}
@@ -0,0 +1,72 @@
+/**
+ * @file qpb_lazy.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ *
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_LAZY_H__
+#define __QPB_LAZY_H__
+
+#include "qpb_forwards.h"
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+/**
+ * the wire format bytes of a lazily decoded message ( QPB.decode_lazy ),
+ * with the offsets of each of its top level fields.
+ * a field is parsed into the message the first time it's used;
+ * until the message changes, encoding it hands back the original bytes.
+ *
+ * fields of a oneof are parsed together, so that the last one on the wire still wins.
+ */
+struct QpbLazy
+{
+  typedef google::protobuf::Message Message;
+  typedef google::protobuf::Descriptor Descriptor;
+  typedef google::protobuf::FieldDescriptor FieldDescriptor;
+
+  /**
+   * copy the bytes, and find where each field is.
+   * @return 0 if the top level of the bytes is malformed, or misses a required field.
+   */
+  static QpbLazy* Index( const Descriptor* desc, const char* bytes, size_t size );
+
+  /**
+   * parse field ( and the rest of its oneof ) into msg, if it hasn't been yet.
+   * @return false for malformed field bytes; the field counts as parsed either way.
+   */
+  bool Touch( Message* msg, const FieldDescriptor* field );
+
+  /**
+   * parse every remaining field, and any unknown fields, into msg.
+   */
+  bool Complete( Message* msg );
+
+  /**
+   * the original bytes, or 0 once the message was changed.
+   */
+  const std::string* Pristine() const {
+    return _modified ? 0 : &_bytes;
+  }
+  void Modified() {
+    _modified= true;
+  }
+
+private:
+  QpbLazy() : _modified(false) {}
+  bool Parse( Message* msg, int group );
+
+  std::string _bytes;
+  std::vector<int> _spans;   // the offset of each field's tag, in wire order within each group
+  std::vector<int> _groups;  // per group, its first span; one extra entry ends the last group
+  std::vector<bool> _parsed; // per group
+  bool _modified;
+};
+
+#endif // #ifndef __QPB_LAZY_H__
@@ -0,0 +1,110 @@
+/**
+ * @file qpb_lua.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_LUA_H__
+#define __QPB_LUA_H__
+
+extern "C" {
+#include <lua.h>
+#include <lauxlib.h>
+}
+
+//---------------------------------------------------------------------------
+/**
+ * qpb is written against the lua 5.2 api.
+ * this fills in what lua 5.1 and luajit lack, and what lua 5.3 and 5.4 have since dropped.
+ * ( the 5.1 versions are redirected with macros, so luajit's own copies of some of them don't collide )
+ */
+#if LUA_VERSION_NUM < 502
+
+inline int qpb_absindex( lua_State* L, int idx ) {
+  return (idx > 0 || idx <= LUA_REGISTRYINDEX) ? idx : lua_gettop( L ) + idx + 1;
+}
+#define lua_absindex qpb_absindex
+
+#define lua_rawlen lua_objlen
+
+inline void qpb_rawgetp( lua_State* L, int idx, const void* p ) {
+  idx= qpb_absindex( L, idx );
+  lua_pushlightuserdata( L, const_cast<void*>(p) );
+  lua_rawget( L, idx );
+}
+#define lua_rawgetp qpb_rawgetp
+
+inline void qpb_rawsetp( lua_State* L, int idx, const void* p ) {
+  idx= qpb_absindex( L, idx );
+  lua_pushlightuserdata( L, const_cast<void*>(p) );
+  lua_insert( L, -2 );
+  lua_rawset( L, idx );
+}
+#define lua_rawsetp qpb_rawsetp
+
+inline lua_Integer qpb_tointegerx( lua_State* L, int idx, int* isnum ) {
+  if (isnum) {
+    *isnum= lua_isnumber( L, idx );
+  }
+  return lua_tointeger( L, idx );
+}
+#define lua_tointegerx qpb_tointegerx
+
+// the functions share nup upvalues from the top of the stack, which are then popped.
+inline void qpb_setfuncs( lua_State* L, const luaL_Reg* l, int nup ) {
+  luaL_checkstack( L, nup, "too many upvalues" );
+  for (; l->name; ++l) {
+    for (int i=0; i< nup; ++i) {
+      lua_pushvalue( L, -nup );
+    }
+    lua_pushcclosure( L, l->func, nup );
+    lua_setfield( L, -(nup + 2), l->name );
+  }
+  lua_pop( L, nup );
+}
+#define luaL_setfuncs qpb_setfuncs
+
+// the 5.1 buffer can't hand out a block of a given size; a scratch userdata stands in for it.
+inline char* qpb_buffinitsize( lua_State* L, luaL_Buffer* b, size_t size ) {
+  luaL_buffinit( L, b );
+  return (char*) lua_newuserdata( L, size );
+}
+#define luaL_buffinitsize qpb_buffinitsize
+
+inline void qpb_pushresultsize( luaL_Buffer* b, size_t size ) {
+  lua_State* L= b->L;
+  lua_pushlstring( L, (const char*) lua_touserdata( L, -1 ), size );
+  lua_remove( L, -2 );
+}
+#define luaL_pushresultsize qpb_pushresultsize
+
+inline void* qpb_testudata( lua_State* L, int idx, const char* tname ) {
+  void* p= lua_touserdata( L, idx );
+  if (p && lua_getmetatable( L, idx )) {
+    luaL_getmetatable( L, tname );
+    if (!lua_rawequal( L, -1, -2 )) {
+      p= 0;
+    }
+    lua_pop( L, 2 );
+  }
+  else {
+    p= 0;
+  }
+  return p;
+}
+#define luaL_testudata qpb_testudata
+
+#endif // LUA_VERSION_NUM < 502
+
+// lua 5.3 only has these with LUA_COMPAT_APIINTCASTS, and 5.4 not at all.
+#ifndef luaL_checkint
+#define luaL_checkint(L,n)    ((int)luaL_checkinteger(L, (n)))
+#define luaL_optint(L,n,d)    ((int)luaL_optinteger(L, (n), (d)))
+#endif
+
+#endif // #ifndef __QPB_LUA_H__
@@ -0,0 +1,609 @@
+/**
+ * @file qpb_map.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ *
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_map.h"
+#include "qpb.h"
+#include "qpb_message.h"
+#include "qpb_access.h"
+#include "qpb_stats.h"
+#include "qpb_table.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include "qpb_lua.h"
+#include <string>
+
+using namespace google::protobuf;
+#include "qpb_convert.h"
+
+//---------------------------------------------------------------------------
+/**
+ * lua keys of type T. a lua value of the wrong type is no key at all, so a lookup with it finds nothing.
+ * a key is pushed the same way reading it from an entry pushes it, so 1 and 1.0 are the same key in the index.
+ */
+template <typename T>
+struct QpbMapKey {
+  static bool Push( lua_State* L, int idx ) {
+    const bool ok= lua_type( L, idx )==LUA_TNUMBER;
+    if (ok) {
+      QpbConvert<T>::Push( L, QpbConvert<T>::To( L, idx ) );
+    }
+    return ok;
+  }
+};
+
+template <> inline bool QpbMapKey<bool>::Push( lua_State* L, int idx ) {
+  const bool ok= lua_type( L, idx )==LUA_TBOOLEAN;
+  if (ok) {
+    lua_pushvalue( L, idx );
+  }
+  return ok;
+}
+
+template <> inline bool QpbMapKey<std::string>::Push( lua_State* L, int idx ) {
+  const bool ok= lua_type( L, idx )==LUA_TSTRING;
+  if (ok) {
+    lua_pushvalue( L, idx );
+  }
+  return ok;
+}
+
+// floating point values, enums, and messages are never keys
+static bool qpb_map_no_key( lua_State*, int ) {
+  return false;
+}
+
+typedef bool (*QpbMapKeyPush)( lua_State*, int idx );
+
+// indexed by FieldDescriptor::CppType
+static const QpbMapKeyPush qpb_map_keys[FieldDescriptor::MAX_CPPTYPE+1]= {
+  0,
+  QpbMapKey<int32>::Push,         // CPPTYPE_INT32
+  QpbMapKey<int64>::Push,         // CPPTYPE_INT64
+  QpbMapKey<uint32>::Push,        // CPPTYPE_UINT32
+  QpbMapKey<uint64>::Push,        // CPPTYPE_UINT64
+  qpb_map_no_key,                 // CPPTYPE_DOUBLE
+  qpb_map_no_key,                 // CPPTYPE_FLOAT
+  QpbMapKey<bool>::Push,          // CPPTYPE_BOOL
+  qpb_map_no_key,                 // CPPTYPE_ENUM
+  QpbMapKey<std::string>::Push,   // CPPTYPE_STRING
+  qpb_map_no_key,                 // CPPTYPE_MESSAGE
+};
+
+//---------------------------------------------------------------------------
+// push the table of indexes, registry[QPB_MAP_INDEX_TABLE][proxy]; weak keyed, an index goes away with its proxy.
+static void qpb_map_indexes( lua_State * L )
+{
+  lua_getfield( L, LUA_REGISTRYINDEX, QPB_MAP_INDEX_TABLE );
+  if (lua_isnil( L, -1 )) {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_createtable( L, 0, 1 );
+    lua_pushliteral( L, "k" );
+    lua_setfield( L, -2, "__mode" );
+    lua_setmetatable( L, -2 );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, QPB_MAP_INDEX_TABLE );
+  }
+}
+
+//---------------------------------------------------------------------------
+// QpbMap
+//---------------------------------------------------------------------------
+int QpbMap::PushProxy( lua_State* L, const QpbRef & msg, const FieldDescriptor *field )
+{
+  // each map is only wrapped once per tree, in the slot an array of the field would use
+  msg.PushSlot( L, QPB_OWNER_SELF, 1 + field->index() );
+  lua_rawgetp( L, -1, msg.Key() );
+  const QpbMap* cached= (const QpbMap*) luaL_testudata( L, -1, QPB_MAP_METATABLE );
+  if (cached && cached->_field==field) {
+    lua_remove( L, -2 ); // the cache
+    return 1;
+  }
+  lua_pop( L, 1 );
+  const int cache= lua_gettop( L );
+
+  // lua 'throws' on failed allocation
+  QpbMap* proxy= (QpbMap*)lua_newuserdata( L, sizeof(QpbMap) );
+  QPB_STAT( handles_map );
+  luaL_getmetatable( L, QPB_MAP_METATABLE );
+  lua_setmetatable( L, -2 );
+  proxy->_msg= msg;
+  proxy->_field= field;
+  proxy->_changes= 0;
+  proxy->_size= 0;
+  proxy->_count= 0;
+  proxy->_indexed= false;
+  proxy->_duplicates= false;
+  QpbRef::SetOwner( L, -1, QPB_OWNER_SELF );
+  lua_pushvalue( L, -1 );
+  lua_rawsetp( L, cache, msg.Key() );
+  lua_remove( L, cache );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+QpbMap* QpbMap::GetUserData( lua_State * L, int idx )
+{
+  return (QpbMap*) luaL_checkudata( L, idx, QPB_MAP_METATABLE );
+}
+
+//---------------------------------------------------------------------------
+// a write, or handing out a mutable message value, changes the map's tree ( see QpbMessage::Modified );
+// copying into a message value is nested, but it leaves the keys alone, so an index that was current stays so.
+void QpbMap::modified( lua_State * L, int self, bool nested ) const
+{
+  if (_msg.is_mutable()) {
+    const bool current= nested && _changes==QpbMessage::Changes( L, self );
+    QpbMessage::Modified( L, self, nested );
+    if (current) {
+      _changes= QpbMessage::Changes( L, self );
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+// the entries were added, removed, or reordered: the proxy with the other mutability, if any, indexed them separately.
+void QpbMap::moved( lua_State * L, int self ) const
+{
+  const QpbRef other( (const Message&) _msg );
+  other.PushSlot( L, self, 1 + _field->index() );
+  lua_rawgetp( L, -1, other.Key() );
+  QpbMap* map= (QpbMap*) luaL_testudata( L, -1, QPB_MAP_METATABLE );
+  if (map && map!=this && map->_field==_field) {
+    map->_indexed= false;
+  }
+  lua_pop( L, 2 );
+}
+
+//---------------------------------------------------------------------------
+// push the index of the proxy at self: the 1-based entry of each key, the last one for a repeated key.
+// it's rebuilt when the tree changed, or the count of entries did, since the proxy last saw it.
+void QpbMap::index( lua_State * L, int self ) const
+{
+  self= lua_absindex( L, self );
+  const Message& msg= _msg;
+  const Reflection * reflect= msg.GetReflection();
+  const int size= reflect->FieldSize( msg, _field );
+  const unsigned changes= QpbMessage::Changes( L, self );
+  qpb_map_indexes( L );
+  lua_pushvalue( L, self );
+  lua_rawget( L, -2 );
+  if (!_indexed || _changes!=changes || _size!=size || !lua_istable( L, -1 )) {
+    lua_pop( L, 1 );
+    const FieldDescriptor* kfield= _field->message_type()->map_key();
+    const QpbAccessor& keys= QpbAccessor::For( kfield );
+    _indexed= false;
+    _count= 0;
+    _duplicates= false;
+    lua_createtable( L, 0, size );
+    for (int i=0; i< size; ++i) {
+      keys.get( L, reflect->GetRepeatedMessage( msg, _field, i ), kfield );
+      lua_pushvalue( L, -1 );
+      lua_rawget( L, -3 );
+      if (lua_isnil( L, -1 )) {
+        ++_count;
+      }
+      else {
+        _duplicates= true;
+      }
+      lua_pop( L, 1 );
+      lua_pushinteger( L, i+1 );
+      lua_rawset( L, -3 );
+    }
+    lua_pushvalue( L, self );
+    lua_pushvalue( L, -2 );
+    lua_rawset( L, -4 );
+    _changes= changes;
+    _size= size;
+    _indexed= true;
+  }
+  lua_remove( L, -2 ); // the indexes
+}
+
+//---------------------------------------------------------------------------
+// push the key at key the way the index holds it, or nil for a value that's no key;
+// returns the key's entry, or -1. a hit is checked against the entry itself.
+int QpbMap::find( lua_State * L, int self, int key ) const
+{
+  self= lua_absindex( L, self );
+  key= lua_absindex( L, key );
+  int ret= -1;
+  index( L, self );
+  if (!qpb_map_keys[ _field->message_type()->map_key()->cpp_type() ]( L, key )) {
+    lua_pushnil( L );
+  }
+  else {
+    lua_pushvalue( L, -1 );
+    lua_rawget( L, -3 );
+    if (!lua_isnil( L, -1 )) {
+      ret= (int) lua_tointeger( L, -1 ) - 1;
+    }
+    lua_pop( L, 1 );
+    if (ret>=0) {
+      const Message& msg= _msg;
+      const FieldDescriptor* kfield= _field->message_type()->map_key();
+      QpbAccessor::For( kfield ).get( L, msg.GetReflection()->GetRepeatedMessage( msg, _field, ret ), kfield );
+      const bool same= lua_rawequal( L, -1, -2 )!=0;
+      lua_pop( L, 1 );
+      if (!same) {
+        lua_pop( L, 2 );
+        _indexed= false;
+        return find( L, self, key );
+      }
+    }
+  }
+  lua_remove( L, -2 ); // the index
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// push the value of entry; message values have the same mutability as the proxy.
+int QpbMap::push_value( lua_State * L, int self, int entry ) const
+{
+  const FieldDescriptor* vfield= _field->message_type()->map_value();
+  QpbRef ref= _msg;
+  Message* msg= vfield->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE ? ref.demute(0) : 0;
+  int ret=1;
+  if (msg) {
+    modified( L, self, false );
+    Message* e= msg->GetReflection()->MutableRepeatedMessage( msg, _field, entry );
+    ret= LUA_PUSH_MESSAGE( L, e->GetReflection()->MutableMessage( e, vfield ), QpbMessage::message_owner );
+  }
+  else {
+    const Message& m= _msg;
+    const Message& e= m.GetReflection()->GetRepeatedMessage( m, _field, entry );
+    if (vfield->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE) {
+      ret= LUA_PUSH_MESSAGE( L, e.GetReflection()->GetMessage( e, vfield ), QpbMessage::message_owner );
+    }
+    else {
+      ret= QpbAccessor::For( vfield ).get( L, e, vfield );
+    }
+  }
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// add an entry for the key at key, which isn't in the map; returns the entry
+int QpbMap::insert( lua_State * L, int self, int key ) const
+{
+  key= lua_absindex( L, key );
+  QpbRef ref= _msg;
+  Message* msg= ref.demute(0);
+  const FieldDescriptor* kfield= _field->message_type()->map_key();
+  index( L, self );
+  Message* entry= msg->GetReflection()->AddMessage( msg, _field );
+  QpbAccessor::For( kfield ).set( L, entry, kfield, key );
+  const int ret= _size++;
+  ++_count;
+  lua_pushvalue( L, key );
+  lua_pushinteger( L, ret+1 );
+  lua_rawset( L, -3 );
+  lua_pop( L, 1 );
+  moved( L, self );
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// remove the entry of the key at key, disabling any handles into its value first.
+// the last entry takes its place, so the map mustn't have repeated keys ( see unique ).
+void QpbMap::erase( lua_State * L, int self, int key, int entry ) const
+{
+  key= lua_absindex( L, key );
+  QpbRef ref= _msg;
+  Message* msg= ref.demute(0);
+  const Reflection * reflect= msg->GetReflection();
+  QpbMessage::Invalidate( L, self, reflect->GetRepeatedMessage( *msg, _field, entry ) );
+  index( L, self );
+  const int last= _size-1;
+  if (entry!=last) {
+    const FieldDescriptor* kfield= _field->message_type()->map_key();
+    reflect->SwapElements( msg, _field, entry, last );
+    QpbAccessor::For( kfield ).get( L, reflect->GetRepeatedMessage( *msg, _field, entry ), kfield );
+    lua_pushinteger( L, entry+1 );
+    lua_rawset( L, -3 );
+  }
+  reflect->RemoveLast( msg, _field );
+  --_size;
+  --_count;
+  lua_pushvalue( L, key );
+  lua_pushnil( L );
+  lua_rawset( L, -3 );
+  lua_pop( L, 1 );
+  moved( L, self );
+}
+
+//---------------------------------------------------------------------------
+// remove the entries whose key a later entry repeats ( ex. from merge_table ), so that entries can move without changing the map.
+void QpbMap::unique( lua_State * L, int self ) const
+{
+  QpbRef ref= _msg;
+  Message* msg= ref.demute(0);
+  const Reflection * reflect= msg->GetReflection();
+  const FieldDescriptor* kfield= _field->message_type()->map_key();
+  const QpbAccessor& keys= QpbAccessor::For( kfield );
+  index( L, self );
+  const int positions= lua_gettop( L );
+  int size= _size;
+  for (int i= size-1; i>=0; --i) {
+    // the entries past i are all kept, so the one moving in is always the last of its key
+    const Message& entry= reflect->GetRepeatedMessage( *msg, _field, i );
+    keys.get( L, entry, kfield );
+    lua_rawget( L, positions );
+    const bool repeated= lua_tointeger( L, -1 )!=i+1;
+    lua_pop( L, 1 );
+    if (repeated) {
+      QpbMessage::Invalidate( L, self, entry );
+      reflect->SwapElements( msg, _field, i, --size );
+      reflect->RemoveLast( msg, _field );
+    }
+  }
+  lua_pop( L, 1 );
+  _indexed= false;
+  moved( L, self );
+}
+
+//---------------------------------------------------------------------------
+// set the key at key to the value at value, or delete it for nil
+void QpbMap::assign( lua_State * L, int self, int key, int value ) const
+{
+  self= lua_absindex( L, self );
+  key= lua_absindex( L, key );
+  value= lua_absindex( L, value );
+  const FieldDescriptor* vfield= _field->message_type()->map_value();
+  const bool remove= lua_isnoneornil( L, value );
+  const bool message= vfield->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE;
+  const bool table= message && lua_istable( L, value );
+
+  // anything about the value that can raise an error does so before the map changes
+  const Message* src= 0;
+  if (remove || table) {
+  }
+  else if (message) {
+    src= &LUA_TO_MESSAGE( L, value );
+    if (src->GetDescriptor()!=vfield->message_type()) {
+      QPB_ERR_MAP_VALUE( L, _field->name().c_str(), src->GetDescriptor()->full_name().c_str() );
+    }
+  }
+  else if (vfield->cpp_type()==FieldDescriptor::CPPTYPE_ENUM) {
+    LUA_TO_ENUM( vfield, L, value );
+  }
+
+  modified( L, self, message && !remove );
+  if (remove) {
+    index( L, self );
+    lua_pop( L, 1 );
+    if (_duplicates) {
+      unique( L, self );
+    }
+  }
+  int entry= find( L, self, key );
+  if (lua_isnil( L, -1 )) {
+    QPB_ERR_MAP_KEY( L, _field->name().c_str(), luaL_typename( L, key ) );
+  }
+  else if (remove) {
+    if (entry>=0) {
+      erase( L, self, -1, entry );
+    }
+  }
+  else if (!src) {
+    if (entry<0) {
+      entry= insert( L, self, -1 );
+    }
+    QpbRef ref= _msg;
+    Message* msg= ref.demute(0);
+    Message* e= msg->GetReflection()->MutableRepeatedMessage( msg, _field, entry );
+    if (!table) {
+      QpbAccessor::For( vfield ).set( L, e, vfield, value );
+    }
+    else {
+      Message* dst= e->GetReflection()->MutableMessage( e, vfield );
+      dst->Clear();
+      QpbTable::MergeTable( L, dst, value );
+    }
+  }
+  else {
+    QpbRef ref= _msg;
+    Message* msg= ref.demute(0);
+    const Message* old= 0;
+    if (entry>=0) {
+      const Message& e= msg->GetReflection()->GetRepeatedMessage( *msg, _field, entry );
+      old= &e.GetReflection()->GetMessage( e, vfield );
+    }
+    if (old!=src) {
+      // taken before the insert, since src might hold this map; or it might lie inside the value it replaces.
+      const QpbCopySource copy( *src, msg, old );
+      if (entry<0) {
+        entry= insert( L, self, -1 );
+      }
+      Message* e= msg->GetReflection()->MutableRepeatedMessage( msg, _field, entry );
+      e->GetReflection()->MutableMessage( e, vfield )->CopyFrom( copy.get() );
+      QPB_STAT( deep_copies );
+    }
+  }
+  lua_pop( L, 1 ); // the key
+}
+
+//---------------------------------------------------------------------------
+// m[key]
+int QpbMap::get( lua_State * L ) const
+{
+  QPB_STAT_ACCESS( op_map_get, _field );
+  int ret=1;
+  const int entry= find( L, QPB_MAP_SELF, QPB_MAP_KEY );
+  if (entry<0) {
+    lua_pushnil( L );
+  }
+  else {
+    ret= push_value( L, QPB_MAP_SELF, entry );
+  }
+  return QPB_STAT_DONE( ret );
+}
+
+//---------------------------------------------------------------------------
+// m[key]= value, m[key]= nil
+int QpbMap::set( lua_State * L )
+{
+  int ret=0;
+  if (_msg.demute(L)) {
+    QPB_STAT_ACCESS( op_map_set, _field );
+    assign( L, QPB_MAP_SELF, QPB_MAP_KEY, QPB_MAP_VALUE );
+    ret= QPB_STAT_DONE( 0 );
+  }
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// #m
+int QpbMap::size( lua_State * L ) const
+{
+  index( L, QPB_MAP_SELF );
+  lua_pop( L, 1 );
+  lua_pushinteger( L, _count );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+int QpbMap::MapSize( lua_State * L, const QpbRef& msg, const FieldDescriptor* field )
+{
+  PushProxy( L, msg, field );
+  const QpbMap* map= (const QpbMap*) lua_touserdata( L, -1 );
+  map->index( L, -1 );
+  lua_pop( L, 2 );
+  return map->_count;
+}
+
+//---------------------------------------------------------------------------
+int QpbMap::MapGet( lua_State * L, const QpbRef& msg, const FieldDescriptor* field, int key )
+{
+  key= lua_absindex( L, key );
+  PushProxy( L, msg, field );
+  const QpbMap* map= (const QpbMap*) lua_touserdata( L, -1 );
+  const int self= lua_gettop( L );
+  const int entry= map->find( L, self, key );
+  if (entry<0) {
+    lua_pushnil( L );
+    return 1;
+  }
+  return map->push_value( L, self, entry );
+}
+
+//---------------------------------------------------------------------------
+void QpbMap::MapSet( lua_State * L, Message * msg, const FieldDescriptor* field, int key, int value )
+{
+  key= lua_absindex( L, key );
+  value= lua_absindex( L, value );
+  PushProxy( L, msg, field );
+  const QpbMap* map= (const QpbMap*) lua_touserdata( L, -1 );
+  map->assign( L, -1, key, value );
+  lua_pop( L, 1 );
+}
+
+//---------------------------------------------------------------------------
+int QpbMap::MapMutable( lua_State * L, Message * msg, const FieldDescriptor* field, int key )
+{
+  if (field->message_type()->map_value()->cpp_type()!=FieldDescriptor::CPPTYPE_MESSAGE) {
+    QPB_ERR_MUTABLE( L, field->name().c_str() );
+  }
+  key= lua_absindex( L, key );
+  PushProxy( L, msg, field );
+  const QpbMap* map= (const QpbMap*) lua_touserdata( L, -1 );
+  const int self= lua_gettop( L );
+  int entry= map->find( L, self, key );
+  if (lua_isnil( L, -1 )) {
+    QPB_ERR_MAP_KEY( L, field->name().c_str(), luaL_typename( L, key ) );
+  }
+  if (entry<0) {
+    map->modified( L, self, false );
+    entry= map->insert( L, self, -1 );
+  }
+  return map->push_value( L, self, entry );
+}
+
+//---------------------------------------------------------------------------
+static int qpb_map_next( lua_State * L )
+{
+  // the generic for passes nothing useful; the map, as the owner of any sub-messages, goes at QPB_MAP_SELF
+  lua_settop( L, 0 );
+  lua_pushvalue( L, lua_upvalueindex( QPB_MAP_ITERATOR_MAP_UPVALUE ) );
+  const QpbMap* map= (const QpbMap*) lua_touserdata( L, QPB_MAP_SELF );
+  // the map's message was detached mid loop
+  luaL_getmetatable( L, QPB_MAP_METATABLE );
+  lua_getmetatable( L, QPB_MAP_SELF );
+  const bool live= lua_rawequal( L, -1, -2 )!=0;
+  lua_pop( L, 2 );
+  if (!live) {
+    QPB_ERR_DETACHED( L );
+  }
+  return map->next( L );
+}
+
+//---------------------------------------------------------------------------
+// pairs( m ), QPB.pairs( m ):
+// the keys are gathered when the loop starts, and each value is looked up as the loop reaches it.
+// so, like a table, the map can be changed during the loop; keys deleted before they're reached are skipped.
+int QpbMap::iterate( lua_State * L ) const
+{
+  index( L, QPB_MAP_SELF );
+  const int positions= lua_gettop( L );
+  lua_pushvalue( L, QPB_MAP_SELF );
+  lua_createtable( L, _count, 0 );
+  const Message& msg= _msg;
+  const Reflection * reflect= msg.GetReflection();
+  const FieldDescriptor* kfield= _field->message_type()->map_key();
+  const QpbAccessor& keys= QpbAccessor::For( kfield );
+  int n=0;
+  for (int i=0; i< _size; ++i) {
+    // each key once, from its last entry
+    keys.get( L, reflect->GetRepeatedMessage( msg, _field, i ), kfield );
+    lua_pushvalue( L, -1 );
+    lua_rawget( L, positions );
+    const bool last= lua_tointeger( L, -1 )==i+1;
+    lua_pop( L, 1 );
+    if (last) {
+      lua_rawseti( L, -2, ++n );
+    }
+    else {
+      lua_pop( L, 1 );
+    }
+  }
+  lua_pushinteger( L, 0 );
+  lua_pushcclosure( L, qpb_map_next, 3 );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+int QpbMap::next( lua_State * L ) const
+{
+  int ret=0;
+  const int keys= lua_upvalueindex( QPB_MAP_ITERATOR_KEYS_UPVALUE );
+  const int count= (int) lua_rawlen( L, keys );
+  int at= (int) lua_tointeger( L, lua_upvalueindex( QPB_MAP_ITERATOR_AT_UPVALUE ) );
+  while (!ret && at < count) {
+    lua_rawgeti( L, keys, ++at );
+    const int entry= find( L, QPB_MAP_SELF, -1 );
+    if (entry<0) {
+      lua_pop( L, 2 );
+    }
+    else {
+      ret= 1 + push_value( L, QPB_MAP_SELF, entry );
+    }
+  }
+  lua_pushinteger( L, at );
+  lua_replace( L, lua_upvalueindex( QPB_MAP_ITERATOR_AT_UPVALUE ) );
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+int QpbMap::to_string( lua_State * L ) const
+{
+  lua_pushfstring( L, "qpb: %p - map %s", this, (const char *) _field->full_name().c_str() );
+  return 1;
+}
@@ -0,0 +1,90 @@
+/**
+ * @file qpb_map.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ *
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_MAP_H__
+#define __QPB_MAP_H__
+
+#include "qpb_forwards.h"
+#include "qpb_ref.h"
+
+//---------------------------------------------------------------------------
+/**
+ * POD-like type managed by lua, a proxy to a map<K,V> field.
+ * the field is its repeated entry messages; the proxy keeps a lua table from each key to its entry.
+ * the proxy's own writes keep it up to date; it's rebuilt after a nested change to the tree ( see QpbMessage::Changes ),
+ * and after the other proxy of the map ( mutable or not ) moved the entries.
+ * entries can repeat a key, the last one wins; the same as protobuf's own map.
+ * every key is a lookup, so the proxy has no methods of its own: m[key], m[key]= value ( nil deletes ), #m, and pairs( m ).
+ */
+struct QpbMap
+{
+  typedef google::protobuf::Message Message;
+  typedef google::protobuf::FieldDescriptor FieldDescriptor;
+
+  static int PushProxy( lua_State*L, const Message&m, const FieldDescriptor *f) {
+    return PushProxy( L, QpbRef(m), f );
+  }
+  static int PushProxy( lua_State*L, Message*m, const FieldDescriptor *f){
+    return PushProxy( L, QpbRef(m), f );
+  }
+
+  static QpbMap* GetUserData( lua_State *, int idx= QPB_MAP_SELF );
+
+  int get( lua_State * ) const;
+  int set( lua_State * );
+  int size( lua_State * ) const;
+  int iterate( lua_State * ) const;
+  int next( lua_State * ) const;
+  int to_string( lua_State * ) const;
+
+  /**
+   * pushes the value under the key at idx, or nil; sub-messages have the same mutability as msg.
+   */
+  static int MapGet( lua_State *, const QpbRef& msg, const FieldDescriptor*, int key );
+  /**
+   * sets the key at idx to the value at value; a nil value deletes the key.
+   * a sub-message value is copied from a message, or from a table.
+   */
+  static void MapSet( lua_State *, Message *, const FieldDescriptor*, int key, int value );
+  /**
+   * pushes the sub-message under the key at idx, inserting an empty one if the key isn't there.
+   */
+  static int MapMutable( lua_State *, Message *, const FieldDescriptor*, int key );
+  /**
+   * the count of distinct keys
+   */
+  static int MapSize( lua_State *, const QpbRef& msg, const FieldDescriptor* );
+
+private:
+  static int PushProxy( lua_State*, const QpbRef&, const FieldDescriptor *);
+  void modified( lua_State *, int self, bool nested ) const;
+  void moved( lua_State *, int self ) const;
+
+  void index( lua_State *, int self ) const;
+  int find( lua_State *, int self, int key ) const;
+  int push_value( lua_State *, int self, int entry ) const;
+  int insert( lua_State *, int self, int key ) const;
+  void erase( lua_State *, int self, int key, int entry ) const;
+  void unique( lua_State *, int self ) const;
+  void assign( lua_State *, int self, int key, int value ) const;
+
+  QpbMap(); // unimplemented
+  QpbRef _msg;
+  const FieldDescriptor *_field;
+  // the index: the tree's changes it's up to date with, the entries it was built from, and their distinct keys
+  mutable unsigned _changes;
+  mutable int _size;
+  mutable int _count;
+  mutable bool _indexed;
+  mutable bool _duplicates;
+};
+
+#endif // #ifndef __QPB_MAP_H__
@@ -0,0 +1,136 @@
+/**
+ * @file qpb_mask.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ *
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_mask.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/wire_format.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <limits.h>
+#include <string.h>
+
+using namespace google::protobuf;
+using namespace google::protobuf::internal;
+
+//---------------------------------------------------------------------------
+QpbFieldMask* QpbFieldMask::Compile( const Descriptor* desc, const std::string& paths, std::string* bad )
+{
+  QpbFieldMask* mask= new QpbFieldMask();
+  size_t start=0;
+  for (size_t end; (end= paths.find( '\n', start ))!=std::string::npos; start= end+1) {
+    if (!mask->Add( desc, paths.data()+start, end-start )) {
+      bad->assign( paths, start, end-start );
+      delete mask;
+      mask= 0;
+      break;
+    }
+  }
+  return mask;
+}
+
+//---------------------------------------------------------------------------
+QpbFieldMask::~QpbFieldMask()
+{
+  for (size_t i=0; i< _entries.size(); ++i) {
+    delete _entries[i].sub;
+  }
+}
+
+//---------------------------------------------------------------------------
+// a whole field wins over any of its sub-fields
+bool QpbFieldMask::Add( const Descriptor* desc, const char* path, size_t len )
+{
+  const char* dot= (const char*) memchr( path, '.', len );
+  const size_t name_len= dot ? dot-path : len;
+  const FieldDescriptor* field= desc->FindFieldByName( std::string( path, name_len ) );
+  // only length delimited messages can be looked into
+  if (!field || (dot && (field->type()!=FieldDescriptor::TYPE_MESSAGE || field->is_map()))) {
+    return false;
+  }
+  Entry* entry= 0;
+  for (size_t i=0; i< _entries.size() && !entry; ++i) {
+    if (_entries[i].field==field) {
+      entry= &_entries[i];
+    }
+  }
+  if (!entry) {
+    const Entry e= { field->number(), field, dot ? new QpbFieldMask() : 0 };
+    _entries.push_back( e );
+    entry= &_entries.back();
+  }
+  bool ok= true;
+  if (!dot) {
+    delete entry->sub;
+    entry->sub= 0;
+  }
+  else 
+  if (entry->sub) {
+    ok= entry->sub->Add( field->message_type(), dot+1, len-name_len-1 );
+  }
+  return ok;
+}
+
+//---------------------------------------------------------------------------
+bool QpbFieldMask::Parse( const char* bytes, int size, Message* msg ) const
+{
+  msg->Clear();
+  io::CodedInputStream in( (const uint8*) bytes, size );
+  return Merge( &in, msg ) && in.ConsumedEntireMessage();
+}
+
+//---------------------------------------------------------------------------
+// reads until the end of the input, or of the current limit
+bool QpbFieldMask::Merge( io::CodedInputStream* in, Message* msg ) const
+{
+  for (;;) {
+    const uint32 tag= in->ReadTag();
+    if (!tag) {
+      return true;
+    }
+    const int number= WireFormatLite::GetTagFieldNumber( tag );
+    const Entry* entry= 0;
+    for (size_t i=0; i< _entries.size() && !entry; ++i) {
+      if (_entries[i].number==number) {
+        entry= &_entries[i];
+      }
+    }
+    if (!entry || (entry->sub && WireFormatLite::GetTagWireType( tag )!=WireFormatLite::WIRETYPE_LENGTH_DELIMITED)) {
+      // not wanted: skipped in place
+      if (WireFormatLite::GetTagWireType( tag )==WireFormatLite::WIRETYPE_END_GROUP || !WireFormatLite::SkipField( in, tag )) {
+        return false;
+      }
+    }
+    else
+    if (!entry->sub) {
+      if (!WireFormat::ParseAndMergeField( tag, entry->field, msg, in )) {
+        return false;
+      }
+    }
+    else {
+      // the sub-message, with only its masked fields
+      uint32 length=0;
+      // a length past the end of the input would cut the sub-message short without an error
+      if (!in->ReadVarint32( &length ) || length> INT_MAX || (int) length> in->BytesUntilLimit()) {
+        return false;
+      }
+      const std::pair<io::CodedInputStream::Limit, int> limit= in->IncrementRecursionDepthAndPushLimit( (int) length );
+      if (limit.second< 0) {
+        return false;
+      }
+      const Reflection* reflect= msg->GetReflection();
+      Message* sub= entry->field->is_repeated() ? reflect->AddMessage( msg, entry->field ) : reflect->MutableMessage( msg, entry->field );
+      if (!entry->sub->Merge( in, sub ) || !in->DecrementRecursionDepthAndPopLimit( limit.first )) {
+        return false;
+      }
+    }
+  }
+}
@@ -0,0 +1,68 @@
+/**
+ * @file qpb_mask.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ *
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_MASK_H__
+#define __QPB_MASK_H__
+
+#include "qpb_forwards.h"
+#include <string>
+#include <vector>
+
+namespace google {
+  namespace protobuf {
+    namespace io {
+      class CodedInputStream;
+    }
+  }
+};
+
+//---------------------------------------------------------------------------
+/**
+ * the field paths of a partial decode ( QPB.decode( name, bytes, { "id", "header.ts" } ) ),
+ * compiled into a tree of field numbers for one message type.
+ * fields outside the mask are skipped on the wire, without being parsed or copied.
+ * a mask never changes once compiled, so any number of threads can parse with it.
+ */
+struct QpbFieldMask
+{
+  typedef google::protobuf::Message Message;
+  typedef google::protobuf::Descriptor Descriptor;
+  typedef google::protobuf::FieldDescriptor FieldDescriptor;
+
+  /**
+   * @param paths dotted field paths, each followed by a newline.
+   * @param bad on failure, the first path that isn't a field of desc ( or of its sub-messages ).
+   * @return a new mask, or 0 on failure.
+   */
+  static QpbFieldMask* Compile( const Descriptor* desc, const std::string& paths, std::string* bad );
+  ~QpbFieldMask();
+
+  /**
+   * replace the contents of msg with the masked fields of the wire format bytes.
+   * required fields outside the mask are left unset.
+   * @return false for malformed bytes.
+   */
+  bool Parse( const char* bytes, int size, Message* msg ) const;
+
+private:
+  QpbFieldMask() {}
+  bool Add( const Descriptor* desc, const char* path, size_t len );
+  bool Merge( google::protobuf::io::CodedInputStream* in, Message* msg ) const;
+
+  struct Entry {
+    int number;
+    const FieldDescriptor* field;
+    QpbFieldMask* sub; // only these fields of the sub-message, or 0 for the whole field
+  };
+  std::vector<Entry> _entries;
+};
+
+#endif // #ifndef __QPB_MASK_H__
@@ -9,14 +9,22 @@
  * See License.txt for complete information.
  */
 #include "qpb_message.h"
+#include "qpb.h"
 #include "qpb_array.h"
+#include "qpb_arena.h"
+#include "qpb_pool.h"
+#include "qpb_stats.h"
+#include "qpb_table.h"
+#include "qpb_json.h"
+#include "qpb_mask.h"
+#include "qpb_lazy.h"
+#include "qpb_view.h"
+#include "qpb_map.h"
+#include "qpb_access.h"
 
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/message.h>
-extern "C" {
-#include <lua.h>
-#include <lauxlib.h>
-}
+#include "qpb_lua.h"
 #include <string>
 
 using namespace google::protobuf;
@@ -27,36 +35,244 @@ using namespace google::protobuf;
 //---------------------------------------------------------------------------
 // note we can't get a handle without a valid msg
 // and every msg is supposed to have a valid descriptor
-int QpbMessage::PushMsg( lua_State*L, const QpbRef& msg, int owner ) 
+int QpbMessage::PushMsg( lua_State*L, const QpbRef& msg, int owner, QpbArena* arena ) 
 {
+  const Descriptor* desc= msg->GetDescriptor();
+  int cache=0;
+  if (owner!=unowned) {
+    // a borrowed message is only wrapped once per tree; 
+    // the metatable check guards against a cached handle to a deleted message whose memory got reused.
+    msg.PushSlot( L, QPB_OWNER_SELF, 0 );
+    lua_rawgetp( L, -1, msg.Key() );
+    QpbMessage *cached= (QpbMessage *)lua_touserdata( L, -1 );
+    if (cached && lua_getmetatable( L, -1 )) {
+      lua_getfield( L, -1, QPB_MESSAGE_METATABLE );
+      const bool same= lua_touserdata( L, -1 )==desc;
+      lua_pop( L, 2 );
+      if (same) {
+        cached->_owner= owner; // an array element might have moved
+        lua_remove( L, -2 ); // the cache
+        return 1;
+      }
+    }
+    lua_pop( L, 1 );
+    cache= lua_gettop( L );
+  }
+
   // lua 'throws' on failed allocation
   QpbMessage *handle= (QpbMessage *)lua_newuserdata( L, sizeof(QpbMessage) );
-  luaL_getmetatable(L, QPB_MESSAGE_METATABLE ); // fetch the object metatable
+  QPB_STAT( handles_message );
+  Qpb::PushRegistered( L, desc ); // fetch the per-type metatable ( see Qpb::register_metatable )
   if (lua_type(L,-1)!= LUA_TTABLE) {
-    QPB_ERR_TYPE(L, QPB_MESSAGE_METATABLE );
+    QPB_ERR_TYPE(L, desc->full_name().c_str() );
+  }
+  if (owner!=unowned) {
+    lua_rawgetp( L, -1, desc ); // the borrowed version, without __gc
+    lua_remove( L, -2 );
   }
   lua_setmetatable( L, -2 ); // set the metatable of the user data
   handle->_msg= msg;
   handle->_owner= owner;
+  handle->_arena= arena;
+  handle->_lazy= 0;
+  handle->_changes= 0;
+  if (arena) {
+    arena->retain();
+  }
+  if (cache) {
+    QpbRef::SetOwner( L, -1, QPB_OWNER_SELF );
+    lua_pushvalue( L, -1 );
+    lua_rawsetp( L, cache, msg.Key() );
+    lua_remove( L, cache );
+  }
   return 1;
 }
 
 //---------------------------------------------------------------------------
+// every message type has its own metatable, so luaL_checkudata can't be used;
+// instead, the metatables are all marked with the QPB_MESSAGE_METATABLE key.
 QpbMessage* QpbMessage::GetUserData( lua_State * L, int idx ) 
 {
-  QpbMessage* handle= (QpbMessage*) luaL_checkudata( L, idx, QPB_MESSAGE_METATABLE );
+  QpbMessage* handle= (QpbMessage*) lua_touserdata( L, idx );
+  if (handle) {
+    if (!lua_getmetatable( L, idx )) {
+      handle= 0;
+    }
+    else {
+      lua_getfield( L, -1, QPB_MESSAGE_METATABLE );
+      if (!lua_islightuserdata( L, -1 )) {
+        handle= 0;
+        luaL_getmetatable( L, QPB_DETACHED_METATABLE );
+        if (lua_rawequal( L, -1, -3 )) {
+          QPB_ERR_DETACHED( L );
+        }
+        lua_pop( L, 1 );
+      }
+      lua_pop( L, 2 );
+    }
+  }
+  if (!handle) {
+    luaL_argerror( L, idx, "expected " QPB_MESSAGE_METATABLE );
+  }
   return handle;
 }
 
 //---------------------------------------------------------------------------
-int QpbMessage::collect(lua_State* state)
+int QpbMessage::collect(lua_State* state, QpbPool* pool)
 {
+  delete _lazy;
+  _lazy= 0;
   if (_owner==unowned) {
-    delete _msg.demute(0);
+    QPB_STAT( messages_freed );
+    if (_arena) {
+      _arena->release();
+      _arena= 0;
+    }
+    else if (pool) {
+      pool->Recycle( _msg.demute(0) );
+    }
+    else {
+      delete _msg.demute(0);
+    }
   }    
   return 0;
 }
 
+//---------------------------------------------------------------------------
+// add msg, and every message under it, to the set at idx; or with only, just the messages in that field of msg.
+static void qpb_collect( lua_State * L, int set, const Message& msg, const FieldDescriptor* only= 0 )
+{
+  if (!only) {
+    lua_pushlightuserdata( L, const_cast<Message*>( &msg ) );
+    lua_pushboolean( L, 1 );
+    lua_rawset( L, set );
+  }
+  const Descriptor* desc= msg.GetDescriptor();
+  const Reflection* reflect= msg.GetReflection();
+  for (int i=0; i< desc->field_count(); ++i) {
+    const FieldDescriptor* field= desc->field(i);
+    if (field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE && (!only || field==only)) {
+      if (field->is_repeated()) {
+        // map entries included
+        const int count= reflect->FieldSize( msg, field );
+        for (int k=0; k< count; ++k) {
+          qpb_collect( L, set, reflect->GetRepeatedMessage( msg, field, k ) );
+        }
+      }
+      else 
+      if (reflect->HasField( msg, field )) {
+        qpb_collect( L, set, reflect->GetMessage( msg, field ) );
+      }
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+// disable the handle on top of the stack, which stays there.
+// changing its metatable leaves the cache it's in alone.
+static void qpb_disable( lua_State * L, int detached )
+{
+  QpbArray* array= (QpbArray*) luaL_testudata( L, -1, QPB_ARRAY_METATABLE );
+  if (array) {
+    array->detach();
+  }
+  lua_pushvalue( L, detached );
+  lua_setmetatable( L, -2 );
+}
+
+//---------------------------------------------------------------------------
+// true if the cache on top of the stack holds any handle
+static bool qpb_cached( lua_State * L )
+{
+  bool ret= false;
+  lua_pushnil( L );
+  while (!ret && lua_next( L, -2 )) {
+    lua_pushnil( L );
+    if (lua_next( L, -2 )) {
+      lua_pop( L, 2 );
+      ret= true;
+    }
+    lua_pop( L, 1 );
+  }
+  if (ret) {
+    lua_pop( L, 1 ); // the slot key
+  }
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// sub is about to be deleted, or handed to a new owner:
+// handles into it would point at freed memory, so they get a metatable that raises an error instead.
+void QpbMessage::Invalidate( lua_State*L, int idx, const Message& sub, const FieldDescriptor* field )
+{
+  const int top= lua_gettop( L );
+  QpbRef::PushCache( L, idx );
+  const int cache= lua_gettop( L );
+  if (qpb_cached( L )) {
+    lua_newtable( L );
+    const int set= lua_gettop( L );
+    qpb_collect( L, set, sub, field );
+    luaL_getmetatable( L, QPB_DETACHED_METATABLE );
+    const int detached= lua_gettop( L );
+    lua_pushnil( L );
+    while (lua_next( L, cache )) {
+      // views are keyed by themselves, everything else by its message
+      const bool views= lua_tointeger( L, -2 ) < 0;
+      lua_pushnil( L );
+      while (lua_next( L, -2 )) {
+        const void* key= lua_touserdata( L, -2 );
+        if (views) {
+          const QpbView* view= (const QpbView*) luaL_testudata( L, -1, QPB_VIEW_METATABLE );
+          key= view ? view->Key() : 0;
+        }
+        lua_pushlightuserdata( L, const_cast<void*>( key ) );
+        lua_rawget( L, set );
+        const bool inside= lua_toboolean( L, -1 )!=0;
+        lua_pop( L, 1 );
+        if (inside) {
+          qpb_disable( L, detached );
+          lua_pushvalue( L, -2 );
+          lua_pushnil( L );
+          lua_rawset( L, -5 );
+        }
+        lua_pop( L, 1 );
+      }
+      lua_pop( L, 1 );
+    }
+  }
+  lua_settop( L, top );
+}
+
+//---------------------------------------------------------------------------
+// token= QPB.detach( pb ); the sub-messages and arrays of the tree are views into the message,
+// so they're all disabled along with the handle.
+Message* QpbMessage::detach(lua_State* L, int idx)
+{
+  idx= lua_absindex( L, idx );
+  if (_owner!=unowned || _arena) {
+    QPB_ERR_DETACH( L );
+  }
+  settle( L, true );
+  Message* msg= _msg.demute(L);
+  luaL_getmetatable( L, QPB_DETACHED_METATABLE );
+  const int detached= lua_gettop( L );
+  QpbRef::PushCache( L, idx );
+  lua_pushnil( L );
+  while (lua_next( L, -2 )) {
+    // each slot
+    lua_pushnil( L );
+    while (lua_next( L, -2 )) {
+      qpb_disable( L, detached );
+      lua_pop( L, 1 );
+    }
+    lua_pop( L, 1 );
+  }
+  lua_pop( L, 1 ); // the cache
+  lua_setmetatable( L, idx ); // no __gc, the handle doesn't delete msg anymore
+  _owner= message_owner;
+  return msg;
+}
+
 //---------------------------------------------------------------------------
 const FieldDescriptor* QpbMessage::field( lua_State* L, const char * name ) const
 {
@@ -84,6 +300,194 @@ int QpbMessage::to_string( lua_State * L ) const
   return 1;
 }
 
+//---------------------------------------------------------------------------
+/**
+ * serialize the message to the wire format; 
+ * the bytes are written straight into lua's buffer, and returned as a string.
+ */
+int QpbMessage::encode( lua_State * L ) const
+{
+  const std::string* bytes= pristine();
+  if (bytes) {
+    lua_pushlstring( L, bytes->data(), bytes->size() );
+    QPB_STAT_ADD( bytes_encoded, bytes->size() );
+    return 1;
+  }
+  const Message & msg= GetMessage( L );
+  if (!msg.IsInitialized()) {
+    QPB_ERR_UNINITIALIZED( L, msg.GetDescriptor()->full_name().c_str(), msg.InitializationErrorString().c_str() );
+  }
+  else {
+    const size_t size= msg.ByteSizeLong();
+    luaL_Buffer b;
+    uint8 * out= (uint8*) luaL_buffinitsize( L, &b, size );
+    msg.SerializeWithCachedSizesToArray( out );
+    luaL_pushresultsize( &b, size );
+    QPB_STAT_ADD( bytes_encoded, size );
+  }
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+/**
+ * replace the contents of the message with the wire format string at idx.
+ * the string is parsed in place; Clear() keeps the message's existing allocations for reuse.
+ */
+int QpbMessage::parse( lua_State * L, int idx, const QpbFieldMask* mask )
+{
+  Message * msg= _msg.demute(L);
+  if (msg) {
+    delete _lazy;
+    _lazy= 0;
+    size_t len=0;
+    const char * bytes= lua_tolstring( L, idx, &len );
+    QPB_STAT_ADD( bytes_decoded, len );
+    if (mask ? !mask->Parse( bytes, (int) len, msg ) : !msg->ParseFromArray( bytes, (int) len )) {
+      QPB_ERR_PARSE( L, msg->GetDescriptor()->full_name().c_str() );
+    }
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+/**
+ * only the top level of the string is read now, to find where each field is;
+ * the message stays empty until its fields get used.
+ */
+int QpbMessage::parse_lazy( lua_State * L, int idx )
+{
+  Message * msg= _msg.demute(L);
+  if (msg) {
+    size_t len=0;
+    const char * bytes= lua_tolstring( L, idx, &len );
+    QPB_STAT_ADD( bytes_decoded, len );
+    msg->Clear();
+    delete _lazy;
+    _lazy= QpbLazy::Index( msg->GetDescriptor(), bytes, len );
+    if (!_lazy) {
+      QPB_ERR_PARSE( L, msg->GetDescriptor()->full_name().c_str() );
+    }
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+const Descriptor* QpbMessage::GetDescriptor() const
+{
+  return _msg->GetDescriptor();
+}
+
+//---------------------------------------------------------------------------
+const std::string* QpbMessage::pristine() const
+{
+  return _lazy ? _lazy->Pristine() : 0;
+}
+
+//---------------------------------------------------------------------------
+// a field of a lazily decoded message is parsed the first time any of these reach it
+const Message& QpbMessage::touch( lua_State*L, const FieldDescriptor* field ) const
+{
+  if (_lazy && !_lazy->Touch( const_cast<QpbRef&>( _msg ).demute(0), field )) {
+    QPB_ERR_PARSE( L, _msg->GetDescriptor()->full_name().c_str() );
+  }
+  return _msg;
+}
+
+//---------------------------------------------------------------------------
+// arrays and maps only know their root, not the handle they came from
+void QpbMessage::Modified( lua_State*L, int idx, bool nested )
+{
+  QpbRef::PushRoot( L, idx );
+  QpbMessage* root= (QpbMessage*) lua_touserdata( L, -1 );
+  if (root) {
+    if (nested) {
+      ++root->_changes;
+    }
+    if (root->_lazy) {
+      root->_lazy->Modified();
+    }
+  }
+  lua_pop( L, 1 );
+}
+
+//---------------------------------------------------------------------------
+unsigned QpbMessage::Changes( lua_State*L, int idx )
+{
+  QpbRef::PushRoot( L, idx );
+  const QpbMessage* root= (const QpbMessage*) lua_touserdata( L, -1 );
+  const unsigned ret= root ? root->_changes : 0;
+  lua_pop( L, 1 );
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// about to change field: the original bytes don't match the message anymore
+Message* QpbMessage::mutate( lua_State*L, const FieldDescriptor* field )
+{
+  Message* msg= _msg.demute(L);
+  if (msg && _lazy) {
+    touch( L, field );
+    _lazy->Modified();
+  }
+  // setting a member of a oneof deletes the message in another member
+  const OneofDescriptor* oneof= field->containing_oneof();
+  if (msg && oneof) {
+    const Reflection * reflect= msg->GetReflection();
+    const FieldDescriptor* other= reflect->GetOneofFieldDescriptor( *msg, oneof );
+    if (other && other!=field && other->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE) {
+      Invalidate( L, QPB_MESSAGE_SELF, reflect->GetMessage( *msg, other ) );
+    }
+  }
+  return msg;
+}
+
+//---------------------------------------------------------------------------
+// parse every field still waiting; forget also drops the original bytes
+void QpbMessage::settle( lua_State*L, bool forget ) const
+{
+  if (_lazy) {
+    const bool ok= _lazy->Complete( const_cast<QpbRef&>( _msg ).demute(0) );
+    if (forget || !ok) {
+      delete _lazy;
+      _lazy= 0;
+    }
+    if (!ok && L) {
+      QPB_ERR_PARSE( L, _msg->GetDescriptor()->full_name().c_str() );
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+// pb:to_table( [table] )
+int QpbMessage::to_table( lua_State * L ) const
+{
+  int reuse= 0;
+  if (!lua_isnoneornil( L, QPB_TO_TABLE_REUSE )) {
+    luaL_checktype( L, QPB_TO_TABLE_REUSE, LUA_TTABLE );
+    reuse= QPB_TO_TABLE_REUSE;
+  }
+  return QpbTable::ToTable( L, GetMessage( L ), reuse );
+}
+
+//---------------------------------------------------------------------------
+// json= pb:to_json( [options] )
+int QpbMessage::to_json( lua_State * L ) const
+{
+  return QpbJson::ToJson( L, GetMessage( L ), QPB_TO_JSON_OPTIONS );
+}
+
+//---------------------------------------------------------------------------
+// pb:merge_table( table )
+int QpbMessage::merge_table( lua_State * L, int idx )
+{
+  Message * msg= _msg.demute(L);
+  if (msg) {
+    settle( L, true );
+    QpbTable::MergeTable( L, msg, idx );
+  }
+  return 0;
+}
+
 //---------------------------------------------------------------------------
 // frequently a message is embedded in an array or another message
 // this is a very simplistic way to find out
@@ -97,7 +501,7 @@ int QpbMessage::owner(lua_State*L)
 int QpbMessage::has(lua_State*L, const FieldDescriptor* field) const
 {
   const Reflection * reflect= _msg->GetReflection();
-  const bool has= reflect->HasField( _msg, field );
+  const bool has= reflect->HasField( touch( L, field ), field );
   lua_pushboolean( L, has );
   return 1;
 }
@@ -110,7 +514,9 @@ int QpbMessage::size(lua_State*L, const FieldDescriptor* field) const
   }
   else {
     const Reflection * reflect= _msg->GetReflection();
-    int n= reflect->FieldSize( _msg, field );
+    const Message& msg= touch( L, field );
+    // a map's entries can repeat a key, its size is the count of distinct keys
+    int n= field->is_map() ? QpbMap::MapSize( L, QpbRef( msg ), field ) : reflect->FieldSize( msg, field );
     lua_pushinteger( L, n );
   }
   return 1;
@@ -120,9 +526,17 @@ int QpbMessage::size(lua_State*L, const FieldDescriptor* field) const
 int QpbMessage::get(lua_State*L, const FieldDescriptor* field) const
 {
   int ret=0;
-  const Reflection * reflect= _msg->GetReflection();
-    
-  if (field->is_repeated()) {
+  touch( L, field );
+  if (field->is_map()) {
+    // the same for maps: pb.map_field(), and pb.map_field( key )
+    if (lua_type(L, QPB_GET_REPEATED_INDEX) == LUA_TNONE) {
+      ret= QpbMap::PushProxy( L, (const Message&) _msg, field );
+    }
+    else {
+      ret= QpbMap::MapGet( L, QpbRef( (const Message&) _msg ), field, QPB_GET_REPEATED_INDEX );
+    }
+  }
+  else if (field->is_repeated()) {
     // repeated_fields can be accessed two ways through their bare name:
     // pb.repeated_field(), and pb.repeated_field( index ); 
     // the first returns an immutable array, the second an element of the array
@@ -136,103 +550,86 @@ int QpbMessage::get(lua_State*L, const FieldDescriptor* field) const
     }      
   }
   else {
-    switch ( field->cpp_type() ) {
-      case FieldDescriptor::CPPTYPE_INT32: {
-        int32 val= reflect->GetInt32( _msg, field );
-        ret= LUA_PUSH_INT32( L, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_INT64: {
-        int64 val= reflect->GetInt64( _msg, field );
-        ret= LUA_PUSH_INT64( L, val );
-      }
-      break;
-      case FieldDescriptor::CPPTYPE_UINT32: {
-        uint32 val= reflect->GetUInt32( _msg, field );
-        ret= LUA_PUSH_UINT32( L, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_UINT64: {
-        uint64 val= reflect->GetUInt64( _msg, field );
-        ret= LUA_PUSH_UINT64( L, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_DOUBLE: {
-        double val= reflect->GetDouble( _msg, field );
-        ret= LUA_PUSH_DOUBLE( L, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_FLOAT: {
-        float val= reflect->GetFloat( _msg, field );
-        ret= LUA_PUSH_FLOAT( L, val );
-      }
-      break;  
-      case FieldDescriptor::CPPTYPE_BOOL: {
-        bool val= reflect->GetBool( _msg, field );
-        ret= LUA_PUSH_BOOL( L, val );
-      }
-      break;              
-      case FieldDescriptor::CPPTYPE_ENUM: {
-        const EnumValueDescriptor* eval= reflect->GetEnum( _msg, field );
-        ret= LUA_PUSH_ENUM( L, eval );
-      }
-      break;
-      case FieldDescriptor::CPPTYPE_STRING: {
-        std::string scratch;
-        const std::string& str= reflect->GetStringReference( _msg, field, &scratch );
-        ret= LUA_PUSH_STRING( L, str );
-      }              
-      break;
-      case FieldDescriptor::CPPTYPE_MESSAGE: {
-        const Message& val= reflect->GetMessage( _msg, field );
-        ret= LUA_PUSH_MESSAGE( L, val, QpbMessage::message_owner );
-      }
-      break;
-      default:
-        QPB_ERR_TYPE( L, field->name().c_str() );
-      break;
-    }          
+    ret= QpbAccessor::For( field ).get( L, _msg, field );
   }  
   return ret;
 }
     
+//---------------------------------------------------------------------------
+// pb:view_field(), pb:view_field( index ) a view of the bytes, rather than a lua string copy of them
+int QpbMessage::view(lua_State*L, const FieldDescriptor* field) const
+{
+  const Message& msg= touch( L, field );
+  int index= -1;
+  if (field->is_repeated()) {
+    const int size= msg.GetReflection()->FieldSize( msg, field );
+    index= luaL_checkint( L, QPB_GET_REPEATED_INDEX ) - 1; // lua-to-c
+    if (index <0 || index>=size) {
+      QPB_ERR_RANGE( L, field->name().c_str(), index+1, size );
+    }
+  }
+  return QpbView::PushView( L, msg, field, index );
+}
+
 //---------------------------------------------------------------------------
 int QpbMessage::get_mutable(lua_State*L, const FieldDescriptor* field)
 {
   int ret=0;
-  if (field->type()==FieldDescriptor::TYPE_STRING) {
-    QPB_ERR_MUTE_STRING( L, field->name().c_str() );
-  }else if (field->is_repeated()) {
-    if (lua_type(L, QPB_GET_REPEATED_INDEX) == LUA_TNONE) {
-        Message* msg= _msg.demute(L);
-      if (msg) {
-	      ret= QpbArray::PushProxy(L, msg, field );
-      }      
+  if (field->is_map()) {
+    // ex. mutable_map_field() the map, mutable_map_field( key ) its sub-message, added if needed
+    Message* msg= mutate( L, field );
+    if (msg) {
+      ret= lua_type(L, QPB_GET_REPEATED_INDEX) == LUA_TNONE ? 
+        QpbMap::PushProxy( L, msg, field ) : 
+        QpbMap::MapMutable( L, msg, field, QPB_GET_REPEATED_INDEX );
     }
-    else {
-      Message * msg= _msg.demute(L);
-      if (msg) {
-	     const Reflection * reflect= msg->GetReflection();
-	     const int size= reflect->FieldSize( _msg, field );
-	    int index= lua_tointeger(L, QPB_GET_REPEATED_INDEX );
-	    index-=1; // lua-to-c
-	if (index <0 || index>=size) {
-	  QPB_ERR_RANGE( L, field->name().c_str(), index, size );
-	}
-	Message * src= reflect->MutableRepeatedMessage( msg, field, index );
-	ret= LUA_PUSH_MESSAGE( L, src, QpbMessage::message_owner );
-      }      
+  }else if (field->is_repeated() && lua_type(L, QPB_GET_REPEATED_INDEX) == LUA_TNONE) {
+    // any repeated field can be changed through its array
+    Message* msg= mutate( L, field );
+    if (msg) {
+      ret= QpbArray::PushProxy(L, msg, field );
     }      
-  }else if (field->type()==FieldDescriptor::TYPE_MESSAGE) {
-    Message * msg= _msg.demute(L);
+  }else if (field->cpp_type()==FieldDescriptor::CPPTYPE_STRING) {
+    // ex. mutable_foo(), mutable_foo( index ) a builder that changes the string in place
+    Message * msg= mutate( L, field );
+    if (msg) {
+      int index= -1;
+      if (field->is_repeated()) {
+        const int size= msg->GetReflection()->FieldSize( *msg, field );
+        index= luaL_checkint( L, QPB_GET_REPEATED_INDEX ) - 1; // lua-to-c
+        if (index <0 || index>=size) {
+          QPB_ERR_RANGE( L, field->name().c_str(), index+1, size );
+        }
+      }
+      else if (!msg->GetReflection()->HasField( *msg, field )) {
+        // like protobuf's own mutable_foo(), asking for the builder sets the field
+        msg->GetReflection()->SetString( msg, field, field->default_value_string() );
+      }
+      ret= QpbView::PushView( L, msg, field, index );
+    }
+  }else if (field->cpp_type()!=FieldDescriptor::CPPTYPE_MESSAGE) {
+    QPB_ERR_MUTABLE(L, field->name().c_str());
+  }else if (field->is_repeated()) {
+    Message * msg= mutate( L, field );
     if (msg) {
       const Reflection * reflect= msg->GetReflection();
-      Message * src= reflect->MutableMessage( msg, field );
-      ret= LUA_PUSH_MESSAGE( L, src, QpbMessage::message_owner );
+      const int size= reflect->FieldSize( _msg, field );
+      int index= lua_tointeger(L, QPB_GET_REPEATED_INDEX );
+      index-=1; // lua-to-c
+      if (index <0 || index>=size) {
+        QPB_ERR_RANGE( L, field->name().c_str(), index, size );
+      }
+      Message * src= reflect->MutableRepeatedMessage( msg, field, index );
+      ret= LUA_PUSH_MESSAGE( L, src, index );
     }      
   }
   else {
-    QPB_ERR_MUTABLE(L, field->name().c_str());
+    Message * msg= mutate( L, field );
+    if (msg) {
+      const Reflection * reflect= msg->GetReflection();
+      Message * src= reflect->MutableMessage( msg, field );
+      ret= LUA_PUSH_MESSAGE( L, src, QpbMessage::message_owner );
+    }      
   }
   return ret;
 }
@@ -240,78 +637,27 @@ int QpbMessage::get_mutable(lua_State*L, const FieldDescriptor* field)
 //---------------------------------------------------------------------------
 int QpbMessage::set(lua_State*L, const FieldDescriptor* field)
 {
-  Message * msg= _msg.demute(L);
+  Message * msg= mutate( L, field );
   if (msg) {
-    if (field->is_repeated()) {
+    if (field->is_map()) {
+      // ex. set_map_field( key, value ), set_map_field( key, nil ) removes the key
+      QpbMap::MapSet( L, msg, field, QPB_SET_REPEATED_INDEX, QPB_SET_REPEATED_VALUE );
+    }
+    else if (field->is_repeated()) {
       luaL_checknumber( L, QPB_SET_REPEATED_INDEX );
+      if (field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE) {
+        Modified( L, QPB_MESSAGE_SELF, true ); // the element's maps, if any, change too
+      }
       const int index= lua_tointeger(L, QPB_SET_REPEATED_INDEX );
       lua_pushvalue( L, QPB_SET_REPEATED_VALUE ); // tge 
       QpbArray::ArraySet( L, msg, field, index );
     }
     else {
-      const Reflection * reflect= msg->GetReflection();
       // ex. set_foo( int32 value )  
-      switch ( field->cpp_type() ) {
-        case FieldDescriptor::CPPTYPE_INT32: {
-          const int32 val= LUA_TO_INT32( L, QPB_SET_VALUE );
-          reflect->SetInt32( msg, field, val );
-        }
-        break;              
-        case FieldDescriptor::CPPTYPE_INT64: {
-          const int64 val= LUA_TO_INT64( L, QPB_SET_VALUE );
-          reflect->SetInt64( msg, field,val );
-        }
-        break;
-        case FieldDescriptor::CPPTYPE_UINT32: {
-          const uint32 val= LUA_TO_UINT32( L, QPB_SET_VALUE );
-          reflect->SetUInt32( msg, field, val );
-        }
-        break;              
-        case FieldDescriptor::CPPTYPE_UINT64: {
-          const uint64 val= LUA_TO_UINT64( L, QPB_SET_VALUE );
-          reflect->SetUInt64( msg, field, val );
-        }
-        break;              
-        case FieldDescriptor::CPPTYPE_DOUBLE: {
-          const double val= LUA_TO_DOUBLE( L, QPB_SET_VALUE );
-          reflect->SetDouble( msg, field, val );
-        }
-        break;              
-        case FieldDescriptor::CPPTYPE_FLOAT: {
-          const float val= LUA_TO_FLOAT( L, QPB_SET_VALUE );
-          reflect->SetFloat( msg, field, val );
-        }
-        break;  
-        case FieldDescriptor::CPPTYPE_BOOL: {
-          const bool val= LUA_TO_BOOL( L, QPB_SET_VALUE );
-          reflect->SetBool( msg, field, val );
-        }
-        break;              
-        case FieldDescriptor::CPPTYPE_ENUM: {
-          const EnumValueDescriptor* val= LUA_TO_ENUM( msg, field, L, QPB_SET_VALUE );
-          reflect->SetEnum( msg, field, val );
-        }
-        break;
-        case FieldDescriptor::CPPTYPE_STRING: {
-          const std::string & val= LUA_TO_STRING( L, QPB_SET_VALUE );
-          reflect->SetString( msg, field, val );
-        }              
-        break;
-        case FieldDescriptor::CPPTYPE_MESSAGE: {
-          Message * dst= reflect->MutableMessage( msg, field );
-          if (!dst) {
-            QPB_ERR_MESSAGE( L, field->name().c_str() );
-          }
-          else {
-            const Message &val= LUA_TO_MESSAGE( L, QPB_SET_VALUE );
-            dst->CopyFrom( val );
-          }                  
-        }
-        break;
-        default:
-          QPB_ERR_TYPE( L, field->name().c_str() );
-        break;
+      if (field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE) {
+        Modified( L, QPB_MESSAGE_SELF, true ); // so do the sub-message's maps
       }
+      QpbAccessor::For( field ).set( L, msg, field, QPB_SET_VALUE );
     }      
   }    
   return 0;
@@ -324,76 +670,36 @@ int QpbMessage::add(lua_State*L, const FieldDescriptor* field)
   if (!field->is_repeated()) {
     QPB_ERR_REPEATED_FIELD(L,field->name().c_str() ); 
   }
+  else if (field->is_map()) {
+    // a handle to a bare entry could change its key behind the map's index ( see QpbMap )
+    QPB_ERR_ADD_MAP( L, field->name().c_str() );
+  }
   else {
-    Message * msg= _msg.demute(L);
+    Message * msg= mutate( L, field );
     if (msg) {
-      const Reflection * reflect= msg->GetReflection();
-      switch ( field->cpp_type() ) {
-        case FieldDescriptor::CPPTYPE_INT32: {
-          const int32 val= LUA_TO_INT32(L,QPB_APPEND_VALUE);
-          reflect->AddInt32( msg, field, val );
+      if (field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE) {
+        // ex. add_foo() returns the new sub-message
+        if (lua_type(L, QPB_APPEND_VALUE ) != LUA_TNONE) {
+          QPB_ERR_ADD_MESSAGE( L, field->name().c_str() );  
         }
-        break;              
-        case FieldDescriptor::CPPTYPE_INT64: {
-          const int64 val= LUA_TO_INT64( L, QPB_APPEND_VALUE );
-          reflect->AddInt64( msg, field, val );
+        else {
+          // protobuf reuses the messages of cleared elements, maps included
+          Modified( L, QPB_MESSAGE_SELF, true );
+          const Reflection * reflect= msg->GetReflection();
+          int size= reflect->FieldSize( *msg, field );
+          Message * newmsg= reflect->AddMessage( msg, field );
+          ret= LUA_PUSH_MESSAGE( L, newmsg, size );
         }
-        break;
-        case FieldDescriptor::CPPTYPE_UINT32: {
-          const uint32 val= LUA_TO_UINT32( L, QPB_APPEND_VALUE );
-          reflect->AddUInt32( msg, field, val );
-        }
-        break;              
-        case FieldDescriptor::CPPTYPE_UINT64: {
-          const uint64 val= LUA_TO_UINT64( L, QPB_APPEND_VALUE );
-          reflect->AddUInt64( msg, field, val );
-        }
-        break;              
-        case FieldDescriptor::CPPTYPE_DOUBLE: {
-          const double val= LUA_TO_DOUBLE( L, QPB_APPEND_VALUE );
-          reflect->AddDouble( msg, field, val );
-        }
-        break;              
-        case FieldDescriptor::CPPTYPE_FLOAT: {
-          const float val= LUA_TO_FLOAT( L, QPB_APPEND_VALUE );
-          reflect->AddFloat( msg, field, val );
-        }
-        break;  
-        case FieldDescriptor::CPPTYPE_BOOL: {
-          const bool val= LUA_TO_BOOL( L, QPB_APPEND_VALUE );
-          reflect->AddBool( msg, field, val );
-        }
-        break;              
-        case FieldDescriptor::CPPTYPE_ENUM: {
-          const EnumValueDescriptor* val= LUA_TO_ENUM( msg, field, L, QPB_APPEND_VALUE );
-          reflect->AddEnum( msg, field, val );
-        }
-        break;
-        case FieldDescriptor::CPPTYPE_STRING: {
-          const std::string & val= LUA_TO_STRING( L, QPB_APPEND_VALUE );
-          if (lua_type(L, QPB_APPEND_VALUE ) == LUA_TNONE) {
-            QPB_ERR_MUTE_STRING( L, field->name().c_str() );
-          }
-          else {
-            reflect->AddString( msg, field, val );
-          }            
-        }              
-        break;
-        case FieldDescriptor::CPPTYPE_MESSAGE: {
-          if (lua_type(L, QPB_APPEND_VALUE ) != LUA_TNONE) {
-            QPB_ERR_ADD_MESSAGE( L, field->name().c_str() );  
-          }
-          else {
-            int size= reflect->FieldSize( *msg, field );
-            Message * newmsg= reflect->AddMessage( msg, field );
-            LUA_PUSH_MESSAGE( L, newmsg, size );
-            ret= 1;
-          }
-        }
-        break;
-        default:
-          QPB_ERR_TYPE( L, field->name().c_str() );
-        break;
+      }
+      else if (field->cpp_type()==FieldDescriptor::CPPTYPE_STRING && lua_type(L, QPB_APPEND_VALUE ) == LUA_TNONE) {
+        // ex. add_foo() returns a builder for the new, empty, string
+        const Reflection * reflect= msg->GetReflection();
+        const int size= reflect->FieldSize( *msg, field );
+        reflect->AddString( msg, field, std::string() );
+        ret= QpbView::PushView( L, msg, field, size );
+      }
+      else {
+        QpbAccessor::For( field ).add( L, msg, field, QPB_APPEND_VALUE );
       }
     }      
   }      
@@ -403,9 +709,20 @@ int QpbMessage::add(lua_State*L, const FieldDescriptor* field)
 //---------------------------------------------------------------------------
 int QpbMessage::clear( lua_State * L, const FieldDescriptor* field ) 
 {
-  Message * msg= _msg.demute(L);
+  Message * msg= mutate( L, field );
   if (msg) {
     const Reflection * reflect= msg->GetReflection();
+    if (field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE) {
+      if (!field->is_repeated() && reflect->HasField( *msg, field )) {
+        Invalidate( L, QPB_MESSAGE_SELF, reflect->GetMessage( *msg, field ) );
+      }
+      else if (field->is_map()) {
+        // protobuf can free cleared entries when it next syncs the entries with its hashed map
+        Invalidate( L, QPB_MESSAGE_SELF, *msg, field );
+      }
+      // maps index their entries ( see QpbMap )
+      Modified( L, QPB_MESSAGE_SELF, true );
+    }
     reflect->ClearField( msg, field );
   }    
   return 0;
@@ -418,25 +735,32 @@ int QpbMessage::release(lua_State*L, const FieldDescriptor* field)
 {
   int ret=0;
   if (field->type()==FieldDescriptor::TYPE_STRING) {
-    if (_msg.demute(L)) {
+    if (mutate( L, field )) {
       ret= get( L,field );
       clear( L,field );
     }      
   }
   else 
-  if (field->type()==FieldDescriptor::TYPE_MESSAGE) {
-    Message * msg= _msg.demute(L);
+  if (field->type()==FieldDescriptor::TYPE_MESSAGE && !field->is_repeated()) {
+    Message * msg= mutate( L, field );
     if (msg) {
       const Reflection * reflect= msg->GetReflection();
-      const Message& val= reflect->GetMessage( _msg, field );
-      //
-      Message* dst= val.New();
+      // the field gives up its message without a copy ( unless msg lives in an arena ),
+      // an unset field hands back a new, empty, message.
+      if (reflect->HasField( *msg, field )) {
+        Invalidate( L, QPB_MESSAGE_SELF, reflect->GetMessage( *msg, field ) );
+        if (msg->GetArena()) {
+          QPB_STAT( deep_copies );
+        }
+      }
+      Message* dst= reflect->ReleaseMessage( msg, field );
+      if (!dst) {
+        dst= reflect->GetMessage( *msg, field ).New();
+      }
       if (!dst) {
         QPB_ERR_ALLOC(L);
       }
       else {
-        dst->CopyFrom(val);
-        reflect->ClearField( msg, field );
         ret= LUA_PUSH_MESSAGE( L, dst, QpbMessage::unowned );
       }        
     }      
@@ -446,3 +770,101 @@ int QpbMessage::release(lua_State*L, const FieldDescriptor* field)
   }
   return ret;    
 }
+
+//---------------------------------------------------------------------------
+// pb.field ( with QPB_FIELD_PROPERTIES )
+// repeated fields return an array ( or a map ) with the same mutability as the message,
+// so that pb.field[i]= value works; everything else is the same as pb:field()
+// reading through the proxy leaves a lazily decoded message untouched, its writes mark it ( see Modified )
+int QpbMessage::property(lua_State*L, const FieldDescriptor* field )
+{
+  int ret=0;
+  if (field->is_map()) {
+    const Message& msg= touch( L, field );
+    ret= _msg.is_mutable() ? QpbMap::PushProxy( L, _msg.demute(0), field ) : QpbMap::PushProxy( L, msg, field );
+  }
+  else if (field->is_repeated()) {
+    const Message& msg= touch( L, field );
+    ret= _msg.is_mutable() ? QpbArray::PushProxy( L, _msg.demute(0), field ) : QpbArray::PushProxy( L, msg, field );
+  }
+  else {
+    ret= get( L, field );
+  }
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// pb.field= value; pb.field= nil clears the field
+int QpbMessage::assign(lua_State*L, const FieldDescriptor* field )
+{
+  if (lua_isnil( L, QPB_SET_VALUE )) {
+    clear( L, field );
+  }
+  else 
+  if (field->is_repeated()) {
+    QPB_ERR_ASSIGN_REPEATED( L, field->name().c_str() );
+  }
+  else {
+    set( L, field );
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// pb:set_allocated_field( child ), pb:set_allocated_field( nil )
+// moves a top level message into the field without copying it.
+// afterwards, child is a view of the field ( the same as pb:mutable_field() )
+int QpbMessage::set_allocated(lua_State*L, const FieldDescriptor* field )
+{
+  Message * msg= mutate( L, field );
+  if (msg) {
+    const Reflection * reflect= msg->GetReflection();
+    if (field->is_repeated() || field->cpp_type()!=FieldDescriptor::CPPTYPE_MESSAGE) {
+      QPB_ERR_ALLOCATED( L, field->name().c_str() );
+    }
+    else
+    if (lua_isnoneornil( L, QPB_SET_VALUE )) {
+      clear( L, field );
+    }
+    else {
+      QpbMessage* val= GetUserData( L, QPB_SET_VALUE );
+      val->settle( L, true );
+      Message* sub= val->_msg.demute(L);
+      QpbRef::PushRoot( L, QPB_MESSAGE_SELF );
+      // moving a message into its own tree would make it own itself.
+      const bool cycle= lua_rawequal( L, -1, QPB_SET_VALUE )!=0;
+      lua_pop( L, 1 );
+      if (val->_owner!=unowned || cycle || sub->GetDescriptor()!=field->message_type()) {
+        QPB_ERR_ALLOCATED( L, field->name().c_str() );
+      }
+      else
+      if (val->_arena && val->_arena->GetArena()!=msg->GetArena()) {
+        // protobuf would copy between arenas anyway; leave the value as it is
+        Modified( L, QPB_MESSAGE_SELF, true );
+        reflect->MutableMessage( msg, field )->CopyFrom( *sub );
+        QPB_STAT( deep_copies );
+      }
+      else {
+        // a heap message is adopted by msg ( or by msg's arena ) 
+        if (reflect->HasField( *msg, field )) {
+          Invalidate( L, QPB_MESSAGE_SELF, reflect->GetMessage( *msg, field ) );
+        }
+        reflect->SetAllocatedMessage( msg, sub, field );
+        if (val->_arena) {
+          val->_arena->release(); // msg's root holds the arena now
+          val->_arena= 0;
+        }
+        val->_owner= message_owner;
+        // handles into the value join the tree, before the value stops being a root
+        QpbRef::MoveCache( L, QPB_SET_VALUE, QPB_MESSAGE_SELF );
+        QpbRef::SetOwner( L, QPB_SET_VALUE, QPB_MESSAGE_SELF );
+        // the value is now the tree's handle for the field's message
+        val->_msg.PushSlot( L, QPB_MESSAGE_SELF, 0 );
+        lua_pushvalue( L, QPB_SET_VALUE );
+        lua_rawsetp( L, -2, val->_msg.Key() );
+        lua_pop( L, 1 );
+      }
+    }
+  }
+  return 0;
+}
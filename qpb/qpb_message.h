@@ -12,9 +12,16 @@
 #ifndef __QPB_MESSAGE_H__
 #define __QPB_MESSAGE_H__
 
+#include <string>
+
 #include "qpb_forwards.h"
 #include "qpb_ref.h"
 
+struct QpbArena;
+struct QpbPool;
+struct QpbFieldMask;
+struct QpbLazy;
+
 //---------------------------------------------------------------------------
 /**
  * POD-like type managed by lua, we are a proxy to control how garbage colleciton works
@@ -23,7 +30,7 @@ struct QpbMessage
 {
   enum owned {
     unowned=-2,         // a "top level" message, created by 'new, gc/garbage collect will delete
-    message_owner=-1,   // this message is owned by another message
+    message_owner=-1,   // this message is owned by another message ( the handle's user value keeps the root alive )
                         // else: the index of the message in its parent's array
   };
   typedef google::protobuf::Message Message;
@@ -32,13 +39,46 @@ struct QpbMessage
 
   /**
    * @param owner enum owned, or an index
+   * @param arena for unowned messages, the arena the message was allocated from ( the handle keeps it alive )
    * @return 1 on success
    */
-  static int PushMsg(lua_State*, const QpbRef& msg, int owner );
+  static int PushMsg(lua_State*, const QpbRef& msg, int owner, QpbArena* arena= 0 );
   static QpbMessage* GetUserData( lua_State *, int idx= QPB_MESSAGE_SELF );
+  /**
+   * the tree of the handle at idx is about to change, or to hand out a mutable part of itself:
+   * a lazily decoded root stops handing back its original bytes.
+   * a nested change can rewrite map fields out of sight of their proxies ( a copy into a sub-message, a parse ),
+   * and also counts toward Changes.
+   */
+  static void Modified( lua_State *, int idx, bool nested= false );
+  /**
+   * the count of nested changes to the tree of the handle at idx; a map's index of its entries is good while it stays the same.
+   */
+  static unsigned Changes( lua_State *, int idx );
+  /**
+   * disable every cached handle of the tree of the handle at idx that points into sub, 
+   * sub included, and drop them from the cache; for a sub-message about to be deleted, or given away.
+   * with a field, only the handles into the messages of that field of sub.
+   */
+  static void Invalidate( lua_State *, int idx, const Message& sub, const FieldDescriptor* field= 0 );
 
-  int collect(lua_State* L);
+  /**
+   * delete an unowned message, or with a pool, clear it and keep it for reuse.
+   */
+  int collect(lua_State* L, QpbPool* pool= 0);
   int to_string(lua_State*L) const;
+  int encode(lua_State*L) const;
+  /**
+   * @param mask only the fields of the mask are parsed, the rest are skipped ( see QpbFieldMask )
+   */
+  int parse(lua_State*L, int idx, const QpbFieldMask* mask= 0);
+  /**
+   * keep the wire format string at idx, and parse each field on first use ( see QpbLazy )
+   */
+  int parse_lazy(lua_State*L, int idx);
+  int to_table(lua_State*L) const;
+  int merge_table(lua_State*L, int idx);
+  int to_json(lua_State*L) const;
 
   const FieldDescriptor* field( lua_State*L, const char * name ) const;
   int has(lua_State*L, const FieldDescriptor* field) const;
@@ -49,15 +89,44 @@ struct QpbMessage
   int add(lua_State*L, const FieldDescriptor* field);
   int clear( lua_State * L, const FieldDescriptor* field );
   int release(lua_State*L, const FieldDescriptor* field );
+  int set_allocated(lua_State*L, const FieldDescriptor* field );
+  int view(lua_State*L, const FieldDescriptor* field) const;
+  int property(lua_State*L, const FieldDescriptor* field );
+  int assign(lua_State*L, const FieldDescriptor* field );
   int owner(lua_State*L);
 
-  const Message& GetMessage() const {
+  /**
+   * give up the message of the top level handle at idx, for QPB.attach in this or another state.
+   * the handle, and every other handle of its tree, stop working.
+   */
+  Message* detach(lua_State*L, int idx);
+
+  /**
+   * the whole message; a lazily decoded message gets parsed first,
+   * raising a lua error for malformed bytes if there's a state to raise it in.
+   */
+  const Message& GetMessage( lua_State*L= 0 ) const {
+    if (_lazy) {
+      settle( L, false );
+    }
     return _msg;
   }
+  const Descriptor* GetDescriptor() const;
+  /**
+   * the wire format bytes of a lazily decoded message that hasn't changed since, or 0
+   */
+  const std::string* pristine() const;
 
 private:  
+  const Message& touch( lua_State*L, const FieldDescriptor* field ) const;
+  Message* mutate( lua_State*L, const FieldDescriptor* field );
+  void settle( lua_State*L, bool forget ) const;
+
   QpbRef _msg;
   int _owner; // unowned if there is no owner ( ie. it's a message allocated with 'new' )
+  QpbArena* _arena; // unowned messages allocated from an arena are freed with the arena, not deleted
+  mutable QpbLazy* _lazy; // the unparsed fields of a top level message from QPB.decode_lazy
+  unsigned _changes; // for a top level message, see Changes
   QpbMessage(); // unimplemented
 };
 
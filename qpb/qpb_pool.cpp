@@ -0,0 +1,131 @@
+/**
+ * @file qpb_pool.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_pool.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include "qpb_lua.h"
+
+using namespace google::protobuf;
+
+//---------------------------------------------------------------------------
+QpbPool::QpbPool( int limit )
+  : _limit( limit )
+  , _hits(0)
+  , _misses(0)
+  , _recycled(0)
+  , _dropped(0)
+{
+}
+
+//---------------------------------------------------------------------------
+QpbPool::~QpbPool()
+{
+  for (pool_map::iterator it= _pools.begin(); it!= _pools.end(); ++it) {
+    message_list & list= it->second;
+    for (size_t i=0; i< list.size(); ++i) {
+      delete list[i];
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+Message* QpbPool::New( const Message* prototype )
+{
+  Message* msg= 0;
+  {
+    std::lock_guard<std::mutex> lock( _lock );
+    message_list & list= _pools[ prototype->GetDescriptor() ];
+    if (!list.empty()) {
+      msg= list.back();
+      list.pop_back();
+    }
+    if (msg) {
+      ++_hits;
+    }
+    else {
+      ++_misses;
+    }
+  }
+  // a message that didn't come from the same factory gives way to one that did.
+  if (msg && msg->GetReflection()!=prototype->GetReflection()) {
+    delete msg;
+    msg= 0;
+  }
+  if (!msg) {
+    msg= prototype->New();
+  }
+  return msg;
+}
+
+//---------------------------------------------------------------------------
+void QpbPool::Recycle( Message* msg )
+{
+  msg->Clear();
+  {
+    std::lock_guard<std::mutex> lock( _lock );
+    message_list & list= _pools[ msg->GetDescriptor() ];
+    if ((int) list.size() < _limit) {
+      list.push_back( msg );
+      ++_recycled;
+      msg= 0;
+    }
+    else {
+      ++_dropped;
+    }
+  }
+  delete msg;
+}
+
+//---------------------------------------------------------------------------
+void QpbPool::SetLimit( int limit )
+{
+  std::lock_guard<std::mutex> lock( _lock );
+  _limit= limit;
+  for (pool_map::iterator it= _pools.begin(); it!= _pools.end(); ++it) {
+    message_list & list= it->second;
+    while ((int) list.size() > _limit) {
+      delete list.back();
+      list.pop_back();
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+// { hits=, misses=, recycled=, dropped=, pooled= }
+// the counts are copied under the lock, and pushed after it's released: 
+// lua can raise on allocation, and a raise skips the lock's destructor.
+int QpbPool::push_stats( lua_State* L ) const
+{
+  size_t pooled=0, hits, misses, recycled, dropped;
+  {
+    std::lock_guard<std::mutex> lock( _lock );
+    for (pool_map::const_iterator it= _pools.begin(); it!= _pools.end(); ++it) {
+      pooled+= it->second.size();
+    }
+    hits= _hits;
+    misses= _misses;
+    recycled= _recycled;
+    dropped= _dropped;
+  }
+  lua_createtable( L, 0, 5 );
+  lua_pushinteger( L, (lua_Integer) hits );
+  lua_setfield( L, -2, "hits" );
+  lua_pushinteger( L, (lua_Integer) misses );
+  lua_setfield( L, -2, "misses" );
+  lua_pushinteger( L, (lua_Integer) recycled );
+  lua_setfield( L, -2, "recycled" );
+  lua_pushinteger( L, (lua_Integer) dropped );
+  lua_setfield( L, -2, "dropped" );
+  lua_pushinteger( L, (lua_Integer) pooled );
+  lua_setfield( L, -2, "pooled" );
+  return 1;
+}
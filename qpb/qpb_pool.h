@@ -0,0 +1,62 @@
+/**
+ * @file qpb_pool.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_POOL_H__
+#define __QPB_POOL_H__
+
+#include "qpb_forwards.h"
+#include <cstddef>
+#include <map>
+#include <mutex>
+#include <vector>
+
+//---------------------------------------------------------------------------
+/**
+ * bounded per-type pool of cleared top level messages ( see QPB_MESSAGE_POOL ).
+ * shared by every state the Qpb is bound to, so each call takes the pool's lock.
+ * a recycled message keeps the capacity its strings and repeated fields have grown,
+ * so a new message of a shape that keeps repeating doesn't go back to the allocator.
+ */
+struct QpbPool
+{
+  typedef google::protobuf::Message Message;
+  typedef google::protobuf::Descriptor Descriptor;
+
+  QpbPool( int limit );
+  ~QpbPool();
+
+  /**
+   * a pooled message of the prototype's type, or a new one.
+   */
+  Message* New( const Message* prototype );
+
+  /**
+   * clear the message, and keep it for reuse; deletes it when its type's pool is full.
+   */
+  void Recycle( Message* msg );
+
+  /**
+   * the most messages kept per type.
+   */
+  void SetLimit( int limit );
+
+  int push_stats( lua_State* ) const;
+
+private:
+  typedef std::vector<Message*> message_list;
+  typedef std::map<const Descriptor*, message_list> pool_map;
+  mutable std::mutex _lock;
+  pool_map _pools;
+  int _limit;
+  size_t _hits, _misses, _recycled, _dropped;
+};
+
+#endif // #ifndef __QPB_POOL_H__
@@ -2,10 +2,7 @@
 
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/message.h>
-extern "C" {
-#include <lua.h>
-#include <lauxlib.h>
-}
+#include "qpb_lua.h"
 
 using namespace google::protobuf;
 
@@ -22,3 +19,152 @@ Message * QpbRef::demute(lua_State* L)
   }
   return ret;
 }
+
+//---------------------------------------------------------------------------
+// a new weak table of cached handles
+static void qpb_new_slot( lua_State * L ) 
+{
+  lua_newtable( L );
+  if (luaL_newmetatable( L, QPB_CACHE_METATABLE )) {
+    lua_pushliteral( L, "v" );
+    lua_setfield( L, -2, "__mode" );
+  }
+  lua_setmetatable( L, -2 );
+}
+
+//---------------------------------------------------------------------------
+// lua 5.3 user values can be any value: every handle but a root holds its root there, 
+// and a root holds its cache. earlier versions only accept tables;
+// for those the owners, and the caches, live in weak keyed tables in the registry instead.
+#if LUA_VERSION_NUM < 503
+// push the weak table in the registry at name, creating it if need be.
+static void qpb_weak_table( lua_State * L, const char * name, const char * mode ) 
+{
+  lua_getfield( L, LUA_REGISTRYINDEX, name );
+  if (lua_isnil( L, -1 )) {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_createtable( L, 0, 1 );
+    lua_pushstring( L, mode );
+    lua_setfield( L, -2, "__mode" );
+    lua_setmetatable( L, -2 );
+    lua_pushvalue( L, -1 );
+    lua_setfield( L, LUA_REGISTRYINDEX, name );
+  }
+}
+
+static void qpb_owners( lua_State * L ) 
+{
+  qpb_weak_table( L, QPB_OWNER_TABLE, "k" );
+}
+#endif
+
+//---------------------------------------------------------------------------
+void QpbRef::PushRoot( lua_State * L, int idx ) 
+{
+  idx= lua_absindex( L, idx );
+#if LUA_VERSION_NUM >= 503
+  lua_getuservalue( L, idx );
+#else
+  qpb_owners( L );
+  lua_pushvalue( L, idx );
+  lua_rawget( L, -2 );
+  lua_remove( L, -2 );
+#endif
+  if (lua_type( L, -1 )!=LUA_TUSERDATA) {
+    lua_pop( L, 1 );
+    lua_pushvalue( L, idx );
+  }
+}
+
+//---------------------------------------------------------------------------
+void QpbRef::SetOwner( lua_State * L, int idx, int parent ) 
+{
+  idx= lua_absindex( L, idx );
+#if LUA_VERSION_NUM >= 503
+  PushRoot( L, parent );
+  lua_setuservalue( L, idx );
+#else
+  qpb_owners( L );
+  lua_pushvalue( L, idx );
+  PushRoot( L, parent );
+  lua_rawset( L, -3 );
+  lua_pop( L, 1 );
+#endif
+}
+
+//---------------------------------------------------------------------------
+void QpbRef::PushCache( lua_State * L, int idx ) 
+{
+  PushRoot( L, idx );
+#if LUA_VERSION_NUM >= 503
+  lua_getuservalue( L, -1 );
+  if (!lua_istable( L, -1 )) {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_pushvalue( L, -1 );
+    lua_setuservalue( L, -3 );
+  }
+#else
+  qpb_weak_table( L, QPB_CACHE_TABLE, "k" );
+  lua_pushvalue( L, -2 );
+  lua_rawget( L, -2 );
+  if (!lua_istable( L, -1 )) {
+    lua_pop( L, 1 );
+    lua_newtable( L );
+    lua_pushvalue( L, -3 );
+    lua_pushvalue( L, -2 );
+    lua_rawset( L, -4 );
+  }
+  lua_remove( L, -2 ); // the table of caches
+#endif
+  lua_remove( L, -2 ); // the root
+}
+
+//---------------------------------------------------------------------------
+void QpbRef::PushSlot( lua_State * L, int idx, int slot ) const
+{
+  const int key= 2*slot + (_mutation==QPB_MUTABLE ? 1 : 0);
+  PushCache( L, idx );
+  lua_rawgeti( L, -1, key );
+  if (!lua_istable( L, -1 )) {
+    lua_pop( L, 1 );
+    qpb_new_slot( L );
+    lua_pushvalue( L, -1 );
+    lua_rawseti( L, -3, key );
+  }
+  lua_remove( L, -2 ); // the cache
+}
+
+//---------------------------------------------------------------------------
+void QpbRef::MoveCache( lua_State * L, int from, int to )
+{
+  from= lua_absindex( L, from );
+  to= lua_absindex( L, to );
+  PushCache( L, to );
+  const int dst= lua_gettop( L );
+  PushCache( L, from );
+  lua_pushnil( L );
+  while (lua_next( L, -2 )) {
+    // the same slot in the other tree
+    lua_pushvalue( L, -2 );
+    lua_rawget( L, dst );
+    if (!lua_istable( L, -1 )) {
+      lua_pop( L, 1 );
+      qpb_new_slot( L );
+      lua_pushvalue( L, -3 );
+      lua_pushvalue( L, -2 );
+      lua_rawset( L, dst );
+    }
+    lua_pushnil( L );
+    while (lua_next( L, -3 )) {
+      SetOwner( L, -1, to );
+      lua_pushvalue( L, -2 );
+      lua_pushvalue( L, -2 );
+      lua_rawset( L, -5 );
+      lua_pop( L, 1 );
+    }
+    lua_pop( L, 2 );
+  }
+  lua_pop( L, 2 );
+}
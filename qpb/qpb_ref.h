@@ -15,8 +15,13 @@
 #include "qpb_forwards.h"
 
 /**
- * placeholder for referencing counting object
- * so that lua owned messages don't get arbitrarily deleted out under array proxies
+ * pointer to a message, and whether the holder may change it.
+ *
+ * ownership is tracked by lua: a top level ( unowned ) handle owns its message,
+ * every other handle holds the root handle of its tree as its lua user value.
+ * so lua owned messages don't get arbitrarily deleted out under array proxies and sub-messages.
+ * the root caches the other handles of its tree, so each is only created once:
+ * the cache has a weak table per slot ( see PushSlot ), keyed by message.
  */
 struct QpbRef {
   typedef google::protobuf::Message Message;
@@ -53,6 +58,50 @@ struct QpbRef {
    * if the object is immutable,  if the passed L is valid raises an error, otherwise returns NULL,
    */
   Message * demute( lua_State * L );
+  bool is_mutable() const {
+    return _mutation==QPB_MUTABLE;
+  }
+
+  /**
+   * push the handle that owns the tree of the handle at idx: 
+   * its user value, or the handle itself when it's a root.
+   */
+  static void PushRoot( lua_State * L, int idx );
+
+  /**
+   * make the handle at idx keep the root of the handle at parent alive.
+   */
+  static void SetOwner( lua_State * L, int idx, int parent );
+
+  /**
+   * push the table of slots cached for the tree of the handle at idx.
+   * its keys are the slot numbers, its values the weak tables of PushSlot.
+   */
+  static void PushCache( lua_State * L, int idx );
+
+  /**
+   * the handles cached for the tree of the root at from join the tree of the handle at to,
+   * and keep its root alive instead; for a root that's adopted by another tree.
+   */
+  static void MoveCache( lua_State * L, int from, int to );
+
+  /**
+   * push the weak table of handles cached at slot for the tree of the handle at idx;
+   * a handle stays cached as long as something else in lua uses it.
+   * slot 0 holds the handles of messages, slot 1+index the arrays or maps of the field with that index,
+   * and slot -1 the views ( see QpbView ), keyed by the view itself.
+   * mutable and immutable handles are cached in separate tables. 
+   */
+  void PushSlot( lua_State * L, int idx, int slot ) const;
+
+  /**
+   * the key of this message in its slot tables.
+   * each slot has a table of its own, so different kinds of handles to one message don't collide;
+   * a handle found by key still has to be checked, its message might have been deleted, and the memory reused.
+   */
+  const void * Key() const {
+    return _message;
+  }
 
 private:
   const Message* _message;
@@ -0,0 +1,205 @@
+/**
+ * @file qpb_stats.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_stats.h"
+#include "qpb_lua.h"
+
+#ifdef QPB_STATS
+
+#include <google/protobuf/descriptor.h>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+using namespace google::protobuf;
+
+typedef std::atomic<unsigned long long> qpb_counter;
+
+// latency buckets: bucket i holds samples of at least 2^(i-1) and under 2^i nanoseconds
+static const int qpb_buckets= 32;
+
+static const char * qpb_counter_names[QpbStats::counter_count]= {
+  "handles_message", "handles_array", "handles_map", "closures", "messages_allocated", "messages_freed",
+  "deep_copies", "bytes_encoded", "bytes_decoded",
+};
+static const char * qpb_op_names[QpbStats::op_count]= {
+  "get", "has", "set", "add", "size", "clear", "mutable", "release", "set_allocated", 
+  "property", "assign", "array_get", "array_set", "view",
+  "map_get", "map_set",
+};
+
+static qpb_counter qpb_counters[QpbStats::counter_count];
+static qpb_counter qpb_calls[QpbStats::op_count];
+static qpb_counter qpb_latency[QpbStats::op_count][qpb_buckets];
+static qpb_counter qpb_sampler;
+
+// per field counts, in an open addressed table so that workers never share a lock:
+// a field claims its slot the first time it's counted, and keeps it until the process exits.
+// a field that finds no free slot within qpb_field_probes is only counted in qpb_fields_untracked.
+// the types' counts are summed from these when they're pushed.
+static const int qpb_field_slots= 4096; // a power of two
+static const int qpb_field_probes= 64;
+
+struct QpbFieldCount {
+  std::atomic<const FieldDescriptor*> field;
+  qpb_counter count;
+};
+static QpbFieldCount qpb_fields[qpb_field_slots];
+static qpb_counter qpb_fields_untracked;
+
+//---------------------------------------------------------------------------
+static long long qpb_now()
+{
+  typedef std::chrono::steady_clock clock;
+  return std::chrono::duration_cast<std::chrono::nanoseconds>( clock::now().time_since_epoch() ).count();
+}
+
+//---------------------------------------------------------------------------
+void QpbStats::Count( Counter c, size_t n )
+{
+  qpb_counters[c].fetch_add( n, std::memory_order_relaxed );
+}
+
+//---------------------------------------------------------------------------
+static void qpb_count_field( const FieldDescriptor* field )
+{
+  const uintptr_t hash= ((uintptr_t) field >> 4) * 2654435761u;
+  for (int i=0; i< qpb_field_probes; ++i) {
+    QpbFieldCount & slot= qpb_fields[ (hash + i) & (qpb_field_slots-1) ];
+    const FieldDescriptor* claimed= slot.field.load( std::memory_order_acquire );
+    if (!claimed && slot.field.compare_exchange_strong( claimed, field, std::memory_order_acq_rel )) {
+      claimed= field;
+    }
+    if (claimed==field) {
+      slot.count.fetch_add( 1, std::memory_order_relaxed );
+      return;
+    }
+  }
+  qpb_fields_untracked.fetch_add( 1, std::memory_order_relaxed );
+}
+
+//---------------------------------------------------------------------------
+QpbStats::Access QpbStats::Begin( Op op, const FieldDescriptor* field )
+{
+  Access access= { op, 0 };
+  qpb_calls[op].fetch_add( 1, std::memory_order_relaxed );
+  qpb_count_field( field );
+  if ((qpb_sampler.fetch_add( 1, std::memory_order_relaxed ) & (QPB_STATS_SAMPLE-1))==0) {
+    access.start= qpb_now();
+  }
+  return access;
+}
+
+//---------------------------------------------------------------------------
+int QpbStats::End( const Access& access, int ret )
+{
+  if (access.start) {
+    unsigned long long ns= (unsigned long long) (qpb_now() - access.start);
+    int bucket=0;
+    while (ns && bucket < qpb_buckets-1) {
+      ns>>= 1;
+      ++bucket;
+    }
+    qpb_latency[access.op][bucket].fetch_add( 1, std::memory_order_relaxed );
+  }
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+static void qpb_set_count( lua_State* L, const char * name, unsigned long long n )
+{
+  lua_pushinteger( L, (lua_Integer) n );
+  lua_setfield( L, -2, name );
+}
+
+//---------------------------------------------------------------------------
+// { enabled=true, <counters>..., fields_untracked=n, calls={ get=n, ... }, types={ [full name]=n }, fields={ [full name]=n },
+//   latency={ get={ samples=n, buckets={ ... } }, ... } }
+// everything is read straight from the atomics: lua can raise while the tables are built, so there's no lock to hold.
+int QpbStats::Push( lua_State* L )
+{
+  lua_createtable( L, 0, counter_count + 6 );
+  lua_pushboolean( L, 1 );
+  lua_setfield( L, -2, "enabled" );
+  for (int i=0; i< counter_count; ++i) {
+    qpb_set_count( L, qpb_counter_names[i], qpb_counters[i].load( std::memory_order_relaxed ) );
+  }
+  qpb_set_count( L, "fields_untracked", qpb_fields_untracked.load( std::memory_order_relaxed ) );
+
+  lua_createtable( L, 0, op_count );
+  for (int i=0; i< op_count; ++i) {
+    qpb_set_count( L, qpb_op_names[i], qpb_calls[i].load( std::memory_order_relaxed ) );
+  }
+  lua_setfield( L, -2, "calls" );
+
+  lua_newtable( L ); // fields
+  lua_newtable( L ); // types
+  for (int i=0; i< qpb_field_slots; ++i) {
+    const FieldDescriptor* field= qpb_fields[i].field.load( std::memory_order_acquire );
+    const unsigned long long n= field ? qpb_fields[i].count.load( std::memory_order_relaxed ) : 0;
+    if (n) {
+      const char * type= field->containing_type()->full_name().c_str();
+      lua_getfield( L, -1, type );
+      const unsigned long long sum= n + (unsigned long long) lua_tointeger( L, -1 );
+      lua_pop( L, 1 );
+      qpb_set_count( L, type, sum );
+      lua_pushvalue( L, -2 );
+      qpb_set_count( L, field->full_name().c_str(), n );
+      lua_pop( L, 1 );
+    }
+  }
+  lua_setfield( L, -3, "types" );
+  lua_setfield( L, -2, "fields" );
+
+  lua_newtable( L );
+  for (int op=0; op< op_count; ++op) {
+    unsigned long long samples=0;
+    int used=0;
+    for (int b=0; b< qpb_buckets; ++b) {
+      const unsigned long long n= qpb_latency[op][b].load( std::memory_order_relaxed );
+      samples+= n;
+      used= n ? b+1 : used;
+    }
+    if (samples) {
+      lua_createtable( L, 0, 2 );
+      qpb_set_count( L, "samples", samples );
+      lua_createtable( L, used, 0 );
+      for (int b=0; b< used; ++b) {
+        lua_pushinteger( L, (lua_Integer) qpb_latency[op][b].load( std::memory_order_relaxed ) );
+        lua_rawseti( L, -2, b+1 );
+      }
+      lua_setfield( L, -2, "buckets" );
+      lua_setfield( L, -2, qpb_op_names[op] );
+    }
+  }
+  lua_setfield( L, -2, "latency" );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+void QpbStats::Reset()
+{
+  for (int i=0; i< counter_count; ++i) {
+    qpb_counters[i].store( 0, std::memory_order_relaxed );
+  }
+  for (int op=0; op< op_count; ++op) {
+    qpb_calls[op].store( 0, std::memory_order_relaxed );
+    for (int b=0; b< qpb_buckets; ++b) {
+      qpb_latency[op][b].store( 0, std::memory_order_relaxed );
+    }
+  }
+  // fields keep their slots
+  for (int i=0; i< qpb_field_slots; ++i) {
+    qpb_fields[i].count.store( 0, std::memory_order_relaxed );
+  }
+  qpb_fields_untracked.store( 0, std::memory_order_relaxed );
+}
+
+#endif // QPB_STATS
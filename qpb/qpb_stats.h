@@ -0,0 +1,84 @@
+/**
+ * @file qpb_stats.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_STATS_H__
+#define __QPB_STATS_H__
+
+#include "qpb_forwards.h"
+#include <stddef.h>
+
+//---------------------------------------------------------------------------
+/**
+ * process wide counters for QPB.stats(), compiled in only when QPB_STATS is defined.
+ * otherwise the QPB_STAT macros expand to nothing, and QPB.stats() returns { enabled=false }.
+ */
+#ifdef QPB_STATS
+
+// one of every QPB_STATS_SAMPLE field operations is timed ( a power of two )
+#ifndef QPB_STATS_SAMPLE
+#define QPB_STATS_SAMPLE 64
+#endif
+
+struct QpbStats
+{
+  typedef google::protobuf::FieldDescriptor FieldDescriptor;
+
+  enum Counter {
+    handles_message,    // message userdata created, rather than found in a root's cache
+    handles_array,      // array userdata created
+    handles_map,        // map userdata created
+    closures,           // field method closures built by Qpb::register_metatable
+    messages_allocated, // by Qpb::create, for new, decode, and from_table
+    messages_freed,     // unowned messages deleted, pooled, or handed back to their arena by __gc
+    deep_copies,        // message values copied by set, add, fill, and set_allocated across arenas
+    bytes_encoded,
+    bytes_decoded,
+    counter_count
+  };
+  enum Op {
+    op_get, op_has, op_set, op_add, op_size, op_clear, op_mutable, op_release, op_set_allocated, 
+    op_property, op_assign, op_array_get, op_array_set, op_view,
+    op_map_get, op_map_set,
+    op_count
+  };
+
+  static void Count( Counter, size_t n=1 );
+
+  /**
+   * a field operation: Begin counts it for its field and type, and every so often starts a timer that End stops.
+   * a lua error skips End, and the destructors of the frames it unwinds, so Access has none.
+   */
+  struct Access {
+    Op op;
+    long long start; // 0 when this call isn't sampled
+  };
+  static Access Begin( Op, const FieldDescriptor* );
+  static int End( const Access&, int ret );
+
+  static int Push( lua_State* );
+  static void Reset();
+};
+
+#define QPB_STAT( counter )           QpbStats::Count( QpbStats::counter )
+#define QPB_STAT_ADD( counter, n )    QpbStats::Count( QpbStats::counter, (n) )
+#define QPB_STAT_ACCESS( op, field )  const QpbStats::Access qpb_stat_access= QpbStats::Begin( QpbStats::op, (field) )
+#define QPB_STAT_DONE( ret )          QpbStats::End( qpb_stat_access, (ret) )
+
+#else
+
+#define QPB_STAT( counter )           ((void)0)
+#define QPB_STAT_ADD( counter, n )    ((void)0)
+#define QPB_STAT_ACCESS( op, field )  ((void)0)
+#define QPB_STAT_DONE( ret )          (ret)
+
+#endif // QPB_STATS
+
+#endif // #ifndef __QPB_STATS_H__
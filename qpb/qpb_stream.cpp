@@ -0,0 +1,268 @@
+/**
+ * @file qpb_stream.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_stream.h"
+#include "qpb_message.h"
+#include "qpb_stats.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl.h>
+#include "qpb_lua.h"
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#define qpb_open _open
+#else
+#include <unistd.h>
+#define qpb_open open
+#define O_BINARY 0
+#endif
+
+using namespace google::protobuf;
+using namespace google::protobuf::io;
+
+//---------------------------------------------------------------------------
+/**
+ * the file descriptor for the path or descriptor at idx; raises an error on failure.
+ * @param owned set if qpb opened the file, and so should close it.
+ */
+static int qpb_open_file( lua_State * L, int idx, int flags, bool * owned )
+{
+  int fd=-1;
+  if (lua_type( L, idx )==LUA_TNUMBER) {
+    fd= (int) lua_tointeger( L, idx );
+    *owned= false;
+  }
+  else {
+    const char * path= luaL_checkstring( L, idx );
+    fd= qpb_open( path, flags | O_BINARY, 0666 );
+    if (fd < 0) {
+      QPB_ERR_OPEN( L, path, strerror( errno ) );
+    }
+    *owned= true;
+  }
+  return fd;
+}
+
+//---------------------------------------------------------------------------
+// QpbReader
+//---------------------------------------------------------------------------
+int QpbReader::PushReader( lua_State * L, Message * msg )
+{
+  bool owned= false;
+  const int fd= qpb_open_file( L, QPB_READER_FILE, O_RDONLY, &owned );
+  // lua 'throws' on failed allocation
+  QpbReader* reader= (QpbReader*)lua_newuserdata( L, sizeof(QpbReader) );
+  reader->_input= 0;
+  reader->_msg= msg;
+  lua_insert( L, -2 ); 
+  reader->_ref= luaL_ref( L, LUA_REGISTRYINDEX ); // pops the message handle
+  luaL_getmetatable( L, QPB_READER_METATABLE ); // fetch the object metatable
+  lua_setmetatable( L, -2 ); // set the metatable of the user data
+  reader->_input= new FileInputStream( fd );
+  reader->_input->SetCloseOnDelete( owned );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+QpbReader* QpbReader::GetUserData( lua_State * L, int idx ) 
+{
+  QpbReader* reader= (QpbReader*) luaL_checkudata( L, idx, QPB_READER_METATABLE );
+  return reader;
+}
+
+//---------------------------------------------------------------------------
+int QpbReader::collect( lua_State * L )
+{
+  return close( L );
+}
+
+//---------------------------------------------------------------------------
+int QpbReader::close( lua_State * L )
+{
+  delete _input;
+  _input= 0;
+  if (_ref != LUA_NOREF) {
+    luaL_unref( L, LUA_REGISTRYINDEX, _ref );
+    _ref= LUA_NOREF;
+    _msg= 0;
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+int QpbReader::to_string( lua_State * L ) const
+{
+  lua_pushfstring( L, "qpb: %p - reader%s", this, _input ? "" : " (closed)" );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// pb= reader:read(), nil at the end of the file.
+// pb is the reader's message every time, cleared and refilled by each read.
+int QpbReader::read( lua_State * L )
+{
+  if (!_input) {
+    QPB_ERR_STREAM_CLOSED( L );
+  }
+  // raises an error if the message was detached
+  lua_rawgeti( L, LUA_REGISTRYINDEX, _ref );
+  QpbMessage::GetUserData( L, -1 );
+  QpbMessage::Modified( L, -1, true );
+  lua_pop( L, 1 );
+  bool ok= false, eof= false;
+  {
+    // a coded stream per record; it hands back what it over-read when it goes away.
+    CodedInputStream in( _input );
+    uint32 size=0;
+    if (!in.ReadVarint32( &size )) {
+      eof= in.CurrentPosition()==0;
+    }
+    else 
+    if (size <= INT_MAX) { // longer is a corrupt length, and would be a negative limit
+      CodedInputStream::Limit limit= in.PushLimit( (int) size );
+      _msg->Clear();
+      ok= _msg->MergeFromCodedStream( &in ) && in.ConsumedEntireMessage();
+      QPB_STAT_ADD( bytes_decoded, size );
+      in.PopLimit( limit );
+    }
+  }
+  if (ok) {
+    lua_rawgeti( L, LUA_REGISTRYINDEX, _ref );
+  }
+  else 
+  if (eof && _input->GetErrno()) {
+    QPB_ERR_READ( L, strerror( _input->GetErrno() ) );
+  }
+  else 
+  if (eof) {
+    lua_pushnil( L );
+  }
+  else {
+    QPB_ERR_PARSE( L, _msg->GetDescriptor()->full_name().c_str() );
+  }
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+int QpbReader::message( lua_State * L ) const
+{
+  if (!_msg) {
+    QPB_ERR_STREAM_CLOSED( L );
+  }
+  lua_rawgeti( L, LUA_REGISTRYINDEX, _ref );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// QpbWriter
+//---------------------------------------------------------------------------
+int QpbWriter::PushWriter( lua_State * L )
+{
+  bool owned= false;
+  const int fd= qpb_open_file( L, QPB_WRITER_FILE, O_WRONLY | O_CREAT | O_TRUNC, &owned );
+  // lua 'throws' on failed allocation
+  QpbWriter* writer= (QpbWriter*)lua_newuserdata( L, sizeof(QpbWriter) );
+  writer->_output= 0;
+  luaL_getmetatable( L, QPB_WRITER_METATABLE ); // fetch the object metatable
+  lua_setmetatable( L, -2 ); // set the metatable of the user data
+  writer->_output= new FileOutputStream( fd );
+  writer->_output->SetCloseOnDelete( owned );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+QpbWriter* QpbWriter::GetUserData( lua_State * L, int idx ) 
+{
+  QpbWriter* writer= (QpbWriter*) luaL_checkudata( L, idx, QPB_WRITER_METATABLE );
+  return writer;
+}
+
+//---------------------------------------------------------------------------
+int QpbWriter::collect( lua_State * L )
+{
+  return close( L );
+}
+
+//---------------------------------------------------------------------------
+// flushes, and closes the file if the writer opened it.
+int QpbWriter::close( lua_State * L )
+{
+  delete _output;
+  _output= 0;
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+int QpbWriter::to_string( lua_State * L ) const
+{
+  lua_pushfstring( L, "qpb: %p - writer%s", this, _output ? "" : " (closed)" );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// writer:write( pb ), or writer:write( bytes ) for an already encoded message
+int QpbWriter::write( lua_State * L )
+{
+  if (!_output) {
+    QPB_ERR_STREAM_CLOSED( L );
+  }
+  bool ok= false;
+  // a string is written as is, and so is a lazily decoded message that hasn't changed
+  const std::string* pristine= 0;
+  if (lua_type( L, QPB_WRITE_MESSAGE )==LUA_TSTRING || (pristine= QpbMessage::GetUserData( L, QPB_WRITE_MESSAGE )->pristine())!=0) {
+    size_t len=0;
+    const char * bytes= pristine ? pristine->data() : lua_tolstring( L, QPB_WRITE_MESSAGE, &len );
+    if (pristine) {
+      len= pristine->size();
+      QPB_STAT_ADD( bytes_encoded, len );
+    }
+    CodedOutputStream out( _output );
+    out.WriteVarint32( (uint32) len );
+    out.WriteRaw( bytes, (int) len );
+    ok= !out.HadError();
+  }
+  else {
+    const Message & msg= QpbMessage::GetUserData( L, QPB_WRITE_MESSAGE )->GetMessage( L );
+    if (!msg.IsInitialized()) {
+      QPB_ERR_UNINITIALIZED( L, msg.GetDescriptor()->full_name().c_str(), msg.InitializationErrorString().c_str() );
+    }
+    const size_t size= msg.ByteSizeLong();
+    if (size > INT_MAX) {
+      QPB_ERR_WRITE( L, "message too large" );
+    }
+    CodedOutputStream out( _output );
+    out.WriteVarint32( (uint32) size );
+    msg.SerializeWithCachedSizes( &out );
+    QPB_STAT_ADD( bytes_encoded, size );
+    ok= !out.HadError();
+  }
+  if (!ok) {
+    QPB_ERR_WRITE( L, strerror( _output->GetErrno() ) );
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+int QpbWriter::flush( lua_State * L )
+{
+  if (!_output) {
+    QPB_ERR_STREAM_CLOSED( L );
+  }
+  if (!_output->Flush()) {
+    QPB_ERR_WRITE( L, strerror( _output->GetErrno() ) );
+  }
+  return 0;
+}
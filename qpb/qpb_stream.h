@@ -0,0 +1,81 @@
+/**
+ * @file qpb_stream.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_STREAM_H__
+#define __QPB_STREAM_H__
+
+#include "qpb_forwards.h"
+
+namespace google {
+  namespace protobuf {
+    namespace io {
+      class FileInputStream;
+      class FileOutputStream;
+    }
+  }
+};
+
+//---------------------------------------------------------------------------
+/**
+ * POD-like type managed by lua, reads varint length delimited records from a file:
+ * local reader= QPB.reader( path_or_fd, name ); for pb in reader:records() do ... end
+ *
+ * every record is parsed into the same message, so reading allocates nothing per record.
+ */
+struct QpbReader
+{
+  typedef google::protobuf::Message Message;
+  typedef google::protobuf::io::FileInputStream FileInputStream;
+
+  /**
+   * pushes a reader of the file at QPB_READER_FILE, parsing into the message handle on top of the stack ( which is popped )
+   */
+  static int PushReader( lua_State*, Message* msg );
+  static QpbReader* GetUserData( lua_State *, int idx= QPB_STREAM_SELF );
+
+  int collect(lua_State*);
+  int close(lua_State*);
+  int to_string(lua_State*) const;
+  int read(lua_State*);
+  int message(lua_State*) const;
+
+private:
+  QpbReader(); // unimplemented
+  FileInputStream* _input;
+  Message* _msg;  // owned by the handle at _ref
+  int _ref;       // registry reference to the message handle
+};
+
+//---------------------------------------------------------------------------
+/**
+ * POD-like type managed by lua, writes varint length delimited records to a file:
+ * local writer= QPB.writer( path_or_fd ); writer:write( pb )
+ */
+struct QpbWriter
+{
+  typedef google::protobuf::io::FileOutputStream FileOutputStream;
+
+  // pushes a writer of the file at QPB_WRITER_FILE
+  static int PushWriter( lua_State* );
+  static QpbWriter* GetUserData( lua_State *, int idx= QPB_STREAM_SELF );
+
+  int collect(lua_State*);
+  int close(lua_State*);
+  int to_string(lua_State*) const;
+  int write(lua_State*);
+  int flush(lua_State*);
+
+private:
+  QpbWriter(); // unimplemented
+  FileOutputStream* _output;
+};
+
+#endif // #ifndef __QPB_STREAM_H__
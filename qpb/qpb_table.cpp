@@ -0,0 +1,252 @@
+/**
+ * @file qpb_table.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ *
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_table.h"
+#include "qpb.h"
+#include "qpb_message.h"
+#include "qpb_access.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/message.h>
+#include "qpb_lua.h"
+#include <string>
+
+using namespace google::protobuf;
+#include "qpb_convert.h"
+
+//---------------------------------------------------------------------------
+// message to table
+//---------------------------------------------------------------------------
+
+// push a single value; index is the element for repeated fields.
+// sub-messages are converted into the table at reuse ( if any )
+static void qpb_push_value( lua_State *L, const Message & msg, const FieldDescriptor*field, int index, int reuse )
+{
+  const bool repeated= field->is_repeated();
+  if (field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE) {
+    const Reflection * reflect= msg.GetReflection();
+    QpbTable::ToTable( L, repeated ? reflect->GetRepeatedMessage( msg, field, index ) : reflect->GetMessage( msg, field ), reuse );
+  }
+  else if (repeated) {
+    QpbAccessor::For( field ).get_repeated( L, msg, field, index );
+  }
+  else {
+    QpbAccessor::For( field ).get( L, msg, field );
+  }
+}
+
+//---------------------------------------------------------------------------
+// the table at 'table' is filled with the elements of the repeated field
+static void qpb_push_array( lua_State *L, const Message & msg, const FieldDescriptor*field, int size, int table )
+{
+  const bool nested= field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE;
+  const int old_size= (int) lua_rawlen( L, table );
+  for (int i=0; i<size; ++i) {
+    int reuse=0;
+    if (nested && i<old_size) {
+      lua_rawgeti( L, table, i+1 );
+      reuse= lua_istable( L, -1 ) ? lua_gettop( L ) : 0;
+    }
+    qpb_push_value( L, msg, field, i, reuse );
+    lua_rawseti( L, table, i+1 );
+    if (nested && i<old_size) {
+      lua_pop( L, 1 );
+    }
+  }
+  // trim the tail of a reused table
+  for (int i=old_size; i>size; --i) {
+    lua_pushnil( L );
+    lua_rawseti( L, table, i );
+  }
+}
+
+//---------------------------------------------------------------------------
+// map fields are repeated entry messages on the wire, in lua they are keyed tables
+static void qpb_push_map( lua_State *L, const Message & msg, const FieldDescriptor*field, int size, int table )
+{
+  const Reflection * reflect= msg.GetReflection();
+  const Descriptor * entry= field->message_type();
+  const FieldDescriptor* key= entry->map_key();
+  const FieldDescriptor* value= entry->map_value();
+
+  // a reused map is emptied first;
+  // assigning nil to an existing key is allowed during traversal.
+  lua_pushnil( L );
+  while (lua_next( L, table )) {
+    lua_pop( L, 1 );
+    lua_pushvalue( L, -1 );
+    lua_pushnil( L );
+    lua_rawset( L, table );
+  }
+  for (int i=0; i<size; ++i) {
+    const Message & pair= reflect->GetRepeatedMessage( msg, field, i );
+    qpb_push_value( L, pair, key, -1, 0 );
+    qpb_push_value( L, pair, value, -1, 0 );
+    lua_rawset( L, table );
+  }
+}
+
+//---------------------------------------------------------------------------
+int QpbTable::ToTable( lua_State * L, const Message & msg, int reuse )
+{
+  const Descriptor * desc= msg.GetDescriptor();
+  const Reflection * reflect= msg.GetReflection();
+  const int field_count= desc->field_count();
+  luaL_checkstack( L, 6, "QPB: message nested too deeply" );
+  if (reuse) {
+    lua_pushvalue( L, reuse );
+  }
+  else {
+    lua_createtable( L, 0, field_count );
+  }
+  const int table= lua_gettop( L );
+
+  for (int i=0; i< field_count; ++i) {
+    const FieldDescriptor * field= desc->field(i);
+    const std::string & name= field->name();
+    lua_pushlstring( L, name.c_str(), name.size() );
+    const int size= field->is_repeated() ? reflect->FieldSize( msg, field ) : 0;
+    const bool has= field->is_repeated() ? size>0 : reflect->HasField( msg, field );
+    if (!has) {
+      lua_pushnil( L );
+    }
+    else {
+      // nested tables are refilled if the reused table already has one
+      int nested=0;
+      if (reuse && (field->is_repeated() || field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE)) {
+        lua_pushvalue( L, -1 );
+        lua_rawget( L, table );
+        if (lua_istable( L, -1 )) {
+          nested= lua_gettop( L );
+        }
+        else {
+          lua_pop( L, 1 );
+        }
+      }
+      if (!field->is_repeated()) {
+        qpb_push_value( L, msg, field, -1, nested );
+      }
+      else {
+        if (!nested) {
+          lua_createtable( L, field->is_map() ? 0 : size, field->is_map() ? size : 0 );
+        }
+        const int array= lua_gettop( L );
+        if (field->is_map()) {
+          qpb_push_map( L, msg, field, size, array );
+        }
+        else {
+          qpb_push_array( L, msg, field, size, array );
+        }
+        if (nested) {
+          lua_pushvalue( L, nested ); // rawset below pops this copy
+        }
+      }
+      if (nested) {
+        lua_remove( L, nested );
+      }
+    }
+    lua_rawset( L, table );
+  }
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// table to message
+//---------------------------------------------------------------------------
+
+// tables deeper than this are an error, rather than a c stack overflow; a table can even contain itself.
+static const int QPB_MAX_TABLE_DEPTH= 100;
+
+static void qpb_merge_table( lua_State * L, Message * msg, int idx, int depth );
+
+// set, or for repeated fields append, the value at idx
+static void qpb_merge_value( lua_State *L, Message * msg, const FieldDescriptor*field, int idx, int depth )
+{
+  const bool repeated= field->is_repeated();
+  if (field->cpp_type()==FieldDescriptor::CPPTYPE_MESSAGE) {
+    const Reflection * reflect= msg->GetReflection();
+    if (lua_istable( L, idx )) {
+      Message * dst= repeated ? reflect->AddMessage( msg, field ) : reflect->MutableMessage( msg, field );
+      qpb_merge_table( L, dst, idx, depth+1 );
+    }
+    else {
+      // checked before adding, so a bad message leaves no empty element behind
+      const QpbCopySource src( LUA_TO_MESSAGE( field, L, idx ), msg, repeated ? 0 : &reflect->GetMessage( *msg, field ) );
+      Message * dst= repeated ? reflect->AddMessage( msg, field ) : reflect->MutableMessage( msg, field );
+      dst->MergeFrom( src.get() );
+      QPB_STAT( deep_copies );
+    }
+  }
+  else if (repeated) {
+    QpbAccessor::For( field ).add( L, msg, field, idx );
+  }
+  else {
+    QpbAccessor::For( field ).set( L, msg, field, idx );
+  }
+}
+
+//---------------------------------------------------------------------------
+static void qpb_merge_table( lua_State * L, Message * msg, int idx, int depth )
+{
+  const Descriptor * desc= msg->GetDescriptor();
+  idx= lua_absindex( L, idx );
+  luaL_checktype( L, idx, LUA_TTABLE );
+  if (depth> QPB_MAX_TABLE_DEPTH) {
+    QPB_ERR_NESTED( L );
+  }
+  luaL_checkstack( L, 6, "QPB: table nested too deeply" );
+
+  lua_pushnil( L );
+  while (lua_next( L, idx )) {
+    const int value= lua_gettop( L );
+    const char * name= lua_type( L, -2 )==LUA_TSTRING ? lua_tostring( L, -2 ) : 0;
+    const FieldDescriptor * field= name ? desc->FindFieldByName( name ) : 0;
+    if (!field) {
+      field= name ? desc->FindFieldByLowercaseName( name ) : 0;
+      if (!field) {
+        QPB_ERR_FIELD( L, name ? name : luaL_typename( L, -2 ) );
+      }
+    }
+    if (!field->is_repeated()) {
+      qpb_merge_value( L, msg, field, value, depth );
+    }
+    else {
+      luaL_checktype( L, value, LUA_TTABLE );
+      if (field->is_map()) {
+        const Reflection * reflect= msg->GetReflection();
+        const Descriptor * entry= field->message_type();
+        lua_pushnil( L );
+        while (lua_next( L, value )) {
+          Message * pair= reflect->AddMessage( msg, field );
+          qpb_merge_value( L, pair, entry->map_value(), lua_gettop( L ), depth );
+          lua_pop( L, 1 );
+          lua_pushvalue( L, -1 ); // converting the key itself would confuse lua_next
+          qpb_merge_value( L, pair, entry->map_key(), lua_gettop( L ), depth );
+          lua_pop( L, 1 );
+        }
+      }
+      else {
+        const int size= (int) lua_rawlen( L, value );
+        for (int i=1; i<=size; ++i) {
+          lua_rawgeti( L, value, i );
+          qpb_merge_value( L, msg, field, lua_gettop( L ), depth );
+          lua_pop( L, 1 );
+        }
+      }
+    }
+    lua_pop( L, 1 );
+  }
+}
+
+//---------------------------------------------------------------------------
+void QpbTable::MergeTable( lua_State * L, Message * msg, int idx )
+{
+  qpb_merge_table( L, msg, idx, 0 );
+}
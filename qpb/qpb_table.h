@@ -0,0 +1,43 @@
+/**
+ * @file qpb_table.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_TABLE_H__
+#define __QPB_TABLE_H__
+
+#include "qpb_forwards.h"
+
+//---------------------------------------------------------------------------
+/**
+ * whole message conversion to and from plain lua tables, in a single call.
+ * 
+ * fields are keyed by name; repeated fields are arrays, map fields are keyed tables,
+ * sub-messages are nested tables; unset fields are nil.
+ */
+struct QpbTable
+{
+  typedef google::protobuf::Message Message;
+
+  /**
+   * push a table with the contents of msg.
+   * @param reuse stack index of an existing table to refill ( and the tables nested in it ), or 0 for a new table.
+   *        only the keys named by msg's fields are touched.
+   * @return 1
+   */
+  static int ToTable( lua_State*, const Message& msg, int reuse );
+
+  /**
+   * merge the contents of the table at idx into msg.
+   * repeated and map fields are appended to; a sub-message may also be given as a qpb message.
+   */
+  static void MergeTable( lua_State*, Message* msg, int idx );
+};
+
+#endif // #ifndef __QPB_TABLE_H__
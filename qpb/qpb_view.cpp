@@ -0,0 +1,357 @@
+/**
+ * @file qpb_view.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ *
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_view.h"
+#include "qpb_ref.h"
+
+#include <google/protobuf/descriptor.h>
+#include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/message.h>
+#include "qpb_lua.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <algorithm>
+#ifdef _WIN32
+#include <io.h>
+#define qpb_write ::_write
+#else
+#include <unistd.h>
+#define qpb_write ::write
+#endif
+
+// lua 5.1 declares this in lualib.h
+#ifndef LUA_FILEHANDLE
+#define LUA_FILEHANDLE "FILE*"
+#endif
+
+using namespace google::protobuf;
+
+//---------------------------------------------------------------------------
+int QpbView::PushView( lua_State* L, const QpbRef& msg, const FieldDescriptor* field, int index )
+{
+  // lua 'throws' on failed allocation
+  QpbView* view= (QpbView*) lua_newuserdata( L, sizeof(QpbView) );
+  luaL_getmetatable( L, QPB_VIEW_METATABLE );
+  lua_setmetatable( L, -2 );
+  view->_msg= msg;
+  view->_field= field;
+  view->_index= index;
+  QpbRef::SetOwner( L, -1, QPB_OWNER_SELF );
+  // cached with the tree's other handles, so that QPB.detach can disable it
+  msg.PushSlot( L, QPB_OWNER_SELF, -1 );
+  lua_pushvalue( L, -2 );
+  lua_rawsetp( L, -2, view );
+  lua_pop( L, 1 );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+QpbView* QpbView::GetUserData( lua_State * L, int idx )
+{
+  return (QpbView*) luaL_checkudata( L, idx, QPB_VIEW_METATABLE );
+}
+
+//---------------------------------------------------------------------------
+void QpbView::check( lua_State* L ) const
+{
+  if (_index >= 0) {
+    const int size= _msg->GetReflection()->FieldSize( _msg, _field );
+    if (_index >= size) {
+      QPB_ERR_RANGE( L, _field->name().c_str(), _index+1, size );
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+const std::string& QpbView::bytes( std::string* scratch ) const
+{
+  const Reflection* reflect= _msg->GetReflection();
+  return _index < 0 ?
+    reflect->GetStringReference( _msg, _field, scratch ) :
+    reflect->GetRepeatedStringReference( _msg, _field, _index, scratch );
+}
+
+//---------------------------------------------------------------------------
+// reflection only hands out a const reference to a singular string;
+// once the field is set, that's the message's own std::string, and it's safe to change.
+std::string* QpbView::mutable_bytes( lua_State* L )
+{
+  Message* msg= _msg.demute( L );
+  check( L );
+  if (_field->options().ctype()==FieldOptions::CORD) {
+    QPB_ERR_MUTE_STRING( L, _field->name().c_str() );
+  }
+  const Reflection* reflect= msg->GetReflection();
+  std::string* ret= 0;
+  if (_index >= 0) {
+    // a repeated string's own std::string is only reachable through the typed container ( deprecated, but still the only way in. )
+#if defined(_MSC_VER)
+#pragma warning( push )
+#pragma warning( disable : 4996 )
+#elif defined(__GNUC__)
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+    ret= reflect->MutableRepeatedPtrField<std::string>( msg, _field )->Mutable( _index );
+#if defined(_MSC_VER)
+#pragma warning( pop )
+#elif defined(__GNUC__)
+#pragma GCC diagnostic pop
+#endif
+  }
+  else {
+    std::string scratch;
+    const std::string* s= &reflect->GetStringReference( *msg, _field, &scratch );
+    if (s==&_field->default_value_string()) {
+      // an unset field shares the default; setting it gives the message a string of its own
+      reflect->SetString( msg, _field, *s );
+      s= &reflect->GetStringReference( *msg, _field, &scratch );
+    }
+    if (s!=&scratch && s!=&_field->default_value_string()) {
+      ret= const_cast<std::string*>( s );
+    }
+  }
+  if (!ret) {
+    QPB_ERR_MUTE_STRING( L, _field->name().c_str() );
+  }
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// #view
+int QpbView::size( lua_State* L ) const
+{
+  check( L );
+  std::string scratch;
+  lua_pushinteger( L, (lua_Integer) bytes( &scratch ).size() );
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// like string.sub, negative positions count back from the end;
+// the range is clamped to the bytes, and empty when from > to.
+static void qpb_view_range( lua_Integer size, lua_Integer* from, lua_Integer* to )
+{
+  if (*from < 0) {
+    *from= std::max<lua_Integer>( size + *from + 1, 1 );
+  }
+  else if (*from==0) {
+    *from= 1;
+  }
+  if (*to < 0) {
+    *to+= size + 1;
+  }
+  else if (*to > size) {
+    *to= size;
+  }
+}
+
+//---------------------------------------------------------------------------
+// view:sub( [i [, j]] ) copies just bytes i through j into a lua string
+int QpbView::sub( lua_State* L ) const
+{
+  lua_Integer from= luaL_optinteger( L, QPB_VIEW_FROM, 1 );
+  lua_Integer to= luaL_optinteger( L, QPB_VIEW_TO, -1 );
+  check( L );
+  std::string scratch;
+  const std::string& s= bytes( &scratch );
+  qpb_view_range( (lua_Integer) s.size(), &from, &to );
+  if (from > to) {
+    lua_pushliteral( L, "" );
+  }
+  else {
+    lua_pushlstring( L, s.data() + from - 1, (size_t) (to - from + 1) );
+  }
+  return 1;
+}
+
+//---------------------------------------------------------------------------
+// view:byte( [i [, j]] ) the codes of bytes i through j, by default just the first
+int QpbView::byte( lua_State* L ) const
+{
+  lua_Integer from= luaL_optinteger( L, QPB_VIEW_FROM, 1 );
+  lua_Integer to= luaL_optinteger( L, QPB_VIEW_TO, from );
+  check( L );
+  int ret=0;
+  {
+    std::string scratch;
+    const std::string& s= bytes( &scratch );
+    qpb_view_range( (lua_Integer) s.size(), &from, &to );
+    const lua_Integer count= from <= to ? to - from + 1 : 0;
+    if (count > INT_MAX || !lua_checkstack( L, (int) count )) {
+      ret= -1;
+    }
+    else {
+      for (ret=0; ret< count; ++ret) {
+        lua_pushinteger( L, (unsigned char) s[ (size_t) from - 1 + ret ] );
+      }
+    }
+  }
+  if (ret < 0) {
+    QPB_ERR_SLICE( L );
+  }
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// view:find( text [, init] ) a plain search ( no patterns ), returns the first and last positions, or nil
+int QpbView::find( lua_State* L ) const
+{
+  size_t len=0;
+  const char* text= luaL_checklstring( L, QPB_VIEW_FIND_TEXT, &len );
+  lua_Integer init= luaL_optinteger( L, QPB_VIEW_FIND_INIT, 1 );
+  check( L );
+  int ret=1;
+  std::string scratch;
+  const std::string& s= bytes( &scratch );
+  const lua_Integer size= (lua_Integer) s.size();
+  if (init < 0) {
+    init= std::max<lua_Integer>( size + init + 1, 1 );
+  }
+  else if (init==0) {
+    init= 1;
+  }
+  const size_t at= init > size+1 ? std::string::npos : s.find( text, (size_t) init - 1, len );
+  if (at==std::string::npos) {
+    lua_pushnil( L );
+  }
+  else {
+    lua_pushinteger( L, (lua_Integer) at + 1 );
+    lua_pushinteger( L, (lua_Integer) (at + len) );
+    ret= 2;
+  }
+  return ret;
+}
+
+//---------------------------------------------------------------------------
+// view:write( fd or file ) straight from the message's storage
+int QpbView::write( lua_State* L ) const
+{
+  FILE* file= 0;
+  int fd= -1;
+  if (lua_type( L, QPB_VIEW_WRITE_FILE )==LUA_TNUMBER) {
+    fd= (int) lua_tointeger( L, QPB_VIEW_WRITE_FILE );
+  }
+  else {
+#if LUA_VERSION_NUM >= 502
+    luaL_Stream* stream= (luaL_Stream*) luaL_checkudata( L, QPB_VIEW_WRITE_FILE, LUA_FILEHANDLE );
+    file= stream->closef ? stream->f : 0;
+#else
+    // a closed file's FILE* is cleared
+    file= *(FILE**) luaL_checkudata( L, QPB_VIEW_WRITE_FILE, LUA_FILEHANDLE );
+#endif
+    if (!file) {
+      QPB_ERR_STREAM_CLOSED( L );
+    }
+  }
+  check( L );
+  int error= 0;
+  {
+    std::string scratch;
+    const std::string& s= bytes( &scratch );
+    const char* data= s.data();
+    size_t left= s.size();
+    if (file) {
+      if (fwrite( data, 1, left, file )!=left) {
+        error= errno;
+      }
+    }
+    else {
+      while (left && !error) {
+        // a socket can take less than it was given
+        const int chunk= (int) std::min<size_t>( left, 1<<30 );
+        const int n= (int) qpb_write( fd, data, chunk );
+        if (n > 0) {
+          data+= n;
+          left-= n;
+        }
+        else if (n==0 || errno!=EINTR) {
+          error= n ? errno : EIO;
+        }
+      }
+    }
+  }
+  if (error) {
+    QPB_ERR_WRITE( L, strerror( error ) );
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// builder:append( text, ... ) adds each text to the end
+int QpbView::append( lua_State* L )
+{
+  const int top= lua_gettop( L );
+  for (int i= QPB_VIEW_APPEND_TEXT; i<= top; ++i) {
+    luaL_checkstring( L, i );
+  }
+  std::string* s= mutable_bytes( L );
+  for (int i= QPB_VIEW_APPEND_TEXT; i<= top; ++i) {
+    size_t len=0;
+    const char* text= lua_tolstring( L, i, &len );
+    s->append( text, len );
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// builder:reserve( n ) makes room for n bytes in total
+int QpbView::reserve( lua_State* L )
+{
+  const lua_Integer count= luaL_checkinteger( L, QPB_VIEW_RESERVE_COUNT );
+  std::string* s= mutable_bytes( L );
+  if (count > 0) {
+    s->reserve( (size_t) count );
+  }
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// builder:truncate( n ) keeps only the first n bytes
+int QpbView::truncate( lua_State* L )
+{
+  const lua_Integer count= luaL_checkinteger( L, QPB_VIEW_TRUNCATE_SIZE );
+  std::string* s= mutable_bytes( L );
+  if (count < 0 || count > (lua_Integer) s->size()) {
+    QPB_ERR_RANGE( L, _field->name().c_str(), (int) count, (int) s->size() );
+  }
+  s->resize( (size_t) count );
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+// builder:write_at( i, text ) overwrites the bytes from position i on, growing the string if text runs past its end.
+// i can be one past the end, the same as append.
+int QpbView::write_at( lua_State* L )
+{
+  const lua_Integer at= luaL_checkinteger( L, QPB_VIEW_WRITE_AT );
+  size_t len=0;
+  const char* text= luaL_checklstring( L, QPB_VIEW_WRITE_AT_TEXT, &len );
+  std::string* s= mutable_bytes( L );
+  if (at < 1 || at > (lua_Integer) s->size() + 1) {
+    QPB_ERR_RANGE( L, _field->name().c_str(), (int) at, (int) s->size() );
+  }
+  s->replace( (size_t) at - 1, len, text, len );
+  return 0;
+}
+
+//---------------------------------------------------------------------------
+int QpbView::to_string( lua_State* L ) const
+{
+  if (_index < 0) {
+    lua_pushfstring( L, "qpb: %p - view of %s", this, (const char *) _field->full_name().c_str() );
+  }
+  else {
+    lua_pushfstring( L, "qpb: %p - view of %s[%d]", this, (const char *) _field->full_name().c_str(), _index+1 );
+  }
+  return 1;
+}
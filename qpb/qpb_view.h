@@ -0,0 +1,77 @@
+/**
+ * @file qpb_view.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ *
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_VIEW_H__
+#define __QPB_VIEW_H__
+
+#include "qpb_forwards.h"
+#include "qpb_ref.h"
+#include <string>
+
+//---------------------------------------------------------------------------
+/**
+ * POD-like type managed by lua, a read-only view of a string or bytes field ( pb:view_field() ),
+ * or from pb:mutable_field(), a builder that also changes the field's std::string in place.
+ * the bytes stay in the message: each use reads the field's current value without copying it,
+ * and only sub() makes a lua string, of just the part asked for.
+ * like an array, the view keeps the root of its message's tree alive.
+ */
+struct QpbView
+{
+  typedef google::protobuf::Message Message;
+  typedef google::protobuf::FieldDescriptor FieldDescriptor;
+
+  /**
+   * @param index the element of a repeated field, or -1
+   */
+  static int PushView( lua_State* L, const Message& msg, const FieldDescriptor* field, int index ) {
+    return PushView( L, QpbRef(msg), field, index );
+  }
+  static int PushView( lua_State* L, Message* msg, const FieldDescriptor* field, int index ) {
+    return PushView( L, QpbRef(msg), field, index );
+  }
+  static QpbView* GetUserData( lua_State *, int idx= QPB_VIEW_SELF );
+
+  int size( lua_State* ) const;
+  int sub( lua_State* ) const;
+  int byte( lua_State* ) const;
+  int find( lua_State* ) const;
+  int write( lua_State* ) const;
+  int to_string( lua_State* ) const;
+
+  int append( lua_State* );
+  int reserve( lua_State* );
+  int truncate( lua_State* );
+  int write_at( lua_State* );
+
+  /**
+   * the cache key of the view's message ( see QpbMessage::Invalidate )
+   */
+  const void* Key() const {
+    return _msg.Key();
+  }
+
+private:
+  static int PushView( lua_State*, const QpbRef&, const FieldDescriptor* field, int index );
+  // raises an error if a repeated field shrank past the view's element
+  void check( lua_State* ) const;
+  // the field's bytes; only a field that isn't stored as a std::string gets copied into scratch
+  const std::string& bytes( std::string* scratch ) const;
+  // the field's own std::string; raises an error for a read-only view
+  std::string* mutable_bytes( lua_State* );
+
+  QpbView(); // unimplemented
+  QpbRef _msg;
+  const FieldDescriptor* _field;
+  int _index;
+};
+
+#endif // #ifndef __QPB_VIEW_H__
@@ -0,0 +1,99 @@
+/**
+ * @file qpb_workers.cpp
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#include "qpb_workers.h"
+
+#include <algorithm>
+
+//---------------------------------------------------------------------------
+QpbWorkers::Job::Job( int count, const Task& task )
+  : _task( task )
+  , _count( count )
+  , _next( 0 )
+  , _active( 0 )
+{
+}
+
+//---------------------------------------------------------------------------
+// take indices until there are none left
+void QpbWorkers::Job::Drain()
+{
+  for (int i= _next++; i< _count; i= _next++) {
+    _task( i );
+  }
+}
+
+//---------------------------------------------------------------------------
+QpbWorkers::QpbWorkers( int threads )
+  : _stop( false )
+{
+  for (int i=0; i< threads; ++i) {
+    _threads.push_back( std::thread( &QpbWorkers::Work, this ) );
+  }
+}
+
+//---------------------------------------------------------------------------
+QpbWorkers::~QpbWorkers()
+{
+  {
+    std::lock_guard<std::mutex> lock( _lock );
+    _stop= true;
+  }
+  _wake.notify_all();
+  for (size_t i=0; i< _threads.size(); ++i) {
+    _threads[i].join();
+  }
+}
+
+//---------------------------------------------------------------------------
+void QpbWorkers::Work()
+{
+  std::unique_lock<std::mutex> lock( _lock );
+  for (;;) {
+    _wake.wait( lock, [this]{ return _stop || !_jobs.empty(); } );
+    if (_stop) {
+      break;
+    }
+    Job* job= _jobs.front();
+    ++job->_active;
+    lock.unlock();
+    job->Drain();
+    lock.lock();
+    // every index has been handed out, so no one else needs to join in
+    std::deque<Job*>::iterator it= std::find( _jobs.begin(), _jobs.end(), job );
+    if (it!= _jobs.end()) {
+      _jobs.erase( it );
+    }
+    if (--job->_active==0) {
+      _finished.notify_all();
+    }
+  }
+}
+
+//---------------------------------------------------------------------------
+void QpbWorkers::Run( int count, const Task& task )
+{
+  Job job( count, task );
+  if (count>1 && !_threads.empty()) {
+    {
+      std::lock_guard<std::mutex> lock( _lock );
+      _jobs.push_back( &job );
+    }
+    _wake.notify_all();
+  }
+  job.Drain();
+  // the calling thread ran out of indices: wait for the ones the workers took.
+  std::unique_lock<std::mutex> lock( _lock );
+  std::deque<Job*>::iterator it= std::find( _jobs.begin(), _jobs.end(), &job );
+  if (it!= _jobs.end()) {
+    _jobs.erase( it );
+  }
+  _finished.wait( lock, [&job]{ return job._active==0; } );
+}
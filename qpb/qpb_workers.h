@@ -0,0 +1,60 @@
+/**
+ * @file qpb_workers.h
+ *
+ * \internal
+ * Copyright (c) 2012, everMany, LLC.
+ * All rights reserved.
+ * 
+ * Code licensed under the "New BSD" (BSD 3-Clause) License
+ * See License.txt for complete information.
+ */
+#pragma once
+#ifndef __QPB_WORKERS_H__
+#define __QPB_WORKERS_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//---------------------------------------------------------------------------
+/**
+ * threads for QPB.decode_batch and QPB.encode_batch.
+ * the work never touches lua: each index is one message to parse or serialize.
+ * shared by every state the Qpb is bound to, so any number of batches can run at once.
+ */
+struct QpbWorkers
+{
+  typedef std::function<void(int)> Task;
+
+  QpbWorkers( int threads );
+  ~QpbWorkers();
+
+  /**
+   * call task( i ) for every i in [0,count), on the workers and on the calling thread;
+   * returns once every call has finished.
+   */
+  void Run( int count, const Task& task );
+
+private:
+  struct Job {
+    Job( int count, const Task& task );
+    void Drain();
+    const Task& _task;
+    const int _count;
+    std::atomic<int> _next; // the next index to hand out
+    int _active;            // workers inside Drain, guarded by QpbWorkers::_lock
+  };
+  void Work();
+
+  std::mutex _lock;
+  std::condition_variable _wake, _finished;
+  std::deque<Job*> _jobs; // jobs with indices still to hand out
+  std::vector<std::thread> _threads;
+  bool _stop;
+};
+
+#endif // #ifndef __QPB_WORKERS_H__